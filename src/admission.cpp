@@ -0,0 +1,123 @@
+#include "include/admission.h"
+#include "include/expiryWheel.h"
+#include "include/headerManager.h"
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <cstdio>
+#include <ctime>
+#include <unordered_map>
+
+using namespace std;
+
+struct AdmittedClient
+{
+    int score; // latest trust score
+    time_t seen;
+};
+
+static const time_t establishedSeconds = 300; // how long a scored client keeps its place
+static const size_t admittedMax = 65536;      // past this new clients just aren't remembered
+
+// no date, server info or body, shedding has to stay cheaper than serving
+static const char cannedUnavailable[] = "HTTP/1.1 503 Service Unavailable\r\nRetry-After: 5\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+
+static unordered_map<IpAddr, AdmittedClient, IpAddrHash> admitted;
+static ExpiryWheel<IpAddr> admittedExpiry;
+static int listenSock = -1;
+static int threshold = 0;
+static unsigned long shedTotal = 0;
+static unsigned long shedSinceReport = 0;
+static time_t lastReport = 0;
+
+void initializeAdmission(int listenFd, int queueThreshold)
+{
+    listenSock = listenFd;
+    threshold = queueThreshold;
+}
+
+// for a listening socket the kernel reports the accept queue in tcpi_unacked and its size in tcpi_sacked
+static bool acceptQueue(unsigned &pending, unsigned &backlog)
+{
+    struct tcp_info info{};
+    socklen_t len = sizeof(info);
+    if (getsockopt(listenSock, IPPROTO_TCP, TCP_INFO, &info, &len) != 0)
+        return false;
+    pending = info.tcpi_unacked;
+    backlog = info.tcpi_sacked;
+    return true;
+}
+
+// only clients that made it through trust scoring are established, being let in once doesn't earn a place
+static void remember(const IpAddr &ip, int score, time_t now)
+{
+    auto it = admitted.find(ip);
+    if (it == admitted.end())
+    {
+        if (admitted.size() >= admittedMax)
+            return;
+        it = admitted.emplace(ip, AdmittedClient{score, now}).first;
+        admittedExpiry.schedule(ip, now + establishedSeconds);
+    }
+    it->second.score = score;
+    it->second.seen = now;
+}
+
+bool shedConnection(int client_fd, const IpAddr &ip)
+{
+    if (threshold <= 0)
+        return false;
+    time_t now = time(nullptr);
+    unsigned pending, backlog;
+    if (!acceptQueue(pending, backlog) || pending < (unsigned)threshold)
+        return false;
+
+    // at the threshold anyone established gets in, by a full backlog it takes a perfect score
+    int required = 1;
+    if (backlog > (unsigned)threshold)
+        required += (int)(99ULL * (pending - threshold) / (backlog - threshold));
+    auto it = admitted.find(ip);
+    int score = it == admitted.end() ? 0 : it->second.score;
+    if (score >= required)
+        return false;
+
+    sendCannedAndClose(client_fd, cannedUnavailable, sizeof(cannedUnavailable) - 1);
+    shedTotal++;
+    shedSinceReport++;
+    if (now != lastReport)
+    {
+        printf("Overloaded (%u of %u queued), shed %lu connections below trust %d\n", pending, backlog, shedSinceReport, required);
+        shedSinceReport = 0;
+        lastReport = now;
+    }
+    return true;
+}
+
+void noteAdmissionScore(const IpAddr &ip, int score)
+{
+    if (threshold > 0)
+        remember(ip, score, time(nullptr));
+}
+
+void expireAdmission()
+{
+    time_t now = time(nullptr);
+    admittedExpiry.advance(now, [now](const IpAddr &ip) -> time_t
+                           {
+                               auto it = admitted.find(ip);
+                               if (it == admitted.end())
+                                   return 0;
+                               if ((now - it->second.seen) < establishedSeconds)
+                                   return it->second.seen + establishedSeconds;
+                               admitted.erase(it);
+                               return 0; });
+}
+
+string admissionJson()
+{
+    unsigned pending = 0, backlog = 0;
+    if (listenSock != -1)
+        acceptQueue(pending, backlog);
+    return "{\"queue\":" + to_string(pending) + ",\"backlog\":" + to_string(backlog) +
+           ",\"threshold\":" + to_string(threshold) + ",\"shed\":" + to_string(shedTotal) + "}";
+}
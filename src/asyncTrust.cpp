@@ -0,0 +1,132 @@
+#include "include/asyncTrust.h"
+#include "include/evaluateTrust.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+using namespace std;
+
+struct TrustJob
+{
+    IpAddr ip;
+    string headers;
+    int notFoundPerMinute;
+    int timeoutsPerMinute;
+};
+
+static const size_t maxQueuedJobs = 16384; // about 64 MB of headers at worst
+
+static int resultFd = -1;
+static bool honeypotPaths = false;
+static thread worker;
+static mutex queueLock; // guards everything below it
+static condition_variable queueReady;
+static vector<TrustJob> jobs;
+static vector<TrustResult> results;
+static bool stopping = false;
+static atomic<bool> reloadPending{false};
+
+static void runWorker()
+{
+    vector<TrustJob> batch;
+    vector<TrustResult> scored;
+    for (;;)
+    {
+        {
+            unique_lock<mutex> lock(queueLock);
+            // wake at least once a second so the trust windows keep expiring while idle
+            queueReady.wait_for(lock, chrono::seconds(1), []
+                                { return !jobs.empty() || stopping; });
+            if (stopping && jobs.empty())
+                return;
+            batch.swap(jobs);
+        }
+
+        if (reloadPending.exchange(false))
+            reloadTrustRules();
+        expireTrustWindows();
+
+        for (auto &job : batch)
+        {
+            int score = evaluateTrust(job.ip, job.headers, honeypotPaths, job.notFoundPerMinute, job.timeoutsPerMinute);
+            scored.push_back(TrustResult{job.ip, score});
+        }
+        batch.clear();
+
+        if (scored.empty())
+            continue;
+        {
+            lock_guard<mutex> lock(queueLock);
+            results.insert(results.end(), scored.begin(), scored.end());
+        }
+        scored.clear();
+        uint64_t one = 1;
+        if (write(resultFd, &one, sizeof(one)) < 0)
+            perror("eventfd write"); // only fails if the counter overflows, main is draining it anyway
+    }
+}
+
+void startAsyncTrust(bool checkHoneypotPaths)
+{
+    resultFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (resultFd == -1)
+    {
+        perror("eventfd");
+        printf("Async trust evaluation disabled.\n");
+        return;
+    }
+    honeypotPaths = checkHoneypotPaths;
+    worker = thread(runWorker);
+}
+
+void stopAsyncTrust()
+{
+    if (!worker.joinable())
+        return;
+    {
+        lock_guard<mutex> lock(queueLock);
+        stopping = true;
+    }
+    queueReady.notify_one();
+    worker.join();
+}
+
+int asyncTrustFd()
+{
+    return resultFd;
+}
+
+void queueTrustEvaluation(const IpAddr &ip, string headers, int notFoundPerMinute, int timeoutsPerMinute)
+{
+    {
+        lock_guard<mutex> lock(queueLock);
+        if (jobs.size() >= maxQueuedJobs)
+            return;
+        jobs.push_back(TrustJob{ip, move(headers), notFoundPerMinute, timeoutsPerMinute});
+    }
+    queueReady.notify_one();
+}
+
+void requestAsyncTrustReload()
+{
+    reloadPending = true;
+    queueReady.notify_one();
+}
+
+vector<TrustResult> takeTrustResults()
+{
+    uint64_t count;
+    if (read(resultFd, &count, sizeof(count)) < 0)
+    {
+        // EAGAIN, already drained
+    }
+    vector<TrustResult> taken;
+    lock_guard<mutex> lock(queueLock);
+    taken.swap(results);
+    return taken;
+}
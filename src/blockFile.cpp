@@ -0,0 +1,200 @@
+#include "include/blockFile.h"
+#include "include/ipAddr.h"
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+using namespace std;
+
+static const char blockFileMagic[8] = {'F', 'C', 'T', 'B', 'L', 'O', 'C', 'K'};
+static const uint32_t blockFileVersion = 1;
+static const uint32_t blockFileSlots = 1 << 21; // 2M slots, 64 MiB but sparse, only touched pages use disk
+
+struct BlockFileHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t slotCount;
+    uint64_t checksum; // over the fields above
+    uint8_t reserved[40];
+};
+
+enum : uint32_t
+{
+    slotEmpty = 0,
+    slotUsed = 1,
+    slotDeleted = 2 // tombstone, keeps probe chains intact
+};
+
+struct BlockFileSlot
+{
+    uint8_t addr[16]; // IPv6, IPv4 stored as ::ffff:a.b.c.d
+    int64_t blockedUntil;
+    uint32_t state;
+    uint32_t checksum; // over addr, blockedUntil and state, torn or corrupted slots read as deleted
+};
+
+static_assert(sizeof(BlockFileHeader) == 64 && sizeof(BlockFileSlot) == 32, "blocklist.dat layout is fixed");
+
+static BlockFileHeader *blockFileHeader = nullptr;
+static BlockFileSlot *blockFileTable = nullptr;
+static int blockFileFd = -1;
+
+// several processes (SO_REUSEPORT) can share the file, writers take an exclusive flock for the few stores a
+// change takes. readers don't lock, a slot torn by a concurrent write fails its checksum and reads as not blocked
+struct BlockFileLock
+{
+    BlockFileLock() { flock(blockFileFd, LOCK_EX); }
+    ~BlockFileLock() { flock(blockFileFd, LOCK_UN); }
+};
+
+static uint64_t fnv1a(const void *data, size_t len, uint64_t h = 1469598103934665603ULL)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    for (size_t i = 0; i < len; i++)
+    {
+        h ^= p[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static uint64_t headerChecksum(const BlockFileHeader &h)
+{
+    return fnv1a(&h, offsetof(BlockFileHeader, checksum));
+}
+
+static uint32_t slotChecksum(const BlockFileSlot &s)
+{
+    uint64_t h = fnv1a(s.addr, sizeof(s.addr));
+    h = fnv1a(&s.blockedUntil, sizeof(s.blockedUntil), h);
+    h = fnv1a(&s.state, sizeof(s.state), h);
+    return (uint32_t)(h ^ (h >> 32));
+}
+
+static size_t slotIndex(const uint8_t addr[16])
+{
+    uint64_t h = fnv1a(addr, 16);
+    return (size_t)(h ^ (h >> 29)) & (blockFileSlots - 1);
+}
+
+static bool slotIntact(const BlockFileSlot &s)
+{
+    return s.state == slotEmpty || s.checksum == slotChecksum(s);
+}
+
+// empties the whole table, punching a hole keeps the file sparse where memset would allocate all of it
+static void clearTable()
+{
+    size_t bytes = (size_t)blockFileSlots * sizeof(BlockFileSlot);
+    if (fallocate(blockFileFd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, sizeof(BlockFileHeader), (off_t)bytes) != 0)
+        memset(blockFileTable, 0, bytes);
+}
+
+bool openBlockFile(const string &path)
+{
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd == -1)
+    {
+        perror(path.c_str());
+        return false;
+    }
+    flock(fd, LOCK_EX); // another process may be creating or resetting it right now
+    size_t size = sizeof(BlockFileHeader) + (size_t)blockFileSlots * sizeof(BlockFileSlot);
+    struct stat st{};
+    bool fresh = fstat(fd, &st) != 0 || (size_t)st.st_size != size;
+    if (fresh && (ftruncate(fd, 0) != 0 || ftruncate(fd, (off_t)size) != 0))
+    {
+        perror("ftruncate");
+        close(fd);
+        return false;
+    }
+    void *map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+    {
+        perror("mmap");
+        close(fd);
+        return false;
+    }
+    blockFileFd = fd;
+    blockFileHeader = (BlockFileHeader *)map;
+    blockFileTable = (BlockFileSlot *)((char *)map + sizeof(BlockFileHeader));
+
+    BlockFileHeader *h = blockFileHeader;
+    if (!fresh && (memcmp(h->magic, blockFileMagic, sizeof(blockFileMagic)) != 0 || h->version != blockFileVersion ||
+                   h->slotCount != blockFileSlots || h->checksum != headerChecksum(*h)))
+    {
+        printf("%s is from another version or damaged, starting with an empty blocklist.\n", path.c_str());
+        fresh = true;
+        clearTable();
+    }
+    if (fresh)
+    {
+        memset(h, 0, sizeof(*h));
+        memcpy(h->magic, blockFileMagic, sizeof(blockFileMagic));
+        h->version = blockFileVersion;
+        h->slotCount = blockFileSlots;
+        h->checksum = headerChecksum(*h);
+    }
+    flock(fd, LOCK_UN);
+    return true;
+}
+
+// finds addr's slot, or with forInsert the first reusable slot of its probe chain, nullptr if not found/full
+static BlockFileSlot *findSlot(const uint8_t addr[16], bool forInsert)
+{
+    BlockFileSlot *reusable = nullptr;
+    time_t now = time(nullptr);
+    size_t idx = slotIndex(addr);
+    for (uint32_t probe = 0; probe < blockFileSlots; probe++, idx = (idx + 1) & (blockFileSlots - 1))
+    {
+        BlockFileSlot &s = blockFileTable[idx];
+        if (s.state == slotEmpty)
+            return forInsert ? (reusable ? reusable : &s) : nullptr;
+        if (s.state == slotUsed && memcmp(s.addr, addr, 16) == 0 && slotIntact(s))
+            return &s;
+        if (!reusable && (s.state == slotDeleted || s.blockedUntil <= now || !slotIntact(s)))
+            reusable = &s; // expired entries are as good as deleted
+    }
+    return forInsert ? reusable : nullptr;
+}
+
+time_t persistedBlockedUntil(const IpAddr &ip, time_t now)
+{
+    if (!blockFileTable)
+        return 0;
+    BlockFileSlot *s = findSlot(ip.bytes, false);
+    return s && s->blockedUntil > now ? (time_t)s->blockedUntil : 0;
+}
+
+void persistBlock(const IpAddr &ip, time_t blockedUntil)
+{
+    if (!blockFileTable)
+        return;
+    BlockFileLock lock;
+    BlockFileSlot *s = findSlot(ip.bytes, true);
+    if (!s)
+        return; // full of live blocks, it'll just not survive a restart
+    memcpy(s->addr, ip.bytes, 16);
+    s->blockedUntil = blockedUntil;
+    s->state = slotUsed;
+    s->checksum = slotChecksum(*s);
+}
+
+void forgetPersistedBlock(const IpAddr &ip)
+{
+    if (!blockFileTable)
+        return;
+    BlockFileLock lock;
+    BlockFileSlot *s = findSlot(ip.bytes, false);
+    if (!s)
+        return;
+    s->state = slotDeleted;
+    s->checksum = slotChecksum(*s);
+}
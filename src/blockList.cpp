@@ -0,0 +1,176 @@
+#include "include/blockList.h"
+#include "include/logRequest.h"
+#include "include/expiryWheel.h"
+#include "include/blockFile.h"
+#include "include/sharedState.h"
+#include "include/underAttack.h"
+#include "include/headerManager.h"
+#include <sys/socket.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstring>
+#include <unordered_map>
+
+using namespace std;
+
+enum class BlockedAction
+{
+    Forbidden, // minimal canned 403
+    Reset,     // SO_LINGER 0, the client sees a RST
+    Close      // just close
+};
+
+static unordered_map<IpAddr, BlockedClient, IpAddrHash> blockedClients;
+static ExpiryWheel<IpAddr> blockExpiry;
+static BlockedAction blockedAction = BlockedAction::Forbidden;
+static bool blockLogging = false;
+static int blockLogMaxLines = 0;
+
+static const unsigned long blockedLogEvery = 100; // log the first hit of a block, then one in this many
+
+// no date, server info or body, blocked clients get nothing worth parsing
+static const char cannedForbidden[] = "HTTP/1.1 403 Forbidden\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+
+void initializeBlockList(const string &action, bool toggleLogging, int logMaxLines)
+{
+    blockLogging = toggleLogging;
+    blockLogMaxLines = logMaxLines;
+    if (action == "403" || action.empty())
+        blockedAction = BlockedAction::Forbidden;
+    else if (action == "rst")
+        blockedAction = BlockedAction::Reset;
+    else if (action == "close")
+        blockedAction = BlockedAction::Close;
+    else
+        printf("Unknown BLOCKED_ACTION %s, using 403.\n", action.c_str());
+}
+
+void blockClient(const IpAddr &ip, time_t blockedUntil)
+{
+    auto it = blockedClients.find(ip);
+    if (it == blockedClients.end())
+        blockExpiry.schedule(ip, blockedUntil);
+    else if (blockedUntil < it->second.blockedUntil)
+        blockExpiry.schedule(ip, blockedUntil); // shortened, the old wheel entry would be too late
+    blockedClients[ip] = BlockedClient{blockedUntil, 0};
+    persistBlock(ip, blockedUntil);
+    sharedBlock(ip, blockedUntil);
+}
+
+void loadPersistedBlocks(const string &path)
+{
+    if (!openBlockFile(path))
+    {
+        printf("Couldn't open %s, blocks won't survive a restart.\n", path.c_str());
+        return;
+    }
+    // nothing to load, blocks in the file are picked up as their addresses show up again
+}
+
+bool isClientBlocked(const IpAddr &ip)
+{
+    auto it = blockedClients.find(ip);
+    return it != blockedClients.end() && it->second.blockedUntil > time(nullptr);
+}
+
+BlockedClient *hitBlockedClient(const IpAddr &ip)
+{
+    auto it = blockedClients.find(ip);
+    // the shared table has the latest word on blocks, another process may have set, shortened or lifted one
+    time_t sharedUntil = sharedStateActive() ? sharedBlockedUntil(ip) : -1;
+    if (it == blockedClients.end())
+    {
+        // maybe another process (or this one before a restart) blocked it, track it here too for hit counting/logging
+        time_t until = sharedUntil >= 0 ? sharedUntil : persistedBlockedUntil(ip, time(nullptr));
+        if (until <= 0)
+            return nullptr;
+        it = blockedClients.emplace(ip, BlockedClient{until, 0}).first;
+        blockExpiry.schedule(ip, until);
+    }
+    else if (sharedUntil >= 0 && sharedUntil != it->second.blockedUntil)
+    {
+        if (sharedUntil != 0 && sharedUntil < it->second.blockedUntil)
+            blockExpiry.schedule(ip, sharedUntil);
+        it->second.blockedUntil = sharedUntil; // 0 or already past drops it below
+    }
+    if (it->second.blockedUntil <= time(nullptr))
+    {
+        forgetPersistedBlock(ip);
+        blockedClients.erase(it);
+        return nullptr;
+    }
+    it->second.hits++;
+    return &it->second;
+}
+
+static void turnAway(int client_fd)
+{
+    noteGlobalBlock();
+    switch (blockedAction)
+    {
+    case BlockedAction::Forbidden:
+        sendCannedAndClose(client_fd, cannedForbidden, sizeof(cannedForbidden) - 1);
+        return;
+    case BlockedAction::Reset:
+    {
+        struct linger lin{1, 0};
+        setsockopt(client_fd, SOL_SOCKET, SO_LINGER, &lin, sizeof(lin));
+        break;
+    }
+    case BlockedAction::Close:
+        break;
+    }
+    close(client_fd);
+}
+
+void rejectBlockedClient(int client_fd, const IpAddr &ip, const BlockedClient &entry)
+{
+    turnAway(client_fd);
+
+    // sampled, a flood from one address shouldn't turn into a flood of log lines
+    if (entry.hits != 1 && entry.hits % blockedLogEvery != 0)
+        return;
+    time_t now = time(nullptr);
+    char timebuf[32], untilbuf[32];
+    struct tm tm;
+    strftime(timebuf, sizeof(timebuf), "%d-%m-%Y %H:%M:%S", localtime_r(&now, &tm));
+    strftime(untilbuf, sizeof(untilbuf), "%d-%m-%Y %H:%M:%S", localtime_r(&entry.blockedUntil, &tm));
+    char blockedBuffer[256];
+    snprintf(blockedBuffer, sizeof(blockedBuffer), "[%s] Blocked %s due to previous low trust score until %s (%lu hits)",
+             timebuf, ipToString(ip).c_str(), untilbuf, entry.hits);
+    logRequest(blockedBuffer, blockLogging, blockLogMaxLines);
+}
+
+void expireBlockedClients()
+{
+    time_t now = time(nullptr);
+    blockExpiry.advance(now, [now](const IpAddr &ip) -> time_t
+                        {
+                            auto it = blockedClients.find(ip);
+                            if (it == blockedClients.end())
+                                return 0; // already gone (expired on lookup)
+                            if (it->second.blockedUntil > now)
+                                return it->second.blockedUntil; // re-blocked since, check again later
+                            forgetPersistedBlock(ip);
+                            blockedClients.erase(it);
+                            return 0; });
+}
+
+void rejectDeniedClient(int client_fd, const IpAddr &ip)
+{
+    turnAway(client_fd);
+
+    // no per-ip state for denied networks, sample across all of them instead
+    static unsigned long deniedHits = 0;
+    deniedHits++;
+    if (deniedHits != 1 && deniedHits % blockedLogEvery != 0)
+        return;
+    time_t now = time(nullptr);
+    char timebuf[32];
+    struct tm tm;
+    strftime(timebuf, sizeof(timebuf), "%d-%m-%Y %H:%M:%S", localtime_r(&now, &tm));
+    char deniedBuffer[256];
+    snprintf(deniedBuffer, sizeof(deniedBuffer), "[%s] Denied %s, address is in DENY_CIDRS (%lu denied connections)",
+             timebuf, ipToString(ip).c_str(), deniedHits);
+    logRequest(deniedBuffer, blockLogging, blockLogMaxLines);
+}
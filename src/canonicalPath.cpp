@@ -0,0 +1,113 @@
+#include "include/canonicalPath.h"
+#include <cstring>
+#include <cctype>
+
+using namespace std;
+
+static int hexValue(unsigned char h)
+{
+    if (h >= '0' && h <= '9')
+        return h - '0';
+    if (h >= 'a' && h <= 'f')
+        return 10 + (h - 'a');
+    if (h >= 'A' && h <= 'F')
+        return 10 + (h - 'A');
+    return -1;
+}
+
+// closes the segment that started at segStart, returns false if .. climbs above the root
+static bool finishSegment(string &key, size_t segStart, bool &dirSegment)
+{
+    size_t len = key.size() - segStart;
+    const char *seg = key.data() + segStart;
+    size_t joinStart = segStart > 0 ? segStart - 1 : 0; // includes the '/' joining it to the previous segment
+
+    dirSegment = false;
+    if (len == 0 || (len == 1 && seg[0] == '.'))
+    {
+        key.resize(joinStart); // "//" and "/./"
+        dirSegment = true;
+        return true;
+    }
+    if (len == 2 && seg[0] == '.' && seg[1] == '.')
+    {
+        if (segStart == 0)
+            return false; // nothing left to go up from
+        key.resize(joinStart);
+        size_t prev = key.rfind('/');
+        key.resize(prev == string::npos ? 0 : prev);
+        dirSegment = true;
+    }
+    return true;
+}
+
+bool canonicalizePath(const char *target, CanonicalPath &out)
+{
+    // raw control characters never belong in a request target, and would end up in Location headers
+    for (const char *p = target; *p; ++p)
+        if ((unsigned char)*p < 0x20 || *p == 0x7f)
+            return false;
+
+    size_t pathLen = strcspn(target, "?#");
+    out.query.clear();
+    if (target[pathLen] == '?')
+    {
+        const char *q = target + pathLen + 1;
+        out.query.assign(q, strcspn(q, "#"));
+    }
+
+    string &key = out.key;
+    key.clear();
+    key.reserve(pathLen);
+    bool hasPercent = memchr(target, '%', pathLen) != nullptr; // most paths aren't encoded, skip the decode checks for them
+    bool dirSegment = false;
+    size_t segStart = 0;
+
+    for (size_t i = 0; i < pathLen; ++i)
+    {
+        unsigned char c = (unsigned char)target[i];
+        if (hasPercent && c == '%')
+        {
+            int hi = i + 2 < pathLen ? hexValue((unsigned char)target[i + 1]) : -1;
+            int lo = hi >= 0 ? hexValue((unsigned char)target[i + 2]) : -1;
+            if (lo < 0)
+                return false; // invalid sequence
+            c = (unsigned char)((hi << 4) | lo);
+            if (c == 0)
+                return false; // would cut every C string API short
+            i += 2;
+        }
+        if (c != '/')
+        {
+            key.push_back((char)c);
+            continue;
+        }
+        if (!finishSegment(key, segStart, dirSegment))
+            return false;
+        if (!key.empty())
+            key.push_back('/');
+        segStart = key.size();
+    }
+    if (!finishSegment(key, segStart, dirSegment))
+        return false;
+
+    // ending in a separator, "." or ".." means a directory was asked for
+    out.trailingSlash = key.empty() || dirSegment;
+    return true;
+}
+
+void appendEncodedPath(string &out, const string &key)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    for (unsigned char c : key)
+    {
+        if (isalnum(c) || c == '/' || c == '-' || c == '_' || c == '.' || c == '~')
+            out.push_back((char)c);
+        else
+        {
+            out.push_back('%');
+            out.push_back(hex[c >> 4]);
+            out.push_back(hex[c & 15]);
+        }
+    }
+}
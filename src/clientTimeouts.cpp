@@ -0,0 +1,151 @@
+#include "include/clientTimeouts.h"
+#include "include/expiryWheel.h"
+#include "include/sharedState.h"
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <climits>
+#include <unordered_map>
+
+using namespace std;
+
+struct PerMinuteTimeouts
+{
+    int count;
+    time_t timestamp; // last timeout, the window runs 60s past it
+};
+
+static unordered_map<IpAddr, PerMinuteTimeouts, IpAddrHash> timeoutsPerMinute;
+static ExpiryWheel<IpAddr> timeoutsExpiry;
+
+static int headerTimeoutMs = 0;
+static int idleTimeoutMs = 0;
+static int minBytesPerSecond = 0;
+
+// the one connection being served, faucet handles them one at a time so plain deadlines do
+static int64_t headerDeadline = 0; // monotonic ms, 0 for none
+static int64_t bodyStart = 0;
+static IpAddr deadlineClient;
+
+static int64_t nowMs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// seconds from the config to ms, in 64 bits and capped so a huge value means "very long" instead of wrapping
+static int secondsToMs(int seconds)
+{
+    return (int)min<int64_t>((int64_t)max(seconds, 0) * 1000, INT_MAX);
+}
+
+void initializeClientTimeouts(int headerTimeout, int idleTimeout, int minSendRate)
+{
+    headerTimeoutMs = secondsToMs(headerTimeout);
+    idleTimeoutMs = secondsToMs(idleTimeout);
+    minBytesPerSecond = minSendRate;
+}
+
+void startClientDeadlines(int client_fd)
+{
+    headerDeadline = headerTimeoutMs > 0 ? nowMs() + headerTimeoutMs : 0;
+    if (idleTimeoutMs > 0)
+    {
+        // blocking sends (sendfile included) give up with EAGAIN after this long without progress
+        struct timeval tv{idleTimeoutMs / 1000, (idleTimeoutMs % 1000) * 1000};
+        setsockopt(client_fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    }
+}
+
+bool waitForRequestData(int client_fd)
+{
+    int waitMs = idleTimeoutMs > 0 ? idleTimeoutMs : -1;
+    if (headerDeadline)
+    {
+        int64_t left = headerDeadline - nowMs();
+        if (left <= 0)
+            return false;
+        waitMs = waitMs < 0 ? (int)left : (int)min<int64_t>(waitMs, left);
+    }
+    struct pollfd pfd{client_fd, POLLIN, 0};
+    int ready;
+    do
+        ready = poll(&pfd, 1, waitMs); // a signal restarts the wait, it's short either way
+    while (ready < 0 && errno == EINTR);
+    return ready != 0; // errors and hangups show up in the recv() that follows
+}
+
+void setDeadlineClient(const IpAddr &ip)
+{
+    deadlineClient = ip;
+}
+
+void startBodyDeadline()
+{
+    bodyStart = nowMs();
+}
+
+bool bodyKeepsUp(off_t bytesSent)
+{
+    if (minBytesPerSecond <= 0)
+        return true;
+    int64_t elapsed = nowMs() - bodyStart;
+    int64_t grace = idleTimeoutMs > 0 ? idleTimeoutMs : 5000;
+    if (elapsed <= grace)
+        return true;
+    // average over the transfer, a reader can pause as long as it caught up overall
+    if ((int64_t)bytesSent * 1000 >= (int64_t)minBytesPerSecond * (elapsed - grace))
+        return true;
+    noteClientTimeout(deadlineClient);
+    return false;
+}
+
+void noteStalledSend()
+{
+    noteClientTimeout(deadlineClient);
+}
+
+void noteClientTimeout(const IpAddr &ip)
+{
+    time_t now = time(nullptr);
+    if (sharedStateActive())
+        sharedCountWindow(ip, SharedTimeouts, 60, now);
+    auto it = timeoutsPerMinute.find(ip);
+    if (it != timeoutsPerMinute.end() && (now - it->second.timestamp) <= 60)
+    {
+        it->second.count++;
+        it->second.timestamp = now;
+        return;
+    }
+    if (it == timeoutsPerMinute.end())
+        timeoutsExpiry.schedule(ip, now + 61);
+    timeoutsPerMinute[ip] = {1, now};
+}
+
+int getTimeoutPMcount(const IpAddr &ip)
+{
+    time_t now = time(nullptr);
+    int shared = sharedStateActive() ? sharedWindowCount(ip, SharedTimeouts, 60, now) : -1;
+    auto it = timeoutsPerMinute.find(ip);
+    if (it == timeoutsPerMinute.end() || (now - it->second.timestamp) > 60)
+        return max(shared, 0);
+    return max(shared, it->second.count);
+}
+
+void expireClientTimeouts()
+{
+    time_t now = time(nullptr);
+    timeoutsExpiry.advance(now, [now](const IpAddr &ip) -> time_t
+                           {
+                               auto it = timeoutsPerMinute.find(ip);
+                               if (it == timeoutsPerMinute.end())
+                                   return 0;
+                               if ((now - it->second.timestamp) <= 60)
+                                   return it->second.timestamp + 61; // timed out again since
+                               timeoutsPerMinute.erase(it);
+                               return 0; });
+}
@@ -0,0 +1,313 @@
+#include "include/contentTypes.h"
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+
+using namespace std;
+
+static const char *defaultContentType = "application/octet-stream";
+
+static constexpr size_t maxExtLen = 15; // longer extensions are treated as unknown
+
+struct MimeEntry
+{
+    const char *ext; // lowercase, without the dot
+    const char *type;
+};
+
+static constexpr MimeEntry builtinMimeTypes[] = {
+    {"html", "text/html; charset=utf-8"},
+    {"htm", "text/html; charset=utf-8"},
+    {"css", "text/css; charset=utf-8"},
+    {"js", "text/javascript; charset=utf-8"},
+    {"mjs", "text/javascript; charset=utf-8"},
+    {"json", "application/json"},
+    {"map", "application/json"},
+    {"webmanifest", "application/manifest+json"},
+    {"xml", "application/xml"},
+    {"wasm", "application/wasm"},
+    {"txt", "text/plain; charset=utf-8"},
+    {"log", "text/plain; charset=utf-8"},
+    {"md", "text/markdown; charset=utf-8"},
+    {"csv", "text/csv; charset=utf-8"},
+    {"png", "image/png"},
+    {"apng", "image/apng"},
+    {"jpg", "image/jpeg"},
+    {"jpeg", "image/jpeg"},
+    {"gif", "image/gif"},
+    {"svg", "image/svg+xml"},
+    {"ico", "image/x-icon"},
+    {"webp", "image/webp"},
+    {"avif", "image/avif"},
+    {"bmp", "image/bmp"},
+    {"woff", "font/woff"},
+    {"woff2", "font/woff2"},
+    {"ttf", "font/ttf"},
+    {"otf", "font/otf"},
+    {"pdf", "application/pdf"},
+    {"zip", "application/zip"},
+    {"gz", "application/gzip"},
+    {"tar", "application/x-tar"},
+    {"mp3", "audio/mpeg"},
+    {"ogg", "audio/ogg"},
+    {"wav", "audio/wav"},
+    {"flac", "audio/flac"},
+    {"m4a", "audio/mp4"},
+    {"mp4", "video/mp4"},
+    {"webm", "video/webm"},
+    {"mkv", "video/x-matroska"},
+    {"mov", "video/quicktime"},
+    {"m3u8", "application/vnd.apple.mpegurl"},
+    {"ts", "video/mp2t"},
+};
+
+static constexpr size_t builtinCount = sizeof(builtinMimeTypes) / sizeof(builtinMimeTypes[0]);
+static constexpr size_t builtinSlotCount = 256; // power of two, must stay above builtinCount
+
+static constexpr char lowerAscii(char c)
+{
+    return (c >= 'A' && c <= 'Z') ? (char)(c - 'A' + 'a') : c;
+}
+
+static constexpr size_t constLen(const char *s)
+{
+    size_t n = 0;
+    while (s[n])
+        ++n;
+    return n;
+}
+
+// FNV-1a over the lowercased extension, seeded, with a final avalanche so the low bits are usable as a slot
+static constexpr uint32_t mimeHash(const char *s, size_t n, uint32_t seed)
+{
+    uint32_t h = 2166136261u ^ (seed * 0x9e3779b9u);
+    for (size_t i = 0; i < n; ++i)
+    {
+        h ^= (unsigned char)lowerAscii(s[i]);
+        h *= 16777619u;
+    }
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    return h;
+}
+
+// finds a seed under which every built-in extension lands in its own slot
+static constexpr uint32_t findBuiltinSeed()
+{
+    for (uint32_t seed = 1; seed < 100000; ++seed)
+    {
+        bool used[builtinSlotCount] = {};
+        bool collision = false;
+        for (size_t i = 0; i < builtinCount && !collision; ++i)
+        {
+            const char *ext = builtinMimeTypes[i].ext;
+            size_t slot = mimeHash(ext, constLen(ext), seed) & (builtinSlotCount - 1);
+            collision = used[slot];
+            used[slot] = true;
+        }
+        if (!collision)
+            return seed;
+    }
+    return 0;
+}
+
+static constexpr uint32_t builtinSeed = findBuiltinSeed();
+static_assert(builtinSeed != 0, "no perfect hash seed found for the built-in mime table, grow builtinSlotCount");
+
+struct BuiltinSlots
+{
+    uint8_t index[builtinSlotCount]; // entry index + 1, 0 for empty
+};
+
+static constexpr BuiltinSlots buildBuiltinSlots()
+{
+    BuiltinSlots slots{};
+    for (size_t i = 0; i < builtinCount; ++i)
+    {
+        const char *ext = builtinMimeTypes[i].ext;
+        slots.index[mimeHash(ext, constLen(ext), builtinSeed) & (builtinSlotCount - 1)] = (uint8_t)(i + 1);
+    }
+    return slots;
+}
+
+static constexpr BuiltinSlots builtinSlots = buildBuiltinSlots();
+
+// table built from mime.types at startup (hash and displace, so lookups are still one hash and one compare)
+struct LoadedMime
+{
+    string ext;
+    string type;
+};
+
+static vector<LoadedMime> loadedTypes;
+static vector<uint32_t> loadedDisplacement; // per bucket
+static vector<int32_t> loadedSlots;         // index into loadedTypes, -1 for empty
+static uint32_t loadedSlotMask = 0;
+
+static inline uint32_t displacedSlot(uint32_t h, uint32_t d, uint32_t mask)
+{
+    uint32_t x = h + d * 0x9e3779b9u;
+    x ^= x >> 15;
+    x *= 0x2c1b3c6du;
+    x ^= x >> 12;
+    return x & mask;
+}
+
+static bool buildLoadedTable()
+{
+    size_t n = loadedTypes.size();
+    size_t slotCount = 1;
+    while (slotCount < n * 2)
+        slotCount <<= 1;
+    size_t bucketCount = n / 3 + 1;
+
+    vector<uint32_t> hashes(n);
+    vector<vector<uint32_t>> buckets(bucketCount);
+    for (size_t i = 0; i < n; ++i)
+    {
+        hashes[i] = mimeHash(loadedTypes[i].ext.data(), loadedTypes[i].ext.size(), 0);
+        buckets[hashes[i] % bucketCount].push_back((uint32_t)i);
+    }
+
+    // place the biggest buckets first while the table is still empty
+    vector<uint32_t> order(bucketCount);
+    for (size_t b = 0; b < bucketCount; ++b)
+        order[b] = (uint32_t)b;
+    sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b)
+         { return buckets[a].size() > buckets[b].size(); });
+
+    vector<int32_t> slots(slotCount, -1);
+    vector<uint32_t> displacement(bucketCount, 0);
+    uint32_t mask = (uint32_t)(slotCount - 1);
+    vector<uint32_t> picked;
+    for (uint32_t b : order)
+    {
+        if (buckets[b].empty())
+            break;
+        bool placed = false;
+        for (uint32_t d = 0; d < (1u << 20) && !placed; ++d)
+        {
+            picked.clear();
+            placed = true;
+            for (uint32_t key : buckets[b])
+            {
+                uint32_t slot = displacedSlot(hashes[key], d, mask);
+                if (slots[slot] != -1 || find(picked.begin(), picked.end(), slot) != picked.end())
+                {
+                    placed = false;
+                    break;
+                }
+                picked.push_back(slot);
+            }
+            if (placed)
+            {
+                displacement[b] = d;
+                for (size_t k = 0; k < picked.size(); ++k)
+                    slots[picked[k]] = (int32_t)buckets[b][k];
+            }
+        }
+        if (!placed)
+            return false;
+    }
+
+    loadedSlots.swap(slots);
+    loadedDisplacement.swap(displacement);
+    loadedSlotMask = mask;
+    return true;
+}
+
+static bool extEquals(const char *lowerExt, size_t n, const char *candidate)
+{
+    return strncmp(lowerExt, candidate, n) == 0 && candidate[n] == '\0';
+}
+
+const char *guessContentType(const char *path)
+{
+    const char *dot = strrchr(path, '.');
+    if (!dot || strchr(dot, '/'))
+        return defaultContentType;
+
+    const char *ext = dot + 1;
+    size_t n = strlen(ext);
+    if (n == 0 || n > maxExtLen)
+        return defaultContentType;
+    char lower[maxExtLen + 1];
+    for (size_t i = 0; i < n; ++i)
+        lower[i] = lowerAscii(ext[i]);
+    lower[n] = '\0';
+
+    if (!loadedSlots.empty())
+    {
+        uint32_t h = mimeHash(lower, n, 0);
+        uint32_t d = loadedDisplacement[h % loadedDisplacement.size()];
+        int32_t idx = loadedSlots[displacedSlot(h, d, loadedSlotMask)];
+        if (idx >= 0 && loadedTypes[idx].ext.size() == n && memcmp(loadedTypes[idx].ext.data(), lower, n) == 0)
+            return loadedTypes[idx].type.c_str();
+        return defaultContentType;
+    }
+
+    uint8_t idx = builtinSlots.index[mimeHash(lower, n, builtinSeed) & (builtinSlotCount - 1)];
+    if (idx != 0 && extEquals(lower, n, builtinMimeTypes[idx - 1].ext))
+        return builtinMimeTypes[idx - 1].type;
+    return defaultContentType;
+}
+
+void initializeMimeTypes()
+{
+    // same convention as honeypotPaths.txt, an optional file next to the executable
+    FILE *file = fopen("mime.types", "r");
+    if (!file)
+        return; // built-in table only
+
+    // built-in entries first so mime.types can override them
+    unordered_map<string, string> merged;
+    for (const auto &entry : builtinMimeTypes)
+        merged[entry.ext] = entry.type;
+
+    size_t loaded = 0;
+    char line[4096];
+    while (fgets(line, sizeof(line), file))
+    {
+        // format per line: "type ext1 ext2 ...", # starts a comment
+        char *hash = strchr(line, '#');
+        if (hash)
+            *hash = '\0';
+        char *save = nullptr;
+        char *type = strtok_r(line, " \t\r\n", &save);
+        if (!type || !strchr(type, '/'))
+            continue;
+        string fullType = type;
+        if (strncmp(type, "text/", 5) == 0)
+            fullType += "; charset=utf-8";
+        while (char *ext = strtok_r(nullptr, " \t\r\n", &save))
+        {
+            string key = ext;
+            if (key.empty() || key.size() > maxExtLen)
+                continue;
+            for (auto &c : key)
+                c = lowerAscii(c);
+            merged[key] = fullType;
+            loaded++;
+        }
+    }
+    fclose(file);
+
+    loadedTypes.clear();
+    loadedTypes.reserve(merged.size());
+    for (auto &entry : merged)
+        loadedTypes.push_back({entry.first, entry.second});
+
+    if (!buildLoadedTable())
+    {
+        printf("Failed to build lookup table from mime.types, using built-in content types\n");
+        loadedTypes.clear();
+        loadedSlots.clear();
+        return;
+    }
+    printf("Loaded %zu content types from mime.types\n", loaded);
+}
@@ -0,0 +1,72 @@
+#include "include/countMinSketch.h"
+#include <algorithm>
+
+using namespace std;
+
+WindowedCountMin::WindowedCountMin(int windowSeconds, int slices)
+    : sliceSeconds(max(1, windowSeconds / max(1, slices))),
+      sliceCount(max(1, slices)),
+      counters((size_t)sliceCount * depth * width, 0),
+      sliceEpochs(sliceCount, -1)
+{
+}
+
+// one 64-bit hash split into two, row i uses h1 + i * h2 (Kirsch-Mitzenmacher)
+void WindowedCountMin::columns(const IpAddr &ip, uint32_t cols[depth]) const
+{
+    uint64_t h = IpAddrHash()(ip);
+    h ^= h >> 29;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 32;
+    uint32_t h1 = (uint32_t)h, h2 = (uint32_t)(h >> 32) | 1;
+    for (int i = 0; i < depth; i++)
+        cols[i] = (h1 + (uint32_t)i * h2) & (width - 1);
+}
+
+uint32_t WindowedCountMin::add(const IpAddr &ip, time_t now)
+{
+    time_t epoch = now / sliceSeconds;
+    int s = (int)(epoch % sliceCount);
+    uint16_t *cur = slice(s);
+    if (sliceEpochs[s] != epoch)
+    {
+        fill(cur, cur + depth * width, 0); // aged out, reuse it for this slice of time
+        sliceEpochs[s] = epoch;
+    }
+
+    // conservative update, only the rows at the minimum grow, which keeps collisions from compounding
+    uint32_t cols[depth];
+    columns(ip, cols);
+    uint16_t low = UINT16_MAX;
+    for (int i = 0; i < depth; i++)
+        low = min(low, cur[i * width + cols[i]]);
+    if (low < UINT16_MAX)
+    {
+        for (int i = 0; i < depth; i++)
+        {
+            uint16_t &c = cur[i * width + cols[i]];
+            if (c == low)
+                c++;
+        }
+    }
+    return estimate(ip, now);
+}
+
+uint32_t WindowedCountMin::estimate(const IpAddr &ip, time_t now) const
+{
+    uint32_t cols[depth];
+    columns(ip, cols);
+    time_t epoch = now / sliceSeconds;
+    uint32_t total = 0;
+    for (int s = 0; s < sliceCount; s++)
+    {
+        if (sliceEpochs[s] < 0 || epoch - sliceEpochs[s] >= sliceCount)
+            continue; // empty or older than the window
+        const uint16_t *cur = slice(s);
+        uint16_t low = UINT16_MAX;
+        for (int i = 0; i < depth; i++)
+            low = min(low, cur[i * width + cols[i]]);
+        total += low; // summing each slice's minimum is tighter than the minimum of the sums
+    }
+    return total;
+}
@@ -1,20 +1,31 @@
 #include "include/evaluateTrust.h"
-#include "include/perMinute404.h"
+#include "include/canonicalPath.h"
+#include "include/expiryWheel.h"
+#include "include/ipRanges.h"
+#include "include/countMinSketch.h"
+#include "include/trustRules.h"
+#include "include/underAttack.h"
+#include "include/sharedState.h"
 #include <vector>
 #include <ctime>
 #include <algorithm>
 #include <cstdio>
 #include <cstring>
+#include <strings.h>
 #include <cctype>
+#include <unordered_set>
+#include <unordered_map>
+#include <deque>
+#include <memory>
 
 struct requestPerMinute // storing this here for now cause nothing else outside would need to know requests per minute
 {
-    string ip;
-    int count;
-    time_t timestamp;
+    deque<pair<time_t, int>> perSecond; // request counts per second over the last minute, oldest first
+    int total;
 };
 
-static vector<requestPerMinute> requestsPerMinute;
+static unordered_map<IpAddr, requestPerMinute, IpAddrHash> requestsPerMinute;
+static ExpiryWheel<IpAddr> requestsExpiry;
 
 const vector<string> defaultHoneypotPaths = {
     "/admin",
@@ -27,94 +38,232 @@ const vector<string> defaultHoneypotPaths = {
 };
 
 vector<string> honeypotPaths = defaultHoneypotPaths;
+static unordered_set<string> honeypotKeys; // canonical keys of honeypotPaths, filled by initializeHoneypotPaths
 
 struct lowestScorePerMinute
 { // keeps track of the lowest score per IP per minute
-    string ip;
     int score;
     time_t timestamp;
 };
 
-static vector<lowestScorePerMinute> lowestScores;
+static unordered_map<IpAddr, lowestScorePerMinute, IpAddrHash> lowestScores;
+static ExpiryWheel<IpAddr> lowestScoresExpiry;
 
 struct honeypotsPer3Minutes
 {
-    string ip;
     int count;
     time_t timestamp;
 };
 
-static vector<honeypotsPer3Minutes> honeypots;
+static unordered_map<IpAddr, honeypotsPer3Minutes, IpAddrHash> honeypots;
+static ExpiryWheel<IpAddr> honeypotsExpiry;
+
+// COUNTER_SKETCH mode, the maps above only get addresses whose estimate reaches the point where it affects the score
+static bool sketchMode = false;
+static unique_ptr<WindowedCountMin> requestSketch; // only allocated in sketch mode
+static unique_ptr<WindowedCountMin> honeypotSketch; // only allocated in sketch mode
+static const size_t heavyHitterCap = 65536; // per map, past this even heavy hitters stay estimates
 
-static void clearLowestScores() // clears entries older than 1 minute
+// lowest count with a penalty in the trust rules, below it a sketch estimate scores the same as exact state
+static int heavyHitterMin(TrustCounter counter)
 {
-    time_t now = time(nullptr);
-    lowestScores.erase(
-        std::remove_if(lowestScores.begin(), lowestScores.end(),
-                       [now](const lowestScorePerMinute &entry)
-                       {
-                           return (now - entry.timestamp) > 60;
-                       }),
-        lowestScores.end());
+    return firstTrustBand(counter);
 }
 
-static int checkLowestScore(const string &ip)
+// which penalty band each counter is in, a verdict is only reused while all of them stay put
+struct TrustBands
 {
-    auto it = std::find_if(lowestScores.begin(), lowestScores.end(),
-                           [&ip](const lowestScorePerMinute &entry)
-                           {
-                               return entry.ip == ip;
-                           });
-    if (it != lowestScores.end())
-    {
-        return it->score;
-    }
-    return -1; // not found
+    uint8_t band[TrustCounterCount];
+    bool operator==(const TrustBands &o) const { return memcmp(band, o.band, sizeof(band)) == 0; }
+};
+
+static bool explainScores = false;
+
+void setTrustExplain(bool explain)
+{
+    explainScores = explain;
 }
 
-static void clearHoneypotCounts() // clears entries older than 3 minutes
+struct TrustVerdict // last full evaluation per IP, before the lowest-score-per-minute rule
 {
-    time_t now = time(nullptr);
-    honeypots.erase(
-        std::remove_if(honeypots.begin(), honeypots.end(),
-                       [now](const honeypotsPer3Minutes &entry)
-                       {
-                           return (now - entry.timestamp) > 180;
-                       }),
-        honeypots.end());
+    uint64_t fingerprint;
+    int score;
+    TrustBands bands;
+    time_t expires;
+};
+
+static unordered_map<IpAddr, TrustVerdict, IpAddrHash> verdicts;
+static ExpiryWheel<IpAddr> verdictsExpiry;
+static int verdictTtl = 0;                   // TRUST_CACHE_TTL, 0 disables the cache
+static const size_t verdictCacheMax = 65536; // past this new clients are just evaluated in full
+
+void setTrustCacheTtl(int ttl)
+{
+    verdictTtl = ttl;
+}
+
+void reloadTrustRules()
+{
+    loadTrustRules();
+    verdicts.clear(); // scored under the old rules, the wheel skips the keys that are gone
 }
 
-static int getHoneypotPMcount(const string &ip)
+// FNV-1a over the header names in order plus the values scoring looks at, skipping the request line
+// (paths and per-page headers like Referer's value change on every request, the client doesn't)
+static uint64_t headerFingerprint(const string &headers)
 {
-    clearHoneypotCounts();
-    int count = 0;
-    for (const auto &entry : honeypots)
+    uint64_t h = 1469598103934665603ULL;
+    auto mix = [&h](const char *p, size_t n)
     {
-        if (entry.ip == ip)
+        for (size_t i = 0; i < n; i++)
         {
-            count += entry.count;
+            h ^= (unsigned char)p[i];
+            h *= 1099511628211ULL;
         }
+        h ^= 0xff; // field separator
+        h *= 1099511628211ULL;
+    };
+    size_t pos = headers.find("\r\n");
+    while (pos != string::npos)
+    {
+        size_t start = pos + 2;
+        pos = headers.find("\r\n", start);
+        size_t end = pos == string::npos ? headers.size() : pos;
+        size_t colon = headers.find(':', start);
+        if (colon == string::npos || colon > end)
+            continue;
+        const char *name = headers.data() + start;
+        size_t nameLen = colon - start;
+        mix(name, nameLen);
+        if ((nameLen == 10 && strncasecmp(name, "User-Agent", 10) == 0) ||
+            (nameLen == 15 && strncasecmp(name, "Accept-Encoding", 15) == 0) ||
+            (nameLen == 18 && strncasecmp(name, "sec-ch-ua-platform", 18) == 0))
+            mix(headers.data() + colon + 1, end - colon - 1);
+    }
+    return h;
+}
+
+void useTrustSketches()
+{
+    sketchMode = true;
+    requestSketch.reset(new WindowedCountMin(60, 6));
+    honeypotSketch.reset(new WindowedCountMin(180, 6));
+}
+
+static int checkLowestScore(const IpAddr &ip, time_t now)
+{
+    auto it = lowestScores.find(ip);
+    if (it != lowestScores.end() && (now - it->second.timestamp) <= 60)
+    {
+        return it->second.score;
     }
-    return count;
+    return -1; // not found
 }
 
-static void addHoneypotHit(const string &ip)
+static int getHoneypotPMcount(const IpAddr &ip, time_t now)
 {
-    time_t now = time(nullptr);
-    auto it = std::find_if(honeypots.begin(), honeypots.end(),
-                           [&ip](const honeypotsPer3Minutes &entry)
-                           {
-                               return entry.ip == ip;
-                           });
-    if (it != honeypots.end())
+    int shared = sharedStateActive() ? sharedWindowCount(ip, SharedHoneypots, 180, now) : -1;
+    auto it = honeypots.find(ip);
+    if (it == honeypots.end() || (now - it->second.timestamp) > 180)
+        return max(shared, sketchMode ? (int)honeypotSketch->estimate(ip, now) : 0);
+    return max(shared, it->second.count);
+}
+
+static void addHoneypotHit(const IpAddr &ip, time_t now)
+{
+    if (sharedStateActive())
+        sharedCountWindow(ip, SharedHoneypots, 180, now);
+    int estimate = sketchMode ? (int)honeypotSketch->add(ip, now) : 1;
+    auto it = honeypots.find(ip);
+    if (it != honeypots.end() && (now - it->second.timestamp) <= 180)
+    {
+        it->second.count++;
+        it->second.timestamp = now; // update timestamp to extend the window
+        return;
+    }
+    if (sketchMode && (estimate < heavyHitterMin(HoneypotsPer3Minutes) || honeypots.size() >= heavyHitterCap))
+        return; // the sketch has it
+    if (it == honeypots.end())
+        honeypotsExpiry.schedule(ip, now + 181);
+    honeypots[ip] = {estimate, now};
+}
+
+static int countLocalRequest(const IpAddr &ip, time_t now);
+
+// counts this request and returns how many ip made in the last minute, across all processes with SHARED_STATE
+static int countRequest(const IpAddr &ip, time_t now)
+{
+    int local = countLocalRequest(ip, now);
+    int shared = sharedStateActive() ? sharedCountRequestMinute(ip, now) : -1;
+    return max(local, shared);
+}
+
+static int countLocalRequest(const IpAddr &ip, time_t now)
+{
+    int estimate = sketchMode ? (int)requestSketch->add(ip, now) : 1;
+    auto found = requestsPerMinute.find(ip);
+    if (found == requestsPerMinute.end())
     {
-        it->count++;
-        it->timestamp = now; // update timestamp to extend the window
+        if (sketchMode && (estimate < heavyHitterMin(RequestsPerMinute) || requestsPerMinute.size() >= heavyHitterCap))
+            return estimate;
+        // exact from here on, seeded with what the sketch saw so far
+        found = requestsPerMinute.emplace(ip, requestPerMinute{{{now, estimate - 1}}, estimate - 1}).first;
+        requestsExpiry.schedule(ip, now + 61);
     }
-    else
+    requestPerMinute &window = found->second;
+    while (!window.perSecond.empty() && (now - window.perSecond.front().first) > 60)
     {
-        honeypots.push_back({ip, 1, now});
+        window.total -= window.perSecond.front().second;
+        window.perSecond.pop_front();
     }
+    if (!window.perSecond.empty() && window.perSecond.back().first == now)
+        window.perSecond.back().second++;
+    else
+        window.perSecond.emplace_back(now, 1);
+    window.total++;
+    return window.total;
+}
+
+void expireTrustWindows()
+{
+    time_t now = time(nullptr);
+    requestsExpiry.advance(now, [now](const IpAddr &ip) -> time_t
+                           {
+                               auto it = requestsPerMinute.find(ip);
+                               if (it == requestsPerMinute.end())
+                                   return 0;
+                               time_t last = it->second.perSecond.empty() ? 0 : it->second.perSecond.back().first;
+                               if ((now - last) <= 60)
+                                   return last + 61;
+                               requestsPerMinute.erase(it);
+                               return 0; });
+    lowestScoresExpiry.advance(now, [now](const IpAddr &ip) -> time_t
+                               {
+                                   auto it = lowestScores.find(ip);
+                                   if (it == lowestScores.end())
+                                       return 0;
+                                   if ((now - it->second.timestamp) <= 60)
+                                       return it->second.timestamp + 61;
+                                   lowestScores.erase(it);
+                                   return 0; });
+    verdictsExpiry.advance(now, [now](const IpAddr &ip) -> time_t
+                           {
+                               auto it = verdicts.find(ip);
+                               if (it == verdicts.end())
+                                   return 0;
+                               if (it->second.expires > now)
+                                   return it->second.expires; // re-evaluated since
+                               verdicts.erase(it);
+                               return 0; });
+    honeypotsExpiry.advance(now, [now](const IpAddr &ip) -> time_t
+                            {
+                                auto it = honeypots.find(ip);
+                                if (it == honeypots.end())
+                                    return 0;
+                                if ((now - it->second.timestamp) <= 180)
+                                    return it->second.timestamp + 181;
+                                honeypots.erase(it);
+                                return 0; });
 }
 
 void initializeHoneypotPaths()
@@ -158,162 +307,68 @@ void initializeHoneypotPaths()
     {
         printf("honeypotPaths.txt not found, using default honeypot paths\n");
     }
-}
-
-int evaluateTrust(const string &ip, const string &headers, bool &checkHoneypotPaths)
-{
-    // store request in requestsPerMinute
-    time_t now = time(nullptr);
-    requestsPerMinute.push_back({ip, 1, now});
-
-    // remove old entries from requestsPerMinute
-    requestsPerMinute.erase(
-        std::remove_if(requestsPerMinute.begin(), requestsPerMinute.end(),
-                       [now](const requestPerMinute &entry)
-                       {
-                           return (now - entry.timestamp) > 60;
-                       }),
-        requestsPerMinute.end());
-
-    // extract user agent from headers
-    string userAgent;
-    size_t userAgentStart = headers.find("User-Agent: ");
-    if (userAgentStart != string::npos)
-    {
-        size_t userAgentEnd = headers.find("\r\n", userAgentStart);
-        userAgent = headers.substr(userAgentStart + 12, userAgentEnd - userAgentStart - 12);
-    }
-
-    int score = 30; // Trust score, higher is more trusted. Start at a reasonable trust level
-
-    // user agent stuff
-    if (userAgent.empty())
-    {
-        score -= 20; // no user agent, lower trust
-    }
-
-    // suspicious user agents
-    const vector<string> suspiciousAgents = {
-        "curl", "wget", "python-requests", "libwww-perl", "java", "php", "ruby", "scrapy", "httpclient", "go-http-client"};
-
-    // trusted(?) user agents, can be faked but whatever
-    const vector<string> trustedAgents = {
-        "Mozilla", "Chrome", "Safari", "Edge", "Firefox", "Opera", "AppleWebKit", "Gecko"};
-
-    bool agentFoundAlready = false; // prevents double counting
-    bool isUnknownAgent = true;
-    for (const auto &agent : suspiciousAgents)
-    {
-        if (agentFoundAlready)
-            break;
-        if (userAgent.find(agent) != string::npos)
-        {
-            score -= 10; // suspicious user agent, lower trust
-            isUnknownAgent = false;
-            agentFoundAlready = true;
-        }
-    }
-
-    for (const auto &agent : trustedAgents)
-    {
-        if (agentFoundAlready)
-            break;
-        if (userAgent.find(agent) != string::npos)
-        {
-            score += 10; // trusted user agent, raise trust
-            isUnknownAgent = false;
-            agentFoundAlready = true;
-        }
-    }
-
-    if (isUnknownAgent)
-    {
-        score -= 10; // unknown user agent
-    }
-
-    const vector<string> legitPlatforms = {
-        "Windows", "Linux", "macOS", "Android", "iOS", "Chrome OS", "Chromium OS"};
 
-    // check for sec-ch-ua-platform
-    if (headers.find("sec-ch-ua-platform") != string::npos)
+    honeypotKeys.clear();
+    for (const auto &path : honeypotPaths)
     {
-        // check if actually legit
-        bool foundLegit = false;
-        for (const auto &plat : legitPlatforms)
-        {
-            if (headers.find(plat) != string::npos)
-            {
-                foundLegit = true;
-                break;
-            }
-        }
-        if (foundLegit)
-        {
-            score += 5; // has legit platform, raise trust
-        }
-        else if (headers.find("Unknown") != string::npos)
-        {
-            // unknown platform, at least included so dont lower/raise
-        }
+        CanonicalPath canonical;
+        if (canonicalizePath(path.c_str(), canonical))
+            honeypotKeys.insert(canonical.key);
         else
-        {
-            score -= 5; // older browser or bot, lower trust a bit
-        }
-    }
-
-    // check for referer
-    if (headers.find("Referer: ") != string::npos)
-    {
-        score += 5; // has referer, raise trust a bit, but dont lower if none
+            printf("Skipping invalid honeypot path %s\n", path.c_str());
     }
+}
 
-    // accept-encoding lalala
-    if (headers.find("Accept-Encoding: ") != string::npos)
+// the lowest score in the last minute sticks, so a client can't reset its score by sending better headers
+static int applyLowestScore(const IpAddr &ip, int score, time_t now, bool logIt)
+{
+    // check if score is lower than previous lowest in last minute
+    int prevLowest = checkLowestScore(ip, now);
+    int finalScore = score;
+    if (prevLowest == -1 || score < prevLowest)
     {
-        // make sure it has e.g. gzip or deflate
-        if (headers.find("gzip") != string::npos || headers.find("deflate") != string::npos || headers.find("br") != string::npos || headers.find("zstd") != string::npos)
+        // first entry for this IP in current window, or a new lower score replaces stored
+        // in sketch mode only heavy hitters (those with an exact request window) are remembered
+        bool known = lowestScores.find(ip) != lowestScores.end();
+        if (known || !sketchMode || (requestsPerMinute.count(ip) && lowestScores.size() < heavyHitterCap))
         {
-            score += 5; // has, raise trust a bit
+            if (!known)
+                lowestScoresExpiry.schedule(ip, now + 61);
+            lowestScores[ip] = {score, now};
         }
     }
     else
     {
-        score -= 5; // no accept-encoding, lower trust a bit
+        // use previous lowest score
+        finalScore = prevLowest;
     }
-
-    // check for requests per minute from this IP
-    int rpm = 0;
-    for (const auto &entry : requestsPerMinute)
+    if (sharedStateActive())
     {
-        if (entry.ip == ip)
-        {
-            rpm += entry.count;
-        }
+        // another process may have seen this client at its worst
+        int sharedLowest = sharedLowestScore(ip, score, now);
+        if (sharedLowest >= 0 && sharedLowest < finalScore)
+            finalScore = sharedLowest;
     }
 
-    // requests per minute checks
-    if (rpm > 60)
-    {
-        score -= 20; // very high request rate, lower trust
-    }
-    else if (rpm > 45)
+    if (!logIt || underAttack())
+        return finalScore; // a line per request is too much while under attack
+    if (finalScore != score)
     {
-        score -= 10; // high request rate, lower trust
+        printf("Evaluated trust score for %s: %d (using previous lowest, raw: %d)\n", ipToString(ip).c_str(), finalScore, score);
     }
-    else if (rpm > 25)
+    else
     {
-        score -= 5; // moderate request rate, lower trust a bit
+        printf("Evaluated trust score for %s: %d\n", ipToString(ip).c_str(), finalScore);
     }
 
-    // ip range checks (basic)
-    if (ip.find("192.168.") == 0 || ip.find("10.") == 0 || ip.find("172.") == 0)
-    {
-        score += 15; // private IP range, increase trust
-    }
-    else if (ip.find("127.") == 0 || ip == "::1")
-    {
-        score += 35; // localhost, very high trust
-    }
+    return finalScore;
+}
+
+int evaluateTrust(const IpAddr &ip, const string &headers, bool &checkHoneypotPaths, int notFoundPerMinute, int timeoutsPerMinute)
+{
+    // store request in requestsPerMinute
+    time_t now = time(nullptr);
+    int rpm = countRequest(ip, now);
 
     // Extract request line to get exact path (first line up to CRLF)
     string requestLine;
@@ -339,112 +394,55 @@ int evaluateTrust(const string &ip, const string &headers, bool &checkHoneypotPa
         }
     }
 
-    // normalize reqPath: remove trailing slashes except root
-    if (reqPath.size() > 1)
-    {
-        while (!reqPath.empty() && reqPath.size() > 1 && reqPath.back() == '/')
-            reqPath.pop_back();
-    }
-
+    bool honeypotHit = false;
+    // compare canonical keys, so /wp-login.php?x, //wp-login.php and /%77p-login.php all count
     if (checkHoneypotPaths && !reqPath.empty())
     {
-        for (const auto &path : honeypotPaths)
+        CanonicalPath canonical;
+        string reqKey = canonicalizePath(reqPath.c_str(), canonical) ? canonical.key : reqPath;
+        if (honeypotKeys.count(reqKey))
         {
-            // also normalize the honeypot path similarly (assume stored normalized)
-            string hp = path;
-            if (hp.size() > 1)
-            {
-                while (hp.size() > 1 && hp.back() == '/')
-                    hp.pop_back();
-            }
-            if (reqPath == hp)
-            {
-                score -= 35; // accessing honeypot path, lower trust significantly
-                addHoneypotHit(ip);
-                break;
-            }
+            honeypotHit = true;
+            addHoneypotHit(ip, now);
         }
     }
 
-    // honeypots per 3 minutes check
-    if (checkHoneypotPaths)
-    {
-        int hpCount = getHoneypotPMcount(ip);
-        if (hpCount >= 7)
-        {
-            score -= 65; // very high honeypot access rate, lower trust heavily (maybe block outright instead but idk)
-        }
-        else if (hpCount >= 6)
-        {
-            score -= 40; // high honeypot access rate, lower trust
-        }
-        else if (hpCount >= 4)
-        {
-            score -= 25; // moderate honeypot access rate, lower trust
-        }
-        else if (hpCount >= 2)
-        {
-            score -= 10; // low honeypot access rate, could just be a mistake, lower trust a bit
-        }
-    }
+    int hpCount = checkHoneypotPaths ? getHoneypotPMcount(ip, now) : 0;
+    int f404 = notFoundPerMinute;
 
-    // check 404s per minute from this IP
-    int f404 = get404PMcount(ip);
-    if (f404 > 30)
-    {
-        score -= 35; // very high 404 rate, lower trust significantly
-    }
-    else if (f404 > 20)
-    {
-        score -= 20; // high 404 rate, lower trust
-    }
-    else if (f404 > 10)
+    // same client, same headers, same bands: the score can't have changed, skip the rest (and the log line)
+    TrustBands bands{{trustBand(RequestsPerMinute, rpm), trustBand(HoneypotsPer3Minutes, hpCount), trustBand(NotFoundPerMinute, f404),
+                      trustBand(TimeoutsPerMinute, timeoutsPerMinute)}};
+    uint64_t fingerprint = 0;
+    if (verdictTtl > 0 && !honeypotHit)
     {
-        score -= 10; // moderate 404 rate, lower trust a bit
+        fingerprint = headerFingerprint(headers);
+        auto cached = verdicts.find(ip);
+        if (cached != verdicts.end() && cached->second.fingerprint == fingerprint &&
+            cached->second.expires > now && cached->second.bands == bands)
+            return applyLowestScore(ip, cached->second.score, now, false);
     }
 
-    // clamp score to 0-100
-    if (score < 0)
-        score = 0;
-    if (score > 100)
-        score = 100;
-
-    // check if score is lower than previous lowest in last minute
-    clearLowestScores();
-    int prevLowest = checkLowestScore(ip);
-    int finalScore = score;
-    if (prevLowest == -1)
+    // the rules only ever see these flags and the bands, so every evaluation costs the same
+    uint32_t features = extractTrustFeatures(headers, lookupIpClass(ip), honeypotHit);
+    int score = scoreTrust(features, bands.band);
+    if (explainScores)
     {
-        // first entry for this IP in current window
-        lowestScores.push_back({ip, score, now});
+        printf("Trust score for %s: %s = %d\n", ipToString(ip).c_str(), explainTrust(features, bands.band).c_str(), score);
     }
-    else if (score < prevLowest)
+
+    // a honeypot hit's -35 only belongs to that request, don't let it stick to the cached verdict
+    if (verdictTtl > 0 && !honeypotHit)
     {
-        // new lower score replaces stored
-        for (auto &entry : lowestScores)
+        auto cached = verdicts.find(ip);
+        if (cached == verdicts.end() && verdicts.size() < verdictCacheMax)
         {
-            if (entry.ip == ip)
-            {
-                entry.score = score;
-                entry.timestamp = now;
-                break;
-            }
+            cached = verdicts.emplace(ip, TrustVerdict{}).first;
+            verdictsExpiry.schedule(ip, now + verdictTtl);
         }
-    }
-    else
-    {
-        // use previous lowest score
-        finalScore = prevLowest;
+        if (cached != verdicts.end())
+            cached->second = TrustVerdict{fingerprint, score, bands, now + verdictTtl};
     }
 
-    if (finalScore != score)
-    {
-        printf("Evaluated trust score for %s: %d (using previous lowest, raw: %d)\n", ip.c_str(), finalScore, score);
-    }
-    else
-    {
-        printf("Evaluated trust score for %s: %d\n", ip.c_str(), finalScore);
-    }
-
-    return finalScore;
+    return applyLowestScore(ip, score, now, true);
 }
\ No newline at end of file
@@ -1,37 +1,175 @@
 #include "include/headerManager.h"
-#include <string>
-#include <cctype>
+#include "include/clientTimeouts.h"
+#include <cstdio>
+#include <cstring>
+#include <cstdarg>
+#include <cerrno>
+#include <ctime>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
-using namespace std;
+// headers added to every response, built at compile time instead of being spliced in per request
+static const char commonHeaders[] =
+    "Server: faucet/1.0\r\n"
+    // basic security headers, while remaining flexible
+    "X-Content-Type-Options: nosniff\r\n"
+    "Referrer-Policy: no-referrer\r\n";
+
+static char cachedDate[40];
+static time_t cachedDateFor = -1;
 
-static string addHeaderBeforeEnding(const string &header, const string &toAdd)
+const char *httpDate()
 {
-    size_t pos = header.find("\r\n\r\n");
-    if (pos == string::npos)
-        return header; // invalid header, just return as is
-    return header.substr(0, pos + 2) + toAdd + header.substr(pos + 2);
+    time_t now = time(nullptr);
+    if (now != cachedDateFor) // only reformat once per second
+    {
+        struct tm tmv;
+        gmtime_r(&now, &tmv);
+        strftime(cachedDate, sizeof(cachedDate), "%a, %d %b %Y %H:%M:%S GMT", &tmv);
+        cachedDateFor = now;
+    }
+    return cachedDate;
 }
 
-string headerManager(const string &header) // expects a header and just adds extra stuff to it
+static void appendRaw(ResponseHeader &h, const char *s, size_t n)
 {
-    string modifiedHeader = header;
+    if (h.overflow || h.len + n >= sizeof(h.data))
+    {
+        h.overflow = true;
+        return;
+    }
+    memcpy(h.data + h.len, s, n);
+    h.len += n;
+    h.data[h.len] = '\0';
+}
 
-    // start off by validating the header, checking common headers and /r/n/r/n ending
-    if (modifiedHeader.size() < 16) // minimum valid header size
-        return "invalid";
-    if (modifiedHeader.substr(0, 5) != "HTTP/") // must start with HTTP/
-        return "invalid";
-    if (modifiedHeader.find("\r\n\r\n") == string::npos) // must end with \r\n\r\n
-        return "invalid";
-    // good enough atp
+ResponseHeader::ResponseHeader(const char *status)
+{
+    data[0] = '\0';
+    appendRaw(*this, "HTTP/1.1 ", 9);
+    appendRaw(*this, status, strlen(status));
+    appendRaw(*this, "\r\n", 2);
+}
 
-    // add common headers
-    modifiedHeader = addHeaderBeforeEnding(modifiedHeader, "Server: faucet/1.0\r\n");
+void ResponseHeader::add(const char *line)
+{
+    appendRaw(*this, line, strlen(line));
+    appendRaw(*this, "\r\n", 2);
+}
 
-    // basic security headers, while remaining flexible
-    modifiedHeader = addHeaderBeforeEnding(modifiedHeader, "X-Content-Type-Options: nosniff\r\n");
-    modifiedHeader = addHeaderBeforeEnding(modifiedHeader, "Referrer-Policy: no-referrer\r\n");
+void ResponseHeader::addf(const char *fmt, ...)
+{
+    if (overflow)
+        return;
+    size_t room = sizeof(data) - len;
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(data + len, room, fmt, args);
+    va_end(args);
+    if (n < 0 || (size_t)n >= room)
+    {
+        data[len] = '\0'; // drop the partial line
+        overflow = true;
+        return;
+    }
+    len += (size_t)n;
+    appendRaw(*this, "\r\n", 2);
+}
+
+bool ResponseHeader::finish()
+{
+    appendRaw(*this, commonHeaders, sizeof(commonHeaders) - 1);
+    appendRaw(*this, "Date: ", 6);
+    const char *date = httpDate();
+    appendRaw(*this, date, strlen(date));
+    appendRaw(*this, "\r\nConnection: close\r\n\r\n", 23);
+    return !overflow;
+}
+
+bool sendAll(int client_fd, struct iovec *iov, int count, int flags)
+{
+    struct msghdr msg{};
+    for (;;)
+    {
+        while (count > 0 && iov->iov_len == 0) // skip what's done, empty pieces included
+        {
+            iov++;
+            count--;
+        }
+        if (count == 0)
+            return true;
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+        ssize_t sent = sendmsg(client_fd, &msg, flags);
+        if (sent < 0 && errno == EINTR)
+            continue;
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            noteStalledSend(); // SO_SNDTIMEO ran out without progress
+        if (sent <= 0)
+            return false;
+        while (count > 0 && (size_t)sent >= iov->iov_len)
+        {
+            sent -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + sent;
+            iov->iov_len -= sent;
+        }
+    }
+}
+
+bool sendAll(int client_fd, const void *data, size_t len, int flags)
+{
+    struct iovec iov{(void *)data, len};
+    return sendAll(client_fd, &iov, 1, flags);
+}
 
-    // return the finished header
-    return modifiedHeader;
-}
\ No newline at end of file
+bool sendHeader(int client_fd, ResponseHeader &header, bool bodyFollows)
+{
+    if (!header.finish())
+    {
+        printf("Response header overflowed, not sending.\n");
+        return false;
+    }
+    return sendAll(client_fd, header.data, header.len, bodyFollows ? MSG_MORE : 0);
+}
+
+PreparedResponse prepareResponse(ResponseHeader &header, const std::string &body)
+{
+    PreparedResponse prepared;
+    if (!header.finish())
+        return prepared;
+    std::string full(header.data, header.len);
+    size_t dateStart = full.find("\r\nDate: ") + 8;
+    size_t dateEnd = full.find("\r\n", dateStart);
+    prepared.beforeDate = full.substr(0, dateStart);
+    prepared.afterDate = full.substr(dateEnd) + body;
+    return prepared;
+}
+
+void sendPrepared(int client_fd, const PreparedResponse &response)
+{
+    const char *date = httpDate();
+    struct iovec iov[3] = {
+        {(void *)response.beforeDate.data(), response.beforeDate.size()},
+        {(void *)date, strlen(date)},
+        {(void *)response.afterDate.data(), response.afterDate.size()}};
+    sendAll(client_fd, iov, 3); // usually one syscall, client going away is not our problem
+}
+
+void sendCannedAndClose(int client_fd, const char *response, size_t len)
+{
+    send(client_fd, response, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    shutdown(client_fd, SHUT_WR);
+    // whatever the client already sent has to go, a close with unread data is answered with a RST that
+    // can make the client drop the response it hasn't read yet. only what's there, never wait for more
+    char discard[4096];
+    for (int i = 0; i < 16 && recv(client_fd, discard, sizeof(discard), MSG_DONTWAIT) > 0; i++)
+    {
+    }
+    close(client_fd);
+}
@@ -0,0 +1,19 @@
+#pragma once
+#include <string>
+#include "ipAddr.h"
+
+// ADMISSION_QUEUE, once this many connections wait in the listen backlog new ones are shed with a 503 and Retry-After,
+// lowest trust first: the deeper the queue the higher the trust score a client needs to get in, clients without a
+// trust score go first and established, well scored ones last. 0 disables it. needs EVALUATE_TRUSTSCORE to tell
+// clients apart, without it everyone is shed alike
+void initializeAdmission(int listenFd, int queueThreshold);
+
+// true if client_fd was turned away (and closed)
+bool shedConnection(int client_fd, const IpAddr &ip);
+
+// the client's latest trust score, ranks it when shedding. a client is established only once it has one
+void noteAdmissionScore(const IpAddr &ip, int score);
+
+void expireAdmission(); // drops clients not seen for a while, call every loop tick
+
+std::string admissionJson(); // queue depth, backlog size and connections shed, for the status endpoint
@@ -0,0 +1,26 @@
+#pragma once
+#include <string>
+#include <vector>
+#include "ipAddr.h"
+
+// ASYNC_TRUST, requests are served right away and scored on a worker thread, which from then on owns all of
+// evaluateTrust's state (call after the trust/honeypot setup, and don't call evaluateTrust or expireTrustWindows after)
+void startAsyncTrust(bool checkHoneypotPaths);
+
+void stopAsyncTrust(); // finishes what's queued and joins the worker
+
+int asyncTrustFd(); // eventfd to poll on, readable when scores are ready, -1 if off
+
+// hands a request to the worker, the counts are get404PMcount(ip) and getTimeoutPMcount(ip) at the time of the request
+// drops the request if the worker is this far behind (a flood, the block will come from the requests after it)
+void queueTrustEvaluation(const IpAddr &ip, std::string headers, int notFoundPerMinute, int timeoutsPerMinute);
+
+void requestAsyncTrustReload(); // reloadTrustRules() on the worker before its next batch
+
+struct TrustResult
+{
+    IpAddr ip;
+    int score;
+};
+
+std::vector<TrustResult> takeTrustResults(); // scores since the last call, call when asyncTrustFd() is readable
@@ -0,0 +1,16 @@
+#pragma once
+#include <string>
+#include <ctime>
+#include "ipAddr.h"
+
+// blocklist.dat: fixed-layout open addressing table of blocked addresses, mmap()ed so blocks survive restarts
+// the table is used as-is after a restart, lookups go straight to it and expired entries are reused by later inserts
+
+// maps (creating if needed) the file at path, a bad magic/version/checksum gets it recreated empty
+bool openBlockFile(const std::string &path);
+
+time_t persistedBlockedUntil(const IpAddr &ip, time_t now); // 0 if ip has no block in the file that's still running at now
+
+void persistBlock(const IpAddr &ip, time_t blockedUntil);
+
+void forgetPersistedBlock(const IpAddr &ip);
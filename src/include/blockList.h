@@ -0,0 +1,31 @@
+#pragma once
+#include <string>
+#include <ctime>
+#include "ipAddr.h"
+
+struct BlockedClient // blocked based on trust score until blockforDuration ends
+{
+    time_t blockedUntil;
+    unsigned long hits; // requests turned away since the block started
+};
+
+// action is BLOCKED_ACTION: "403" (canned response), "rst" (reset the connection) or "close" (silent close)
+void initializeBlockList(const std::string &action, bool toggleLogging, int logMaxLines);
+
+// restores blocks saved in the file at path (blocklist.dat) and keeps it updated from here on
+void loadPersistedBlocks(const std::string &path);
+
+void blockClient(const IpAddr &ip, time_t blockedUntil);
+
+bool isClientBlocked(const IpAddr &ip); // blocked by this process, without counting a hit
+
+// O(1), returns the entry (with the hit counted) if ip is currently blocked, nullptr otherwise
+BlockedClient *hitBlockedClient(const IpAddr &ip);
+
+// turns the connection away with the configured action without reading anything, logs a sample of hits, closes client_fd
+void rejectBlockedClient(int client_fd, const IpAddr &ip, const BlockedClient &entry);
+
+// same as rejectBlockedClient for addresses in DENY_CIDRS, logging is sampled over all denied connections
+void rejectDeniedClient(int client_fd, const IpAddr &ip);
+
+void expireBlockedClients(); // drops expired blocks, amortized O(1) per block, call every loop tick
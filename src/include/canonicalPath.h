@@ -0,0 +1,16 @@
+#pragma once
+#include <string>
+
+struct CanonicalPath
+{
+    std::string key;    // decoded, no leading/trailing slash, no empty/. /.. segments, "" is the site root
+    bool trailingSlash; // the request named a directory (ends in /, /. or /..), always true for the root
+    std::string query;  // raw query string without '?', fragment dropped
+};
+
+// turns a request target into the key every lookup and cache uses, so /a//b, /a/./b and /a/b?x all land on "a/b"
+// returns false for bad percent-encoding, encoded NUL bytes, or .. climbing above the root
+bool canonicalizePath(const char *target, CanonicalPath &out);
+
+// percent-encodes a key back into a URL path (without the leading slash), for Location headers and links
+void appendEncodedPath(std::string &out, const std::string &key);
@@ -0,0 +1,31 @@
+#pragma once
+#include <ctime>
+#include <sys/types.h>
+#include "ipAddr.h"
+
+// HEADER_TIMEOUT, IDLE_TIMEOUT and MIN_SEND_RATE, deadlines for the connection being served so a client that
+// trickles its request in or reads the response a byte at a time can't hold the serving loop, 0 disables each
+void initializeClientTimeouts(int headerTimeout, int idleTimeout, int minSendRate);
+
+// call right after accept, starts the header deadline and puts the idle timeout on every send to client_fd
+void startClientDeadlines(int client_fd);
+
+// waits for more of the request, false if the header deadline or the idle timeout passed first
+bool waitForRequestData(int client_fd);
+
+// send timeouts are counted against ip from here on (the proxied address once the headers are read)
+void setDeadlineClient(const IpAddr &ip);
+
+void startBodyDeadline(); // call before sending a body with bodyKeepsUp() checks
+
+// call after each chunk of the body, false (and the timeout counted) once the transfer fell below MIN_SEND_RATE,
+// the first IDLE_TIMEOUT seconds are a grace period for TCP to ramp up
+bool bodyKeepsUp(off_t bytesSent);
+
+void noteStalledSend(); // a send gave up after IDLE_TIMEOUT without progress (EAGAIN from SO_SNDTIMEO)
+
+void noteClientTimeout(const IpAddr &ip);
+
+int getTimeoutPMcount(const IpAddr &ip); // timed out connections in the last minute, fed into the trust score
+
+void expireClientTimeouts(); // drops windows with no timeouts in the last minute, call every loop tick
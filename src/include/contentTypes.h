@@ -1,42 +1,6 @@
 #pragma once
-#include <cstring>
 
-inline const char *guessContentType(const char *path)
-{
-    const char *dot = strrchr(path, '.');
-    if (!dot)
-        return "application/octet-stream";
-    if (strcmp(dot, ".html") == 0 || strcmp(dot, ".htm") == 0)
-        return "text/html";
-    if (strcmp(dot, ".css") == 0)
-        return "text/css";
-    if (strcmp(dot, ".js") == 0)
-        return "text/javascript";
-    if (strcmp(dot, ".json") == 0)
-        return "application/json";
-    if (strcmp(dot, ".png") == 0)
-        return "image/png";
-    if (strcmp(dot, ".jpg") == 0 || strcmp(dot, ".jpeg") == 0)
-        return "image/jpeg";
-    if (strcmp(dot, ".gif") == 0)
-        return "image/gif";
-    if (strcmp(dot, ".txt") == 0 || strcmp(dot, ".log") == 0)
-        return "text/plain";
-    if (strcmp(dot, ".svg") == 0)
-        return "image/svg+xml";
-    if (strcmp(dot, ".ico") == 0)
-        return "image/x-icon";
-    if (strcmp(dot, ".pdf") == 0)
-        return "application/pdf";
-    if (strcmp(dot, ".zip") == 0)
-        return "application/zip";
-    if (strcmp(dot, ".mp3") == 0)
-        return "audio/mpeg";
-    if (strcmp(dot, ".mp4") == 0)
-        return "video/mp4";
-    if (strcmp(dot, ".webm") == 0)
-        return "video/webm";
-    if (strcmp(dot, ".webp") == 0)
-        return "image/webp";
-    return "application/octet-stream";
-}
\ No newline at end of file
+// returns the content type for a path based on its extension (case-insensitive), text types include charset
+const char *guessContentType(const char *path);
+
+void initializeMimeTypes(); // loads mime.types from the working directory if it exists, overriding the built-in table
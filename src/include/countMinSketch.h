@@ -0,0 +1,31 @@
+#pragma once
+#include <ctime>
+#include <cstdint>
+#include <vector>
+#include "ipAddr.h"
+
+// per-IP event counts over a sliding window in fixed memory, for when every request can claim a new address
+// (forged X-Forwarded-For behind TRUST_XREALIP), estimates never undercount and only overcount on collisions
+class WindowedCountMin
+{
+public:
+    // the window is split into slices that are cleared as they age out, so it slides in windowSeconds / slices steps
+    WindowedCountMin(int windowSeconds, int slices);
+
+    uint32_t add(const IpAddr &ip, time_t now); // counts one event, returns the new estimate
+
+    uint32_t estimate(const IpAddr &ip, time_t now) const;
+
+private:
+    static const int depth = 4;
+    static const uint32_t width = 32768; // power of two, 4 x 32768 x 2 bytes = 256 KiB per slice
+
+    int sliceSeconds;
+    int sliceCount;
+    std::vector<uint16_t> counters;   // sliceCount x depth x width, saturating
+    std::vector<time_t> sliceEpochs; // which now / sliceSeconds each slice holds
+
+    void columns(const IpAddr &ip, uint32_t cols[depth]) const;
+    uint16_t *slice(int s) { return &counters[(size_t)s * depth * width]; }
+    const uint16_t *slice(int s) const { return &counters[(size_t)s * depth * width]; }
+};
@@ -1,10 +1,25 @@
 #pragma once
 #include <string>
+#include "ipAddr.h"
 using namespace std;
 
 // evaluates trust, returns score in int, higher is better
-int evaluateTrust(const string &ip, 
+// notFoundPerMinute and timeoutsPerMinute are get404PMcount(ip) and getTimeoutPMcount(ip), passed in so the
+// evaluation can run off the main thread
+int evaluateTrust(const IpAddr &ip,
     const string &headers,
-    bool &checkHoneypotPaths);
+    bool &checkHoneypotPaths,
+    int notFoundPerMinute,
+    int timeoutsPerMinute);
 
-void initializeHoneypotPaths(); // simply initializes honeypot paths from honeypotPaths.txt if it exists
\ No newline at end of file
+void initializeHoneypotPaths(); // simply initializes honeypot paths from honeypotPaths.txt if it exists
+
+void expireTrustWindows(); // drops per-IP request/score/honeypot windows that ran out, call every loop tick
+
+void useTrustSketches(); // COUNTER_SKETCH, estimate request/honeypot rates in fixed memory, exact state only for heavy hitters
+
+void setTrustCacheTtl(int ttl); // TRUST_CACHE_TTL, seconds a verdict is reused for the same IP and header fingerprint, 0 = off
+
+void setTrustExplain(bool explain); // --explain, print each rule's contribution to every fully evaluated score
+
+void reloadTrustRules(); // re-reads trustRules.txt (on SIGHUP) and drops cached verdicts, loadTrustRules() is the startup load
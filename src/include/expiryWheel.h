@@ -0,0 +1,59 @@
+#pragma once
+#include <ctime>
+#include <vector>
+
+// hashed timing wheel with one-second slots, used to expire per-IP state from the accept loop tick
+// each key sits in the wheel once, so expiry costs amortized O(1) per key instead of a scan per request
+template <typename Key>
+class ExpiryWheel
+{
+public:
+    ExpiryWheel() : current(time(nullptr)) {}
+
+    void schedule(const Key &key, time_t when)
+    {
+        slots[(when < current ? current : when) & slotMask].push_back({key, when});
+    }
+
+    // calls onDue(key) for every key whose time has come, it returns 0 to drop the key or a later time to
+    // reschedule it (for entries that were extended since being scheduled)
+    template <typename OnDue>
+    void advance(time_t now, OnDue onDue)
+    {
+        if (now - current >= (time_t)slotCount)
+            current = now - slotCount + 1; // after a long stall one lap visits every slot anyway
+        std::vector<Item> due;
+        for (; current <= now; ++current)
+        {
+            std::vector<Item> &slot = slots[current & slotMask];
+            for (size_t i = 0; i < slot.size();)
+            {
+                if (slot[i].when <= now)
+                {
+                    due.push_back(slot[i]);
+                    slot[i] = slot.back();
+                    slot.pop_back();
+                }
+                else
+                    ++i; // due on a later lap
+            }
+        }
+        for (const Item &item : due)
+        {
+            time_t next = onDue(item.key);
+            if (next != 0)
+                schedule(item.key, next);
+        }
+    }
+
+private:
+    struct Item
+    {
+        Key key;
+        time_t when;
+    };
+    static const size_t slotCount = 1024; // power of two, ~17 minutes per lap
+    static const size_t slotMask = slotCount - 1;
+    std::vector<Item> slots[slotCount];
+    time_t current; // next slot to visit
+};
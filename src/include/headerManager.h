@@ -1,7 +1,47 @@
 #pragma once
 
+#include <cstddef>
 #include <string>
+#include <sys/uio.h>
 
-using namespace std;
+// response header builder, appends into a fixed buffer (usually on the stack) so no heap allocations happen
+struct ResponseHeader
+{
+    char data[1024];
+    size_t len = 0;
+    bool overflow = false; // set if anything did not fit, finish() then fails
 
-string headerManager(const string &header);
\ No newline at end of file
+    explicit ResponseHeader(const char *status); // status like "200 OK", writes the status line
+
+    void add(const char *line);                                            // raw header line without CRLF
+    void addf(const char *fmt, ...) __attribute__((format(printf, 2, 3))); // formatted header line without CRLF
+
+    // appends the common headers (Server, security headers, Date, Connection) and the blank line
+    // returns false if the header overflowed
+    bool finish();
+};
+
+// sends all of it, looping over partial writes. a send that stalls past SO_SNDTIMEO is counted with noteStalledSend()
+// returns false if the client went away or stalled, the response is cut short then and the connection should be closed
+bool sendAll(int client_fd, struct iovec *iov, int count, int flags = 0); // advances iov as it goes
+bool sendAll(int client_fd, const void *data, size_t len, int flags = 0);
+
+// finishes and sends the header, MSG_MORE hints the kernel that a body follows. returns false if it wasn't sent in full
+bool sendHeader(int client_fd, ResponseHeader &header, bool bodyFollows);
+
+const char *httpDate(); // cached IMF-fixdate for the current second
+
+// a complete response (header + body) rendered ahead of time, split around the Date value so the current one can be slotted in
+struct PreparedResponse
+{
+    std::string beforeDate;
+    std::string afterDate;
+};
+
+PreparedResponse prepareResponse(ResponseHeader &header, const std::string &body);
+
+void sendPrepared(int client_fd, const PreparedResponse &response); // one sendAll, does not close client_fd
+
+// for canned rejections (403 to blocked clients, 503 when shedding): sends without blocking, reads away the
+// request bytes already received so the close doesn't turn into a RST, and closes client_fd
+void sendCannedAndClose(int client_fd, const char *response, size_t len);
@@ -0,0 +1,40 @@
+#pragma once
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include <cstddef>
+#include <netinet/in.h>
+
+// 16-byte normalized address, IPv4 is mapped into IPv6 (::ffff:a.b.c.d)
+// every per-client table keys on this, text is only made for logging
+struct IpAddr
+{
+    alignas(8) uint8_t bytes[16]; // network order, same layout as the on-disk and shared tables
+
+    uint64_t word(int i) const
+    {
+        uint64_t w;
+        memcpy(&w, bytes + 8 * i, sizeof(w));
+        return w;
+    }
+    bool operator==(const IpAddr &other) const { return word(0) == other.word(0) && word(1) == other.word(1); }
+    bool operator!=(const IpAddr &other) const { return !(*this == other); }
+};
+
+extern const uint64_t ipHashSeed; // random per process, so nobody can pick addresses that collide
+
+struct IpAddrHash
+{
+    size_t operator()(const IpAddr &ip) const
+    {
+        uint64_t h = (ip.word(0) ^ ipHashSeed) * 0x9e3779b97f4a7c15ULL;
+        h = (h ^ (h >> 32) ^ ip.word(1)) * 0xd6e8feb86659fd93ULL;
+        return (size_t)(h ^ (h >> 32));
+    }
+};
+
+bool parseIp(const std::string &text, IpAddr &out); // dotted IPv4 or IPv6 text, false if neither
+
+IpAddr ipFromV4(const in_addr &addr);
+
+std::string ipToString(const IpAddr &ip); // mapped IPv4 comes out dotted
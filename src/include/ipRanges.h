@@ -0,0 +1,26 @@
+#pragma once
+#include <string>
+#include "ipAddr.h"
+
+enum class IpAccess
+{
+    Unlisted, // in neither ALLOW_CIDRS nor DENY_CIDRS
+    Allow,    // never blocked or scored
+    Deny      // turned away like a blocked client
+};
+
+enum class IpClass
+{
+    Public,
+    Loopback,
+    Private,   // RFC 1918, unique local and link-local
+    Datacenter // listed in DATACENTER_CIDRS
+};
+
+// loads the CIDR files (one prefix per line, IPv4 or IPv6, # comments), empty paths are skipped
+// the most specific prefix wins, an identical prefix in both allow and deny is allowed
+void initializeIpRanges(const std::string &allowFile, const std::string &denyFile, const std::string &datacenterFile);
+
+IpAccess lookupIpAccess(const IpAddr &ip); // longest-prefix match
+
+IpClass lookupIpClass(const IpAddr &ip);
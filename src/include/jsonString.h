@@ -0,0 +1,7 @@
+#pragma once
+#include <string>
+
+// appends in as a quoted JSON string, shared by every endpoint that hands out JSON so they escape alike
+// well-formed UTF-8 passes through, control bytes, DEL and bytes that aren't valid UTF-8 (header values can be
+// anything) become \u00XX escapes, so the output is always valid JSON
+void appendJsonString(std::string &out, const std::string &in);
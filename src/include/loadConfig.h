@@ -14,4 +14,26 @@ int loadConfig(int &port,
                bool &evaluateTrustScore,
                int &trustScoreThreshold,
                bool &checkHoneypotPaths,
-               int &blockforDuration);
\ No newline at end of file
+               int &blockforDuration,
+               bool &useSiteIndex,
+               int &missCacheTtl,
+               std::string &sitePack,
+               std::string &blockedAction,
+               bool &persistBlocklist,
+               std::string &sharedState,
+               std::string &allowCidrs,
+               std::string &denyCidrs,
+               std::string &datacenterCidrs,
+               bool &counterSketch,
+               std::string &statusPath,
+               int &trustCacheTtl,
+               bool &asyncTrust,
+               int &underAttack404s,
+               int &underAttackBlocks,
+               int &underAttackLogSample,
+               int &underAttackRateLimit,
+               int &listenBacklog,
+               int &admissionQueue,
+               int &headerTimeout,
+               int &idleTimeout,
+               int &minSendRate);
\ No newline at end of file
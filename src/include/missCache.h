@@ -0,0 +1,14 @@
+#pragma once
+#include <string>
+
+// bounded cache of paths that recently 404'd, so repeat probes skip the filesystem
+void initializeMissCache(const std::string &siteDir, int ttlSeconds); // ttlSeconds 0 disables the cache
+
+int missCacheFd(); // inotify fd to poll on, -1 if the cache isn't active
+
+void refreshMissCache(); // drops misses whose paths were created, call when missCacheFd() is readable
+
+// relPath has no leading or trailing slash, same form as lookupSite()
+bool isCachedMiss(const std::string &relPath);
+
+void rememberMiss(const std::string &relPath); // call after open() failed with ENOENT
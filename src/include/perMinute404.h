@@ -1,6 +1,10 @@
 #pragma once
-#include <string>
+#include "ipAddr.h"
 
-void add404PMentry(const std::string &ip);
+void add404PMentry(const IpAddr &ip);
 
-int get404PMcount(const std::string &ip);
\ No newline at end of file
+int get404PMcount(const IpAddr &ip);
+
+void use404Sketch(); // COUNTER_SKETCH, estimate 404 rates in fixed memory, exact windows only for heavy hitters
+
+void expire404PMentries(); // drops windows with no 404s in the last minute, call every loop tick
@@ -1,8 +1,9 @@
 #pragma once
 #include <string>
+#include "ipAddr.h"
 
-void return404(int client_fd,
-    const std::string &siteDir, 
-    const std::string &Page404, 
-    const std::string &contactEmail,
-    const std::string &ip);
\ No newline at end of file
+void initialize404Page(const std::string &siteDir, const std::string &Page404); // loads the custom 404 page (if set) into memory
+
+void set404PageBody(const char *data, size_t len); // uses an in-memory custom 404 page instead (site packs), nullptr for none
+
+void return404(int client_fd, const IpAddr &ip, const std::string &key); // sends the custom or default 404 and closes client_fd, key is the missing path
\ No newline at end of file
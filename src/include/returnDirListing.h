@@ -1,9 +1,9 @@
 #pragma once
 #include <string>
+#include "ipAddr.h"
 
 void returnDirListing(int client_fd,
-                      const std::string &siteDir,
-                      const std::string &relPath,
-                      const std::string &Page404,
-                      const std::string &contactEmail,
-                      const std::string &ip);
\ No newline at end of file
+                      const std::string &relPath, // relative to the site root, no leading/trailing slash
+                      const std::string &query, // raw query string without '?', supports offset/limit/sort/format=json
+                      const IpAddr &ip,
+                      bool http10); // HTTP/1.0 request, streamed listings are sent close-delimited instead of chunked
\ No newline at end of file
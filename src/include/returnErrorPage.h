@@ -1,4 +1,6 @@
 #pragma once
 #include <string>
 
-void returnErrorPage(int client_fd, int errorCode, std::string contactMail);
\ No newline at end of file
+void initializeErrorPages(const std::string &contactMail); // renders every error response once, call after config load
+
+void returnErrorPage(int client_fd, int errorCode); // sends the prerendered page and closes client_fd
\ No newline at end of file
@@ -0,0 +1,43 @@
+#pragma once
+#include <string>
+#include <ctime>
+#include "ipAddr.h"
+
+// per-IP blocks, request counters and trust windows in a shared memory segment, so several faucet processes on
+// one port (SO_REUSEPORT) enforce one host-wide limit instead of one each
+
+// maps /dev/shm/faucet-<name>, creating it if this is the first process, false if it can't be used
+bool openSharedState(const std::string &name);
+
+bool sharedStateActive();
+
+// 0 if no process has it blocked, -1 if the address has no slot (the local state is all there is then)
+time_t sharedBlockedUntil(const IpAddr &ip);
+
+// sets ip's block for every process, replacing whatever was there: a shorter time shortens it, 0 lifts it
+// the others pick the change up on the address's next connection
+void sharedBlock(const IpAddr &ip, time_t blockedUntil);
+
+// counts a request from ip and returns how many it made this second across all processes
+int sharedCountRequest(const IpAddr &ip, time_t now);
+
+// the trust score windows, shared so spreading requests over the processes doesn't dilute them
+// all of them return -1 if the address has no slot, callers fall back to their own count then
+enum SharedWindow
+{
+    SharedHoneypots, // honeypot hits, 180s window
+    SharedNotFound,  // 404s, 60s window
+    SharedTimeouts,  // client timeouts, 60s window
+    SharedWindowCount
+};
+
+// counts a hit and returns the host-wide count, which restarts when the last hit is more than windowSeconds ago
+int sharedCountWindow(const IpAddr &ip, SharedWindow window, int windowSeconds, time_t now);
+
+int sharedWindowCount(const IpAddr &ip, SharedWindow window, int windowSeconds, time_t now); // read only
+
+// counts a request for the trust score and returns the host-wide requests in the last minute (a sliding estimate)
+int sharedCountRequestMinute(const IpAddr &ip, time_t now);
+
+// records score and returns the lowest one any process gave ip in the last minute
+int sharedLowestScore(const IpAddr &ip, int score, time_t now);
@@ -0,0 +1,31 @@
+#pragma once
+#include <string>
+#include <ctime>
+#include <sys/types.h>
+
+struct SiteEntry // one file or directory under SITE_DIR
+{
+    bool isDir;
+    bool complete;           // dirs only, every child is indexed (false past the entry cap, for unwatchable dirs, etc.)
+    off_t size;
+    time_t mtime;
+    std::string indexFile;   // dirs only, "index.html"/"index.htm" or empty
+    const char *contentType; // files only
+};
+
+enum class SiteLookup
+{
+    Found,   // entry is set
+    Missing, // definitely does not exist, no need to touch the filesystem
+    Unknown  // index can't tell (disabled, or the path is below an incomplete dir), use the filesystem
+};
+
+// walks siteDir into the in-memory index and sets up inotify watches, returns false if disabled/failed
+bool initializeSiteIndex(const std::string &siteDir);
+
+int siteIndexFd(); // inotify fd to poll on, -1 if the index isn't active
+
+void refreshSiteIndex(); // applies pending inotify events, call when siteIndexFd() is readable
+
+// relPath has no leading or trailing slash, "" is the site root
+SiteLookup lookupSite(const std::string &relPath, const SiteEntry *&entry);
@@ -0,0 +1,31 @@
+#pragma once
+#include <string>
+#include <ctime>
+#include <sys/types.h>
+
+// one path in a loaded .fpk, offsets are into sitePackFd()
+struct PackFile
+{
+    bool isDir;
+    off_t offset, length;
+    time_t mtime;
+    const char *contentType;          // files only
+    off_t gzOffset, gzLength;         // precompressed variants, length 0 if none
+    off_t brOffset, brLength;
+};
+
+// faucet --pack: bundles siteDir into a single .fpk file at outPath (written to a temp file and renamed into place)
+bool buildSitePack(const std::string &siteDir, const std::string &outPath);
+
+// maps packPath for serving, returns false if it can't be opened or isn't a valid pack
+bool initializeSitePack(const std::string &packPath);
+
+bool sitePackActive();
+
+int sitePackFd(); // fd to sendfile() pack contents from
+
+// picks up a pack swapped in by rename, checked at most once per second, returns true if a new pack was loaded
+bool refreshSitePack();
+
+// relPath has no leading or trailing slash, "" is the site root
+bool findPackFile(const std::string &relPath, PackFile &out);
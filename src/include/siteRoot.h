@@ -0,0 +1,9 @@
+#pragma once
+#include <string>
+
+// opens siteDir once as a directory fd that every request path is resolved against
+bool openSiteRoot(const std::string &siteDir);
+
+// opens rel (no leading slash, "" is the site root) beneath the site root, like open() it returns -1 and sets errno on failure
+// uses openat2(RESOLVE_BENEATH) so the kernel refuses anything escaping the root, symlinks included
+int openInSite(const char *rel, int flags);
@@ -0,0 +1,95 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <unordered_map>
+
+// Space-Saving top-K summary: at most capacity counters, a key not being tracked takes over the smallest one
+// (inheriting its count as the error bound), so anything with more than total/capacity hits is guaranteed in
+// slots are kept sorted by count, descending, and every update is O(1): a +1 only ever swaps an entry with the
+// first one of its own count run
+template <typename Key, typename Hash = std::hash<Key>>
+class SpaceSaving
+{
+public:
+    struct Entry
+    {
+        Key key;
+        uint64_t count; // upper bound on the true count
+        uint64_t error; // count - error is a lower bound
+    };
+
+    explicit SpaceSaving(size_t maxEntries) : capacity(maxEntries) { slots.reserve(maxEntries); }
+
+    void add(const Key &key)
+    {
+        total++;
+        auto found = index.find(key);
+        if (found != index.end())
+        {
+            increment(found->second);
+            return;
+        }
+        if (slots.size() < capacity)
+        {
+            // new entries have count 1, the smallest possible, so they go at the end
+            size_t pos = slots.size();
+            slots.push_back(Entry{key, 0, 0});
+            index.emplace(key, pos);
+            if (!runStart.count(0))
+                runStart[0] = pos;
+            increment(pos);
+            return;
+        }
+
+        // evict the minimum (the last slot), the newcomer may have had up to its count before
+        size_t pos = slots.size() - 1;
+        index.erase(slots[pos].key);
+        slots[pos].key = key;
+        slots[pos].error = slots[pos].count;
+        index.emplace(key, pos);
+        increment(pos);
+    }
+
+    const std::vector<Entry> &entries() const { return slots; } // highest count first
+
+    uint64_t totalCount() const { return total; }
+
+    void clear()
+    {
+        slots.clear();
+        index.clear();
+        runStart.clear();
+        total = 0;
+    }
+
+private:
+    size_t capacity;
+    uint64_t total = 0;
+    std::vector<Entry> slots;
+    std::unordered_map<Key, size_t, Hash> index; // key -> position in slots
+    std::unordered_map<uint64_t, size_t> runStart; // count -> first position holding it
+
+    void increment(size_t pos)
+    {
+        uint64_t c = slots[pos].count;
+        size_t first = runStart[c];
+        if (first != pos)
+        {
+            // move to the front of its run so the +1 keeps the order
+            std::swap(slots[first], slots[pos]);
+            index[slots[pos].key] = pos;
+            index[slots[first].key] = first;
+        }
+        slots[first].count = c + 1;
+
+        // first left run c, which now starts after it (or is gone)
+        if (first + 1 < slots.size() && slots[first + 1].count == c)
+            runStart[c] = first + 1;
+        else
+            runStart.erase(c);
+        // and joined run c + 1 as its last entry, starting it if it's new
+        if (!runStart.count(c + 1))
+            runStart[c + 1] = first;
+    }
+};
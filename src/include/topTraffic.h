@@ -0,0 +1,14 @@
+#pragma once
+#include <string>
+#include "ipAddr.h"
+
+// per-minute top-K (Space-Saving) of client IPs, request paths, User-Agents and 404 paths, constant memory and O(1) per update
+
+void noteClient(const IpAddr &ip); // every accepted connection, blocked ones included
+
+void noteRequest(const std::string &key, const std::string &userAgent); // canonical path key (no leading slash)
+
+void noteNotFound(const std::string &key);
+
+// {"window":60,"clients":{"current":[...],"previous":[...]},"paths":...,"userAgents":...,"notFound":...}
+std::string topTrafficJson();
@@ -0,0 +1,70 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "ipRanges.h"
+
+// everything the trust score looks at in the headers, one bit each, extracted in a single pass
+enum TrustFeature
+{
+    UaMissing,
+    UaSuspicious,    // first token list hit wins: suspicious, then trusted, else unknown
+    UaTrusted,
+    UaUnknown,
+    PlatformLegit,   // only when sec-ch-ua-platform is sent
+    PlatformUnknown,
+    PlatformOther,
+    HasReferer,
+    EncodingKnown,
+    EncodingOther,   // Accept-Encoding without any known token
+    EncodingMissing,
+    IpPublic,
+    IpPrivate,
+    IpLoopback,
+    IpDatacenter,
+    HoneypotHit,
+    TrustFeatureCount
+};
+
+// per-IP counters that are scored by thresholds instead of flags
+enum TrustCounter
+{
+    RequestsPerMinute,
+    HoneypotsPer3Minutes,
+    NotFoundPerMinute,
+    TimeoutsPerMinute, // connections that ran into HEADER_TIMEOUT, IDLE_TIMEOUT or MIN_SEND_RATE
+    TrustCounterCount
+};
+
+struct TrustBand
+{
+    int min;    // counter value from which the weight applies
+    int weight;
+};
+
+struct TrustRules
+{
+    int base;
+    int weights[TrustFeatureCount];
+    std::vector<std::string> tokens[TrustFeatureCount]; // substrings matched by the token features
+    std::vector<TrustBand> bands[TrustCounterCount];    // ascending min, the highest one reached applies
+};
+
+// loads trustRules.txt from the same dir as the exe, or the built-in defaults if it doesn't exist
+// a file with errors is reported and ignored, keeping the rules loaded before (safe to call again on SIGHUP)
+void loadTrustRules();
+
+const TrustRules &trustRules();
+
+// lowest counter value with a penalty (INT_MAX if the counter has no bands), safe to call from any thread
+int firstTrustBand(TrustCounter counter);
+
+uint32_t extractTrustFeatures(const std::string &headers, IpClass ipClass, bool honeypotHit); // bitmask of TrustFeature
+
+// which band of counter a value is in, 0 = below all of them
+uint8_t trustBand(TrustCounter counter, int value);
+
+// base + the weights of the features set + the weight of each counter's band, clamped 0-100
+int scoreTrust(uint32_t features, const uint8_t bands[TrustCounterCount]);
+
+std::string explainTrust(uint32_t features, const uint8_t bands[TrustCounterCount]); // per-feature contributions, for --explain
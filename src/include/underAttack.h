@@ -0,0 +1,22 @@
+#pragma once
+#include <string>
+
+// under attack mode, switched on when global 404s or turned away connections per minute pass their thresholds
+// (0 = that counter never triggers it), and off again once both stay under half of them for a minute
+void initializeUnderAttack(int notFoundPerMinute, int blocksPerMinute, int logSample, int rateLimit);
+
+void noteGlobalNotFound(); // any 404 sent
+
+void noteGlobalBlock(); // a blocked or denied connection turned away
+
+void updateUnderAttack(); // checks the thresholds and switches modes, call every loop tick
+
+bool underAttack(); // safe to call from the trust worker
+
+// logRequest keeps 1 line in UNDER_ATTACK_LOG_SAMPLE while under attack, every line otherwise
+bool keepLogLine();
+
+// REQUEST_RATELIMIT, or UNDER_ATTACK_RATELIMIT while under attack if that's stricter
+int currentRateLimit(int requestRateLimit);
+
+std::string underAttackJson(); // state, transition counts and the current rates for the status endpoint
@@ -0,0 +1,41 @@
+#include "include/ipAddr.h"
+#include <arpa/inet.h>
+#include <random>
+
+using namespace std;
+
+static const uint8_t v4MappedPrefix[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+
+static uint64_t randomSeed()
+{
+    random_device rd;
+    return ((uint64_t)rd() << 32) ^ rd();
+}
+
+const uint64_t ipHashSeed = randomSeed();
+
+bool parseIp(const string &text, IpAddr &out)
+{
+    if (inet_pton(AF_INET6, text.c_str(), out.bytes) == 1)
+        return true;
+    memcpy(out.bytes, v4MappedPrefix, sizeof(v4MappedPrefix));
+    return inet_pton(AF_INET, text.c_str(), out.bytes + 12) == 1;
+}
+
+IpAddr ipFromV4(const in_addr &addr)
+{
+    IpAddr ip;
+    memcpy(ip.bytes, v4MappedPrefix, sizeof(v4MappedPrefix));
+    memcpy(ip.bytes + 12, &addr.s_addr, 4);
+    return ip;
+}
+
+string ipToString(const IpAddr &ip)
+{
+    char buf[INET6_ADDRSTRLEN];
+    if (memcmp(ip.bytes, v4MappedPrefix, sizeof(v4MappedPrefix)) == 0)
+        inet_ntop(AF_INET, ip.bytes + 12, buf, sizeof(buf));
+    else
+        inet_ntop(AF_INET6, ip.bytes, buf, sizeof(buf));
+    return buf;
+}
@@ -0,0 +1,329 @@
+#include "include/ipRanges.h"
+#include "include/ipAddr.h"
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+
+using namespace std;
+
+// path-compressed binary trie over 128-bit addresses, IPv4 lives under ::ffff:0:0/96 like everywhere else
+// a lookup only visits nodes where prefixes branch, and after finish() it starts from a jump table on the first
+// 16 bits (of the IPv4 address for mapped ones), which keeps 500k+ prefixes to a handful of cache misses
+class PrefixTrie
+{
+public:
+    PrefixTrie() { nodes.push_back(Node{0, 0, 0, 0, {0, 0}}); } // root, the /0 prefix
+
+    bool empty() const { return nodes.size() == 1 && nodes[0].value == 0; }
+
+    // value 0 means "no value", an existing identical prefix is overwritten
+    void insert(uint64_t hi, uint64_t lo, unsigned len, uint8_t value)
+    {
+        jumpV4.clear(); // stale now, finish() again
+        jumpV6.clear();
+        hi &= maskHi(len);
+        lo &= maskLo(len);
+        uint32_t n = 0;
+        for (;;)
+        {
+            if (nodes[n].len == len)
+            {
+                nodes[n].value = value;
+                return;
+            }
+            unsigned b = bitAt(hi, lo, nodes[n].len);
+            uint32_t c = nodes[n].child[b];
+            if (c == 0)
+            {
+                nodes[n].child[b] = addNode(hi, lo, len, value);
+                return;
+            }
+            unsigned limit = len < nodes[c].len ? len : nodes[c].len;
+            unsigned common = commonPrefix(hi, lo, nodes[c].hi, nodes[c].lo, limit);
+            if (common == nodes[c].len)
+            {
+                n = c; // c covers the new prefix, go below it
+                continue;
+            }
+
+            // diverges inside c's compressed path, split it there
+            uint32_t mid = addNode(hi & maskHi(common), lo & maskLo(common), common, 0);
+            nodes[mid].child[bitAt(nodes[c].hi, nodes[c].lo, common)] = c;
+            nodes[n].child[b] = mid;
+            if (common == len)
+                nodes[mid].value = value;
+            else
+                nodes[mid].child[bitAt(hi, lo, common)] = addNode(hi, lo, len, value);
+            return;
+        }
+    }
+
+    // builds the jump tables, call once everything is inserted
+    void finish()
+    {
+        jumpV4.resize(jumpSize);
+        jumpV6.resize(jumpSize);
+        for (uint32_t i = 0; i < jumpSize; i++)
+        {
+            jumpV4[i] = descend(0, v4MappedLo | ((uint64_t)i << 16), 96 + jumpBits);
+            jumpV6[i] = descend((uint64_t)i << 48, 0, jumpBits);
+        }
+    }
+
+    uint8_t lookup(uint64_t hi, uint64_t lo) const
+    {
+        Jump start{0, nodes[0].value};
+        if (!jumpV4.empty())
+        {
+            if (hi == 0 && (lo >> 32) == 0xffff)
+                start = jumpV4[(lo >> 16) & (jumpSize - 1)];
+            else
+                start = jumpV6[hi >> 48];
+        }
+        return walk(start, hi, lo);
+    }
+
+    size_t size() const { return nodes.size(); }
+
+private:
+    struct Node
+    {
+        uint64_t hi, lo; // prefix bits, masked to len
+        uint8_t len;
+        uint8_t value;
+        uint32_t child[2]; // indexes into nodes, 0 is "none" since the root is never a child
+    };
+    vector<Node> nodes;
+
+    struct Jump
+    {
+        uint32_t node; // deepest node no longer than the jump prefix that matches it
+        uint8_t best;  // value of the longest match on the way there
+    };
+    static const unsigned jumpBits = 16;
+    static const uint32_t jumpSize = 1u << jumpBits;
+    static const uint64_t v4MappedLo = 0xffffULL << 32;
+    vector<Jump> jumpV4, jumpV6;
+
+    // follows hi/lo down while nodes stay within maxLen bits
+    Jump descend(uint64_t hi, uint64_t lo, unsigned maxLen) const
+    {
+        Jump j{0, nodes[0].value};
+        const Node *n = &nodes[0];
+        while (n->len < maxLen)
+        {
+            uint32_t c = n->child[bitAt(hi, lo, n->len)];
+            if (c == 0 || nodes[c].len > maxLen || !matches(nodes[c], hi, lo))
+                break;
+            n = &nodes[c];
+            j.node = c;
+            if (n->value)
+                j.best = n->value;
+        }
+        return j;
+    }
+
+    uint8_t walk(Jump start, uint64_t hi, uint64_t lo) const
+    {
+        uint8_t best = start.best;
+        const Node *n = &nodes[start.node];
+        while (n->len < 128)
+        {
+            uint32_t c = n->child[bitAt(hi, lo, n->len)];
+            if (c == 0)
+                break;
+            n = &nodes[c];
+            if (!matches(*n, hi, lo))
+                break;
+            if (n->value)
+                best = n->value;
+        }
+        return best;
+    }
+
+    static bool matches(const Node &n, uint64_t hi, uint64_t lo)
+    {
+        return ((hi ^ n.hi) & maskHi(n.len)) == 0 && ((lo ^ n.lo) & maskLo(n.len)) == 0;
+    }
+
+    uint32_t addNode(uint64_t hi, uint64_t lo, unsigned len, uint8_t value)
+    {
+        nodes.push_back(Node{hi, lo, (uint8_t)len, value, {0, 0}});
+        return (uint32_t)(nodes.size() - 1);
+    }
+
+    static uint64_t maskHi(unsigned len) { return len >= 64 ? ~0ULL : len == 0 ? 0 : ~0ULL << (64 - len); }
+    static uint64_t maskLo(unsigned len) { return len <= 64 ? 0 : len >= 128 ? ~0ULL : ~0ULL << (128 - len); }
+
+    static unsigned bitAt(uint64_t hi, uint64_t lo, unsigned i)
+    {
+        return i < 64 ? (hi >> (63 - i)) & 1 : (lo >> (127 - i)) & 1;
+    }
+
+    static unsigned commonPrefix(uint64_t ahi, uint64_t alo, uint64_t bhi, uint64_t blo, unsigned limit)
+    {
+        unsigned common;
+        if (ahi != bhi)
+            common = __builtin_clzll(ahi ^ bhi);
+        else if (alo != blo)
+            common = 64 + __builtin_clzll(alo ^ blo);
+        else
+            common = 128;
+        return common < limit ? common : limit;
+    }
+};
+
+// trie values, 0 is "no match"
+static const uint8_t accessAllow = 1, accessDeny = 2;
+static const uint8_t classLoopback = 1, classPrivate = 2, classDatacenter = 3;
+
+static PrefixTrie accessTrie;
+static PrefixTrie classTrie;
+
+static void splitAddress(const IpAddr &ip, uint64_t &hi, uint64_t &lo)
+{
+    hi = lo = 0;
+    for (int i = 0; i < 8; i++)
+    {
+        hi = (hi << 8) | ip.bytes[i];
+        lo = (lo << 8) | ip.bytes[8 + i];
+    }
+}
+
+// "a.b.c.d/n", "v6::/n" or a bare address (a single host)
+static bool parseCidr(const string &text, uint64_t &hi, uint64_t &lo, unsigned &len)
+{
+    size_t slash = text.find('/');
+    string addrText = text.substr(0, slash);
+    IpAddr addr;
+    if (!parseIp(addrText, addr))
+        return false;
+    bool isV4 = addrText.find(':') == string::npos;
+    unsigned maxLen = isV4 ? 32 : 128;
+    len = maxLen;
+    if (slash != string::npos)
+    {
+        const char *lenText = text.c_str() + slash + 1;
+        char *end;
+        long l = strtol(lenText, &end, 10);
+        if (end == lenText || *end != '\0' || l < 0 || l > (long)maxLen)
+            return false;
+        len = (unsigned)l;
+    }
+    if (isV4)
+        len += 96;
+    splitAddress(addr, hi, lo);
+    return true;
+}
+
+static void loadCidrFile(const string &path, PrefixTrie &trie, uint8_t value, const char *what)
+{
+    FILE *file = fopen(path.c_str(), "r");
+    if (!file)
+    {
+        printf("Couldn't open %s (%s), skipping.\n", path.c_str(), what);
+        return;
+    }
+    size_t loaded = 0, skipped = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), file))
+    {
+        // first word of the line, the rest (and # comments) is ignored
+        char *start = line;
+        while (*start == ' ' || *start == '\t')
+            ++start;
+        size_t wordLen = strcspn(start, " \t\r\n#");
+        if (wordLen == 0)
+            continue;
+        start[wordLen] = '\0';
+
+        uint64_t hi, lo;
+        unsigned len;
+        if (!parseCidr(start, hi, lo, len))
+        {
+            skipped++;
+            continue;
+        }
+        trie.insert(hi, lo, len, value);
+        loaded++;
+    }
+    fclose(file);
+    printf("Loaded %zu %s prefixes from %s%s\n", loaded, what, path.c_str(), skipped ? " (some invalid lines skipped)" : "");
+}
+
+void initializeIpRanges(const string &allowFile, const string &denyFile, const string &datacenterFile)
+{
+    // deny first so an identical prefix in the allow file overrides it
+    if (!denyFile.empty())
+        loadCidrFile(denyFile, accessTrie, accessDeny, "denied");
+    if (!allowFile.empty())
+        loadCidrFile(allowFile, accessTrie, accessAllow, "allowed");
+    if (!datacenterFile.empty())
+        loadCidrFile(datacenterFile, classTrie, classDatacenter, "datacenter");
+
+    // built in last, a datacenter list that happens to contain these doesn't make localhost untrusted
+    const struct
+    {
+        const char *cidr;
+        uint8_t value;
+    } builtinRanges[] = {
+        {"127.0.0.0/8", classLoopback},
+        {"::1/128", classLoopback},
+        {"10.0.0.0/8", classPrivate},
+        {"172.16.0.0/12", classPrivate},
+        {"192.168.0.0/16", classPrivate},
+        {"169.254.0.0/16", classPrivate},
+        {"fc00::/7", classPrivate},
+        {"fe80::/10", classPrivate},
+    };
+    for (const auto &range : builtinRanges)
+    {
+        uint64_t hi, lo;
+        unsigned len;
+        if (parseCidr(range.cidr, hi, lo, len))
+            classTrie.insert(hi, lo, len, range.value);
+    }
+
+    if (!accessTrie.empty())
+        accessTrie.finish();
+    classTrie.finish();
+}
+
+static uint8_t lookupTrie(const PrefixTrie &trie, const IpAddr &ip)
+{
+    uint64_t hi, lo;
+    splitAddress(ip, hi, lo);
+    return trie.lookup(hi, lo);
+}
+
+IpAccess lookupIpAccess(const IpAddr &ip)
+{
+    if (accessTrie.empty())
+        return IpAccess::Unlisted; // no lists configured
+    switch (lookupTrie(accessTrie, ip))
+    {
+    case accessAllow:
+        return IpAccess::Allow;
+    case accessDeny:
+        return IpAccess::Deny;
+    default:
+        return IpAccess::Unlisted;
+    }
+}
+
+IpClass lookupIpClass(const IpAddr &ip)
+{
+    switch (lookupTrie(classTrie, ip))
+    {
+    case classLoopback:
+        return IpClass::Loopback;
+    case classPrivate:
+        return IpClass::Private;
+    case classDatacenter:
+        return IpClass::Datacenter;
+    default:
+        return IpClass::Public;
+    }
+}
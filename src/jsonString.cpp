@@ -0,0 +1,73 @@
+#include "include/jsonString.h"
+#include <cstdio>
+
+using namespace std;
+
+// length of the UTF-8 sequence starting at i, 0 if it isn't a well-formed one
+static size_t utf8SequenceLength(const string &in, size_t i)
+{
+    unsigned char c = in[i];
+    size_t len;
+    if (c >= 0xc2 && c <= 0xdf)
+        len = 2;
+    else if (c >= 0xe0 && c <= 0xef)
+        len = 3;
+    else if (c >= 0xf0 && c <= 0xf4)
+        len = 4;
+    else
+        return 0;
+    if (i + len > in.size())
+        return 0;
+    // second byte range rules out overlong forms, utf-16 surrogates and code points past U+10FFFF
+    unsigned char second = in[i + 1], lo = 0x80, hi = 0xbf;
+    if (c == 0xe0)
+        lo = 0xa0;
+    else if (c == 0xed)
+        hi = 0x9f;
+    else if (c == 0xf0)
+        lo = 0x90;
+    else if (c == 0xf4)
+        hi = 0x8f;
+    if (second < lo || second > hi)
+        return 0;
+    for (size_t k = 1; k < len; k++)
+    {
+        if (((unsigned char)in[i + k] & 0xc0) != 0x80)
+            return 0;
+    }
+    return len;
+}
+
+void appendJsonString(string &out, const string &in)
+{
+    out += '"';
+    size_t i = 0;
+    while (i < in.size())
+    {
+        unsigned char c = in[i];
+        if (c == '"' || c == '\\')
+        {
+            out += '\\';
+            out += (char)c;
+            i++;
+        }
+        else if (c >= 0x20 && c < 0x7f)
+        {
+            out += (char)c;
+            i++;
+        }
+        else if (size_t len = c >= 0x80 ? utf8SequenceLength(in, i) : 0)
+        {
+            out.append(in, i, len);
+            i += len;
+        }
+        else
+        {
+            char esc[8];
+            snprintf(esc, sizeof(esc), "\\u%04x", c);
+            out += esc;
+            i++;
+        }
+    }
+    out += '"';
+}
@@ -19,7 +19,29 @@ int loadConfig(int &port,
                bool &evaluateTrustScore,
                int &trustScoreThreshold,
                bool &checkHoneypotPaths,
-               int &blockforDuration)
+               int &blockforDuration,
+               bool &useSiteIndex,
+               int &missCacheTtl,
+               std::string &sitePack,
+               std::string &blockedAction,
+               bool &persistBlocklist,
+               std::string &sharedState,
+               std::string &allowCidrs,
+               std::string &denyCidrs,
+               std::string &datacenterCidrs,
+               bool &counterSketch,
+               std::string &statusPath,
+               int &trustCacheTtl,
+               bool &asyncTrust,
+               int &underAttack404s,
+               int &underAttackBlocks,
+               int &underAttackLogSample,
+               int &underAttackRateLimit,
+               int &listenBacklog,
+               int &admissionQueue,
+               int &headerTimeout,
+               int &idleTimeout,
+               int &minSendRate)
 {
     std::ifstream envFile(".env");
     if (!envFile.is_open())
@@ -39,7 +61,29 @@ int loadConfig(int &port,
                      "EVALUATE_TRUSTSCORE=false\n"
                      "TRUSTSCORE_THRESHOLD=10\n"
                      "CHECK_HONEYPOT_PATHS=false\n"
-                     "BLOCKFOR_DURATION=600\n";
+                     "BLOCKFOR_DURATION=600\n"
+                     "SITE_INDEX=false\n"
+                     "MISS_CACHE_TTL=5\n"
+                     "SITE_PACK=\n"
+                     "BLOCKED_ACTION=403\n"
+                     "PERSIST_BLOCKLIST=false\n"
+                     "SHARED_STATE=\n"
+                     "ALLOW_CIDRS=\n"
+                     "DENY_CIDRS=\n"
+                     "DATACENTER_CIDRS=\n"
+                     "COUNTER_SKETCH=false\n"
+                     "STATUS_PATH=\n"
+                     "TRUST_CACHE_TTL=30\n"
+                     "ASYNC_TRUST=false\n"
+                     "UNDER_ATTACK_404S=0\n"
+                     "UNDER_ATTACK_BLOCKS=0\n"
+                     "UNDER_ATTACK_LOG_SAMPLE=100\n"
+                     "UNDER_ATTACK_RATELIMIT=2\n"
+                     "LISTEN_BACKLOG=511\n"
+                     "ADMISSION_QUEUE=0\n"
+                     "HEADER_TIMEOUT=10\n"
+                     "IDLE_TIMEOUT=5\n"
+                     "MIN_SEND_RATE=0\n";
 
         NewConfig.close();
         return 2;
@@ -180,6 +224,154 @@ int loadConfig(int &port,
             if (bfd >= 0) // 0 for no blocking
                 blockforDuration = bfd;
         }
+        else if (key == "SITE_INDEX") // keep an inotify-maintained index of SITE_DIR in memory
+        {
+            for (auto &c : value)
+                c = tolower(c);
+            if (value == "true")
+            {
+                useSiteIndex = true;
+            }
+            else
+            {
+                useSiteIndex = false;
+            }
+        }
+        else if (key == "MISS_CACHE_TTL") // seconds to remember paths that 404'd
+        {
+            int mct = std::atoi(value.c_str());
+            if (mct >= 0) // 0 disables the miss cache
+                missCacheTtl = mct;
+        }
+        else if (key == "SITE_PACK") // .fpk built with --pack, served instead of SITE_DIR
+        {
+            sitePack = value;
+        }
+        else if (key == "BLOCKED_ACTION") // what blocked clients get: 403, rst or close
+        {
+            for (auto &c : value)
+                c = tolower(c);
+            blockedAction = value;
+        }
+        else if (key == "PERSIST_BLOCKLIST") // keep blocks in blocklist.dat across restarts
+        {
+            for (auto &c : value)
+                c = tolower(c);
+            if (value == "true")
+            {
+                persistBlocklist = true;
+            }
+            else
+            {
+                persistBlocklist = false;
+            }
+        }
+        else if (key == "SHARED_STATE") // shared memory name for blocks/rate limits across processes
+        {
+            sharedState = value;
+        }
+        else if (key == "ALLOW_CIDRS") // file of networks that are never blocked or scored
+        {
+            allowCidrs = value;
+        }
+        else if (key == "DENY_CIDRS") // file of networks turned away on connect
+        {
+            denyCidrs = value;
+        }
+        else if (key == "DATACENTER_CIDRS") // file of hosting/datacenter networks, lowers the trust score
+        {
+            datacenterCidrs = value;
+        }
+        else if (key == "COUNTER_SKETCH") // estimate per-IP rates in fixed memory, exact state only for heavy hitters
+        {
+            for (auto &c : value)
+                c = tolower(c);
+            if (value == "true")
+            {
+                counterSketch = true;
+            }
+            else
+            {
+                counterSketch = false;
+            }
+        }
+        else if (key == "STATUS_PATH") // path of the JSON status endpoint, only answered for loopback and ALLOW_CIDRS
+        {
+            statusPath = value;
+        }
+        else if (key == "TRUST_CACHE_TTL") // seconds to reuse a trust verdict for the same IP and header fingerprint
+        {
+            int tct = std::atoi(value.c_str());
+            if (tct >= 0) // 0 disables the cache
+                trustCacheTtl = tct;
+        }
+        else if (key == "ASYNC_TRUST") // score requests on a worker thread after serving them, blocks apply from the next request
+        {
+            for (auto &c : value)
+                c = tolower(c);
+            if (value == "true")
+            {
+                asyncTrust = true;
+            }
+            else
+            {
+                asyncTrust = false;
+            }
+        }
+        else if (key == "UNDER_ATTACK_404S") // 404s per minute across all clients that switch on under attack mode, 0 = never
+        {
+            int ua4 = std::atoi(value.c_str());
+            if (ua4 >= 0)
+                underAttack404s = ua4;
+        }
+        else if (key == "UNDER_ATTACK_BLOCKS") // blocked/denied connections per minute that switch on under attack mode, 0 = never
+        {
+            int uab = std::atoi(value.c_str());
+            if (uab >= 0)
+                underAttackBlocks = uab;
+        }
+        else if (key == "UNDER_ATTACK_LOG_SAMPLE") // under attack, log 1 in this many lines
+        {
+            int uals = std::atoi(value.c_str());
+            if (uals >= 1)
+                underAttackLogSample = uals;
+        }
+        else if (key == "UNDER_ATTACK_RATELIMIT") // requests/second per IP while under attack, if stricter than REQUEST_RATELIMIT, 0 to keep it
+        {
+            int uarl = std::atoi(value.c_str());
+            if (uarl >= 0)
+                underAttackRateLimit = uarl;
+        }
+        else if (key == "LISTEN_BACKLOG") // connections the kernel queues while one is being served, capped by net.core.somaxconn
+        {
+            int lb = std::atoi(value.c_str());
+            if (lb >= 1)
+                listenBacklog = lb;
+        }
+        else if (key == "ADMISSION_QUEUE") // queued connections from which clients are shed with a 503, lowest trust first, 0 = off
+        {
+            int aq = std::atoi(value.c_str());
+            if (aq >= 0)
+                admissionQueue = aq;
+        }
+        else if (key == "HEADER_TIMEOUT") // seconds a client gets to send the whole request, 0 = no limit
+        {
+            int ht = std::atoi(value.c_str());
+            if (ht >= 0)
+                headerTimeout = ht;
+        }
+        else if (key == "IDLE_TIMEOUT") // seconds without progress reading the request or sending the response, 0 = no limit
+        {
+            int it = std::atoi(value.c_str());
+            if (it >= 0)
+                idleTimeout = it;
+        }
+        else if (key == "MIN_SEND_RATE") // bytes/second a client has to read file bodies at on average, 0 = no minimum
+        {
+            int msr = std::atoi(value.c_str());
+            if (msr >= 0)
+                minSendRate = msr;
+        }
     }
     return 0;
 }
\ No newline at end of file
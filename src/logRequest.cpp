@@ -1,5 +1,6 @@
 #include "include/logRequest.h"
 #include "include/evaluateTrust.h"
+#include "include/underAttack.h"
 #include <iostream>
 #include <fstream>
 #include <string>
@@ -12,6 +13,10 @@ void logRequest(const string &consoleOutput,
                 bool toggleLogging,
                 int logMaxLines)
 {
+    // under attack only a sample gets through, writing every line would slow down serving
+    if (!keepLogLine())
+        return;
+
     // log to console
     cout << consoleOutput << endl;
 
@@ -8,6 +8,7 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/stat.h>
+#include <poll.h>
 #include <signal.h>
 #include <cstdlib>
 #include <errno.h>
@@ -18,6 +19,7 @@
 #include <vector>
 #include <algorithm>
 #include <sstream>
+#include <unordered_map>
 
 #include "include/loadConfig.h"
 #include "include/return404.h"
@@ -28,6 +30,22 @@
 #include "include/headerManager.h"
 #include "include/evaluateTrust.h"
 #include "include/perMinute404.h"
+#include "include/siteIndex.h"
+#include "include/missCache.h"
+#include "include/sitePack.h"
+#include "include/siteRoot.h"
+#include "include/canonicalPath.h"
+#include "include/blockList.h"
+#include "include/sharedState.h"
+#include "include/ipRanges.h"
+#include "include/ipAddr.h"
+#include "include/expiryWheel.h"
+#include "include/topTraffic.h"
+#include "include/trustRules.h"
+#include "include/asyncTrust.h"
+#include "include/underAttack.h"
+#include "include/admission.h"
+#include "include/clientTimeouts.h"
 
 using namespace std;
 
@@ -38,6 +56,13 @@ static void sig_handler(int)
     keepRunning = 0;
 }
 
+static volatile sig_atomic_t reloadRequested = 0;
+
+static void reload_handler(int)
+{
+    reloadRequested = 1;
+}
+
 // config values
 int port = 8080;                 // port to listen on
 string siteDir = "public";       // site root directory, relative to executable
@@ -53,6 +78,30 @@ bool evaluateTrustScore = false; // evaluate trust score on each request
 int trustScoreThreshold = 10;    // block requests with trust score under this
 bool checkHoneypotPaths = false; // check for honeypot paths such as /admin, /wp-login.php, etc.
 int blockforDuration = 600;      // duration in seconds to block an IP for if it goes below the trust score threshold
+bool useSiteIndex = false;       // keep an inotify-maintained index of siteDir in memory
+int missCacheTtl = 5;            // seconds to remember paths that 404'd, 0 for none
+string sitePack = "";            // .fpk file to serve instead of siteDir, empty for none
+string blockedAction = "403";    // what blocked clients get: 403, rst or close
+bool persistBlocklist = false;   // keep blocks in blocklist.dat across restarts
+string sharedState = "";         // shared memory name for blocks/rate limits across processes, empty for none
+string allowCidrs = "";          // file of networks that are never blocked or scored
+string denyCidrs = "";           // file of networks turned away on connect
+string datacenterCidrs = "";     // file of hosting/datacenter networks, lowers the trust score
+bool counterSketch = false;      // estimate per-IP rates in fixed memory, exact state only for heavy hitters
+string statusPath = "";          // path of the JSON status endpoint (loopback/ALLOW_CIDRS only), empty for none
+int trustCacheTtl = 30;          // seconds to reuse a trust verdict for the same IP and header fingerprint, 0 = off
+bool asyncTrust = false;         // score requests on a worker thread after serving them, blocks apply from the next request
+int underAttack404s = 0;         // 404s per minute across all clients that switch on under attack mode, 0 = never
+int underAttackBlocks = 0;       // blocked/denied connections per minute that switch on under attack mode, 0 = never
+int underAttackLogSample = 100;  // under attack, log 1 in this many lines
+int underAttackRateLimit = 2;    // requests/second per IP while under attack, if stricter than REQUEST_RATELIMIT, 0 to keep it
+int listenBacklog = 511;         // connections the kernel queues while one is being served, capped by net.core.somaxconn
+int admissionQueue = 0;          // queued connections from which clients are shed with a 503, lowest trust first, 0 = off
+int headerTimeout = 10;          // seconds a client gets to send the whole request, 0 = no limit
+int idleTimeout = 5;             // seconds without progress reading the request or sending the response, 0 = no limit
+int minSendRate = 0;             // bytes/second a client has to read file bodies at on average, 0 = no minimum
+string statusKey = "";           // statusPath as a canonical key
+time_t startTime = 0;
 
 string authUser = "";
 string authPass = "";
@@ -62,20 +111,27 @@ std::string expectedAuthValue; // basic base64
 // ip ratelimit struct
 struct IpRateLimit
 {
-    string ip;
     int requestCount;
     time_t lastRequestTime;
 };
 
-std::vector<IpRateLimit> ipRateLimits;
+std::unordered_map<IpAddr, IpRateLimit, IpAddrHash> ipRateLimits;
+ExpiryWheel<IpAddr> ipRateLimitsExpiry; // entries only matter for the second they were made in
 
-struct blockedClients // blocked clients based on trust score until blockforDuration ends
+static void expireRateLimits()
 {
-    string ip;
-    time_t blockedUntil;
-};
+    time_t now = time(nullptr);
+    ipRateLimitsExpiry.advance(now, [now](const IpAddr &ip) -> time_t
+                               {
+                                   auto it = ipRateLimits.find(ip);
+                                   if (it == ipRateLimits.end())
+                                       return 0;
+                                   if (it->second.lastRequestTime >= now)
+                                       return now + 1; // still counting this second
+                                   ipRateLimits.erase(it);
+                                   return 0; });
+}
 
-vector<blockedClients> blockedClientList;
 
 // base64 encoder for auth
 static std::string base64Encode(const std::string &in)
@@ -112,57 +168,6 @@ static std::string base64Encode(const std::string &in)
     return out;
 }
 
-static void clearBlockedClients()
-{
-    time_t now = time(nullptr);
-    blockedClientList.erase(
-        std::remove_if(blockedClientList.begin(), blockedClientList.end(),
-                       [now](const blockedClients &entry)
-                       {
-                           return entry.blockedUntil <= now;
-                       }),
-        blockedClientList.end());
-}
-
-static bool percentDecode(const char *in, char *out, size_t outSize) // percent decode a path, returns false if invalid sequence found
-{
-    size_t oi = 0;
-    for (size_t i = 0; in[i] != '\0'; ++i)
-    {
-        if (oi + 1 >= outSize)
-            break; // truncate silently (could also fail)
-        unsigned char c = (unsigned char)in[i];
-        if (c == '%')
-        {
-            if (!isxdigit((unsigned char)in[i + 1]) || !isxdigit((unsigned char)in[i + 2]))
-            {
-                return false; // invalid sequence
-            }
-            auto hexVal = [](char h) -> int
-            {
-                if (h >= '0' && h <= '9')
-                    return h - '0';
-                if (h >= 'a' && h <= 'f')
-                    return 10 + (h - 'a');
-                if (h >= 'A' && h <= 'F')
-                    return 10 + (h - 'A');
-                return 0;
-            };
-            int hi = hexVal(in[i + 1]);
-            int lo = hexVal(in[i + 2]);
-            out[oi++] = (char)((hi << 4) | lo);
-            i += 2;
-        }
-        else
-        {
-            // Leave other bytes as-is. We do not translate '+' to space in path section.
-            out[oi++] = (char)c;
-        }
-    }
-    out[oi] = '\0';
-    return true;
-}
-
 static bool parseRangeHeader(const std::string &headers, off_t fileSize, off_t &outStart, off_t &outEnd) // returns false if no Range header found or invalid
 {
     // locate "Range:" case-insensitive
@@ -254,6 +259,243 @@ static bool parseRangeHeader(const std::string &headers, off_t fileSize, off_t &
     return false; // not found
 }
 
+static const off_t sendChunk = 256 * 1024;
+
+// sends the header followed by len bytes of fd starting at start
+static void sendFileBody(int client_fd, int fd, ResponseHeader &header, off_t start, off_t len)
+{
+    if (!sendHeader(client_fd, header, len > 0))
+        return;
+    off_t off = start;
+    off_t end = start + len;
+    startBodyDeadline();
+    while (off < end)
+    {
+        // in chunks, so a reader that keeps up just barely still gets its rate checked
+        ssize_t s = sendfile(client_fd, fd, &off, std::min<off_t>(end - off, sendChunk));
+        if (s <= 0)
+        {
+            if (s < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                noteStalledSend(); // nothing read for IDLE_TIMEOUT
+            break; // error, EOF or client went away (EPIPE/ECONNRESET)
+        }
+        if (!bodyKeepsUp(off - start))
+            break; // slower than MIN_SEND_RATE
+    }
+}
+
+// sends size bytes of fd starting at base as one file, honouring a Range header if present, closes client_fd
+static void serveFileRange(int client_fd, int fd, off_t base, off_t size, const char *ctype, const char *encoding, bool varyEncoding,
+                           const char *request, size_t requestLen)
+{
+    // check for Range header, and send partial content if present
+    const char *hdrEnd = strstr(request, "\r\n\r\n");
+    size_t headerLen = hdrEnd ? (size_t)(hdrEnd - request) : requestLen;
+    std::string headersAll(request, headerLen);
+    off_t rangeStart = 0, rangeEnd = 0; // inclusive
+    bool partial = parseRangeHeader(headersAll, size, rangeStart, rangeEnd);
+
+    if (partial && (size == 0 || rangeStart < 0 || rangeEnd < rangeStart || rangeEnd >= size))
+    {
+        // cannot satisfy any range on empty file, or invalid (parse function should guarantee end < size, but double check) -> 416
+        ResponseHeader header("416 Range Not Satisfiable");
+        header.addf("Content-Range: bytes */%lld", (long long)size);
+        header.add("Content-Length: 0");
+        sendHeader(client_fd, header, false);
+        close(client_fd);
+        return;
+    }
+
+    off_t sendStart = partial ? rangeStart : 0;
+    off_t contentLen = partial ? (rangeEnd - rangeStart + 1) : size;
+
+    ResponseHeader header(partial ? "206 Partial Content" : "200 OK");
+    header.addf("Content-Length: %lld", (long long)contentLen);
+    header.addf("Content-Type: %s", ctype);
+    if (encoding)
+        header.addf("Content-Encoding: %s", encoding);
+    if (varyEncoding)
+        header.add("Vary: Accept-Encoding");
+    header.add("Accept-Ranges: bytes");
+    if (partial)
+        header.addf("Content-Range: bytes %lld-%lld/%lld", (long long)rangeStart, (long long)rangeEnd, (long long)size);
+    sendFileBody(client_fd, fd, header, base + sendStart, contentLen);
+
+    close(client_fd);
+}
+
+// sends an opened regular file, honouring a Range header if present, closes both fds
+static void serveRegularFile(int client_fd, int fd, const struct stat &st, const char *ctype, const char *request, size_t requestLen)
+{
+    serveFileRange(client_fd, fd, 0, st.st_size, ctype, nullptr, false, request, requestLen);
+    close(fd);
+}
+
+// true if the Accept-Encoding header lists coding without q=0
+static bool acceptsEncoding(const char *request, size_t requestLen, const char *coding)
+{
+    // the request line has NULs punched into it by now, so search by length
+    static const char name[] = "\r\nAccept-Encoding:";
+    const size_t nameLen = sizeof(name) - 1;
+    const char *end = request + requestLen;
+    const char *line = nullptr;
+    for (const char *p = request; p + nameLen <= end && !line; ++p)
+        if (strncasecmp(p, name, nameLen) == 0)
+            line = p + nameLen;
+    if (!line)
+        return false;
+    const char *lineEnd = (const char *)memchr(line, '\r', end - line);
+    if (!lineEnd)
+        lineEnd = end;
+    size_t codingLen = strlen(coding);
+    for (const char *p = line; p < lineEnd;)
+    {
+        while (p < lineEnd && (*p == ' ' || *p == '\t' || *p == ','))
+            ++p;
+        const char *tokEnd = p;
+        while (tokEnd < lineEnd && *tokEnd != ',' && *tokEnd != ';' && *tokEnd != ' ')
+            ++tokEnd;
+        const char *itemEnd = (const char *)memchr(p, ',', lineEnd - p);
+        if (!itemEnd)
+            itemEnd = lineEnd;
+        if ((size_t)(tokEnd - p) == codingLen && strncasecmp(p, coding, codingLen) == 0)
+        {
+            // coding;q=0 means explicitly not acceptable
+            std::string params(tokEnd, itemEnd);
+            params.erase(std::remove(params.begin(), params.end(), ' '), params.end());
+            return params.rfind(";q=0", 0) != 0 || params.find_first_of("123456789") != std::string::npos;
+        }
+        p = itemEnd;
+    }
+    return false;
+}
+
+// 301 to the canonical trailing slash form of a directory, keeping the query string
+static void sendSlashRedirect(int client_fd, const std::string &key, const std::string &query)
+{
+    std::string location = "/";
+    appendEncodedPath(location, key);
+    location += "/";
+    if (!query.empty())
+        location += "?" + query;
+    ResponseHeader header("301 Moved Permanently");
+    header.addf("Location: %s", location.c_str());
+    header.add("Content-Length: 0");
+    sendHeader(client_fd, header, false);
+    close(client_fd);
+}
+
+// JSON snapshot of what the server is seeing, for STATUS_PATH
+static void serveStatus(int client_fd)
+{
+    std::string body = "{\"uptime\":" + std::to_string(time(nullptr) - startTime) + ",\"top\":" + topTrafficJson() + ",\"underAttack\":" + underAttackJson() + ",\"admission\":" + admissionJson() + "}";
+    ResponseHeader header("200 OK");
+    header.addf("Content-Length: %zu", body.size());
+    header.add("Content-Type: application/json");
+    header.add("Cache-Control: no-store");
+    if (sendHeader(client_fd, header, true))
+        sendAll(client_fd, body.data(), body.size());
+    close(client_fd);
+}
+
+// serves index.html or index.htm from dirRel if one exists, returns true if served (client_fd closed)
+static bool tryServeIndex(int client_fd, const std::string &dirRel)
+{
+    const char *indices[] = {"index.html", "index.htm"};
+    for (const char *idx : indices)
+    {
+        std::string idxRel = dirRel.empty() ? idx : dirRel + "/" + idx;
+        int fd = openInSite(idxRel.c_str(), O_RDONLY);
+        if (fd == -1)
+            continue;
+        struct stat ist{};
+        if (fstat(fd, &ist) == 0 && S_ISREG(ist.st_mode))
+        {
+            ResponseHeader header("200 OK");
+            header.addf("Content-Length: %lld", (long long)ist.st_size);
+            header.addf("Content-Type: %s", guessContentType(idx));
+            header.add("Accept-Ranges: bytes");
+            sendFileBody(client_fd, fd, header, 0, ist.st_size);
+            close(fd);
+            close(client_fd);
+            return true;
+        }
+        close(fd);
+    }
+    return false;
+}
+
+// custom 404 page comes from the pack as well
+static void loadPack404Page()
+{
+    std::string key = Page404;
+    while (!key.empty() && key.front() == '/')
+        key.erase(0, 1);
+    PackFile page{};
+    if (key.empty() || !findPackFile(key, page) || page.isDir || page.length > 4 * 1024 * 1024)
+    {
+        set404PageBody(nullptr, 0);
+        return;
+    }
+    std::string body((size_t)page.length, '\0');
+    if (pread(sitePackFd(), &body[0], body.size(), page.offset) != (ssize_t)body.size())
+    {
+        perror("pread");
+        set404PageBody(nullptr, 0);
+        return;
+    }
+    set404PageBody(body.data(), body.size());
+}
+
+// serves a request straight out of the site pack, key is the path without leading/trailing slashes
+static void servePackRequest(int client_fd, const std::string &key, bool hasTrailingSlash, const std::string &query,
+                             const char *request, size_t requestLen, const IpAddr &ip)
+{
+    PackFile file{};
+    if (!findPackFile(key, file) || (!file.isDir && hasTrailingSlash))
+    {
+        // return 418 for /imateapot418 if file/dir does not exist
+        if (key == "imateapot418")
+            returnErrorPage(client_fd, 418);
+        else
+            return404(client_fd, ip, key);
+        return;
+    }
+    if (file.isDir)
+    {
+        if (!hasTrailingSlash)
+        {
+            sendSlashRedirect(client_fd, key, query);
+            return;
+        }
+        // packs carry no directory listings, only index files
+        std::string dirPrefix = key.empty() ? "" : key + "/";
+        if (!findPackFile(dirPrefix + "index.html", file) && !findPackFile(dirPrefix + "index.htm", file))
+        {
+            return404(client_fd, ip, key);
+            return;
+        }
+    }
+
+    // prefer a precompressed variant if the client takes it
+    off_t offset = file.offset, length = file.length;
+    const char *encoding = nullptr;
+    if (file.brLength > 0 && acceptsEncoding(request, requestLen, "br"))
+    {
+        offset = file.brOffset;
+        length = file.brLength;
+        encoding = "br";
+    }
+    else if (file.gzLength > 0 && acceptsEncoding(request, requestLen, "gzip"))
+    {
+        offset = file.gzOffset;
+        length = file.gzLength;
+        encoding = "gzip";
+    }
+    bool hasVariants = file.brLength > 0 || file.gzLength > 0;
+    serveFileRange(client_fd, sitePackFd(), offset, length, file.contentType, encoding, hasVariants, request, requestLen);
+}
+
 int main(int argc, char *argv[])
 {
     struct sigaction sa{};
@@ -262,6 +504,13 @@ int main(int argc, char *argv[])
     sa.sa_flags = 0;
     sigaction(SIGINT, &sa, nullptr);
 
+    // SIGHUP re-reads trustRules.txt between connections
+    struct sigaction sa_hup{};
+    sa_hup.sa_handler = reload_handler;
+    sigemptyset(&sa_hup.sa_mask);
+    sa_hup.sa_flags = 0;
+    sigaction(SIGHUP, &sa_hup, nullptr);
+
     // Ignore SIGPIPE so that aborted client connections during large file/video
     // transfers don't terminate the process
     struct sigaction sa_pipe{};
@@ -272,6 +521,17 @@ int main(int argc, char *argv[])
 
     printf("{{ faucet http server }}\n");
 
+    // --pack is an offline build, it must not touch the config, shared memory or blocklist.dat of a running server
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--pack") == 0 && i + 2 < argc)
+        {
+            // bundle a site dir into a .fpk for SITE_PACK and exit, mime.types overrides apply like when serving
+            initializeMimeTypes();
+            return buildSitePack(argv[i + 1], argv[i + 2]) ? 0 : 1;
+        }
+    }
+
     // load config
     int confResult = loadConfig(port,
                                 siteDir,
@@ -286,7 +546,29 @@ int main(int argc, char *argv[])
                                 evaluateTrustScore,
                                 trustScoreThreshold,
                                 checkHoneypotPaths,
-                                blockforDuration);
+                                blockforDuration,
+                                useSiteIndex,
+                                missCacheTtl,
+                                sitePack,
+                                blockedAction,
+                                persistBlocklist,
+                                sharedState,
+                                allowCidrs,
+                                denyCidrs,
+                                datacenterCidrs,
+                                counterSketch,
+                                statusPath,
+                                trustCacheTtl,
+                                asyncTrust,
+                                underAttack404s,
+                                underAttackBlocks,
+                                underAttackLogSample,
+                                underAttackRateLimit,
+                                listenBacklog,
+                                admissionQueue,
+                                headerTimeout,
+                                idleTimeout,
+                                minSendRate);
     if (confResult == 1)
     {
         printf("Failed to load config, check the .env file.\n");
@@ -303,6 +585,59 @@ int main(int argc, char *argv[])
     {
         initializeHoneypotPaths();
     }
+    setTrustCacheTtl(trustCacheTtl);
+    if (evaluateTrustScore)
+    {
+        loadTrustRules();
+    }
+
+    // blocks and rate limits shared with other faucet processes on this host
+    if (!sharedState.empty() && openSharedState(sharedState))
+    {
+        printf("Sharing blocks and rate limits with other processes as %s\n", sharedState.c_str());
+    }
+
+    // how blocked clients are turned away
+    initializeBlockList(blockedAction, toggleLogging, logMaxLines);
+
+    // deadlines for the connection being served, so slow clients can't hold the loop
+    initializeClientTimeouts(headerTimeout, idleTimeout, minSendRate);
+
+    // sheds listings, full error pages and most logging when 404s or blocks spike
+    initializeUnderAttack(underAttack404s, underAttackBlocks, underAttackLogSample, underAttackRateLimit);
+
+    // allow/deny networks and datacenter ranges for the trust score
+    initializeIpRanges(allowCidrs, denyCidrs, datacenterCidrs);
+
+    // bounded memory per-IP counters, for proxies that pass along forged addresses
+    if (counterSketch)
+    {
+        useTrustSketches();
+        use404Sketch();
+    }
+
+    // status endpoint, matched on the canonical key so any spelling of the path works
+    if (!statusPath.empty())
+    {
+        CanonicalPath canonical;
+        if (canonicalizePath(statusPath.c_str(), canonical) && !canonical.key.empty())
+            statusKey = canonical.key;
+        else
+            printf("Invalid STATUS_PATH %s, status endpoint disabled.\n", statusPath.c_str());
+    }
+    startTime = time(nullptr);
+
+    // blocks from before a restart
+    if (persistBlocklist)
+    {
+        loadPersistedBlocks("blocklist.dat");
+    }
+
+    // load mime.types override if present
+    initializeMimeTypes();
+
+    // render error responses once, they only depend on config
+    initializeErrorPages(contactEmail);
 
     // convert authCredentials to authuser/authpass
     if (!authCredentials.empty())
@@ -352,19 +687,53 @@ int main(int argc, char *argv[])
             port = atoi(argv[i + 1]);
             i++;
         }
+        else if (strcmp(argv[i], "--explain") == 0)
+        {
+            // print how each trust rule added up to the score
+            setTrustExplain(true);
+        }
         else if (strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0)
         {
-            printf("Usage: %s [--port <port>] [--help]\n", argv[0]);
+            printf("Usage: %s [--port <port>] [--pack <site dir> <out.fpk>] [--explain] [--help]\n", argv[0]);
             return 0;
         }
         else
         {
             printf("Unknown argument: %s\n", argv[i]);
-            printf("Usage: %s [--port <port>] [--help]\n", argv[0]);
+            printf("Usage: %s [--port <port>] [--pack <site dir> <out.fpk>] [--explain] [--help]\n", argv[0]);
             return 1;
         }
     }
 
+    if (!sitePack.empty())
+    {
+        // serve everything from the pack, siteDir is only used for packing
+        if (!initializeSitePack(sitePack))
+        {
+            printf("Failed to load SITE_PACK %s\n", sitePack.c_str());
+            return 1;
+        }
+        loadPack404Page();
+    }
+    else
+    {
+        // every request path is resolved beneath this fd
+        if (!openSiteRoot(siteDir))
+            printf("Couldn't open site directory %s, every request will 404.\n", siteDir.empty() ? "." : siteDir.c_str());
+
+        // load custom 404 page into memory
+        initialize404Page(siteDir, Page404);
+
+        // index the site so lookups (and misses especially) don't need the filesystem
+        if (useSiteIndex)
+        {
+            initializeSiteIndex(siteDir);
+        }
+
+        // remember recent misses so repeated probes for the same paths skip the filesystem
+        initializeMissCache(siteDir, missCacheTtl);
+    }
+
     // create the socket
     int sock = socket(AF_INET, SOCK_STREAM, 0);
     if (sock == -1)
@@ -374,6 +743,11 @@ int main(int argc, char *argv[])
     }
     int opt = 1;
     setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    if (sharedStateActive())
+    {
+        // processes sharing state share the port too, the kernel spreads connections over them
+        setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
+    }
 
     // struct for the bind
     sockaddr_in addr{};
@@ -393,17 +767,24 @@ int main(int argc, char *argv[])
     printf("Listening on %s:%d, serving from %s. %s %s\n",
            ip,
            ntohs(addr.sin_port),
-           siteDir.c_str(),
+           sitePack.empty() ? siteDir.c_str() : sitePack.c_str(),
            authEnabled ? ("Authentication enabled (user: " + authUser + ")").c_str() : "",
            evaluateTrustScore ? "Trust score evaluation enabled." : "");
     fflush(stdout);
 
     // listen
-    if (listen(sock, 10) < 0)
+    if (listen(sock, listenBacklog) < 0)
     {
         perror("listen");
         return 1;
     }
+    initializeAdmission(sock, admissionQueue);
+
+    // from here on the trust state belongs to the worker
+    if (evaluateTrustScore && asyncTrust)
+    {
+        startAsyncTrust(checkHoneypotPaths);
+    }
 
     printf("---\n");
 
@@ -413,6 +794,57 @@ int main(int argc, char *argv[])
         if (!keepRunning)
             break;
 
+        // wait for a connection, applying site changes as they come in (poll skips the -1 fds of disabled features)
+        struct pollfd pfds[4] = {{sock, POLLIN, 0}, {siteIndexFd(), POLLIN, 0}, {missCacheFd(), POLLIN, 0}, {asyncTrustFd(), POLLIN, 0}};
+        int ready = poll(pfds, 4, 1000);
+        if (ready < 0 && errno != EINTR)
+        {
+            perror("poll");
+            break;
+        }
+        if (ready > 0 && (pfds[1].revents & POLLIN))
+            refreshSiteIndex();
+        if (ready > 0 && (pfds[2].revents & POLLIN))
+            refreshMissCache();
+        if (refreshSitePack())
+            loadPack404Page(); // new pack swapped in
+        if (ready > 0 && (pfds[3].revents & POLLIN))
+        {
+            // clients the worker scored too low are turned away from their next connection on
+            for (const auto &result : takeTrustResults())
+            {
+                noteAdmissionScore(result.ip, result.score);
+                if (result.score > trustScoreThreshold || isClientBlocked(result.ip))
+                    continue; // fine, or more of its requests were queued before the first block landed
+                blockClient(result.ip, time(nullptr) + blockforDuration);
+                auto now = time(nullptr);
+                char nowbuf[32];
+                strftime(nowbuf, sizeof(nowbuf), "%d-%m-%Y %H:%M:%S", localtime(&now));
+                char blockedBuffer[256];
+                snprintf(blockedBuffer, sizeof(blockedBuffer), "[%s] Blocked %s due to low trust score (%d)", nowbuf, ipToString(result.ip).c_str(), result.score);
+                string blockedOutput = blockedBuffer;
+                logRequest(blockedOutput, toggleLogging, logMaxLines);
+            }
+        }
+        updateUnderAttack();
+        expireAdmission();
+        expireClientTimeouts();
+        expireBlockedClients();
+        if (asyncTrustFd() == -1)
+            expireTrustWindows(); // the worker does its own
+        expire404PMentries();
+        expireRateLimits();
+        if (reloadRequested)
+        {
+            reloadRequested = 0;
+            if (evaluateTrustScore && asyncTrustFd() != -1)
+                requestAsyncTrustReload();
+            else if (evaluateTrustScore)
+                reloadTrustRules();
+        }
+        if (ready <= 0 || !(pfds[0].revents & POLLIN))
+            continue;
+
         sockaddr_in client_addr{};
         socklen_t client_len = sizeof(client_addr);
         int client_fd = accept(sock, (struct sockaddr *)&client_addr, &client_len);
@@ -431,6 +863,28 @@ int main(int argc, char *argv[])
 
         char clientIp[INET_ADDRSTRLEN];
         inet_ntop(AF_INET, &client_addr.sin_addr, clientIp, sizeof(clientIp));
+        IpAddr clientAddr = ipFromV4(client_addr.sin_addr); // what the per-client tables key on, clientIp is for logs
+
+        // turn denied and blocked clients away before reading anything (behind a proxy the real ip is only known after the headers)
+        IpAccess access = IpAccess::Unlisted;
+        if (!trustXRealIp)
+        {
+            noteClient(clientAddr);
+            access = lookupIpAccess(clientAddr);
+            if (access == IpAccess::Deny)
+            {
+                rejectDeniedClient(client_fd, clientAddr);
+                continue;
+            }
+            BlockedClient *blocked = access == IpAccess::Allow ? nullptr : hitBlockedClient(clientAddr);
+            if (blocked)
+            {
+                rejectBlockedClient(client_fd, clientAddr, *blocked);
+                continue;
+            }
+            if (access != IpAccess::Allow && shedConnection(client_fd, clientAddr))
+                continue; // overloaded and not trusted enough to jump the queue
+        }
 
         // log request /w timestamp
         auto t = time(nullptr);
@@ -443,8 +897,17 @@ int main(int argc, char *argv[])
         ssize_t used = 0;
         const char *eolmark = "\r\n\r\n"; // until eol
         bool closedEarly = false;
+        bool timedOut = false;
+        startClientDeadlines(client_fd);
         while (used < (ssize_t)sizeof(buffer) - 1)
         {
+            if (!waitForRequestData(client_fd))
+            {
+                // trickling the request in (or sending nothing) past HEADER_TIMEOUT/IDLE_TIMEOUT
+                close(client_fd);
+                timedOut = true;
+                break;
+            }
             ssize_t recvd = recv(client_fd, buffer + used, sizeof(buffer) - 1 - used, 0);
             if (recvd <= 0)
             {
@@ -460,7 +923,46 @@ int main(int argc, char *argv[])
                 break; // got all headers
         }
 
-        string effectiveClientIp = clientIp;
+        // behind a proxy the timeout is the proxy's, whose address isn't worth penalizing
+        if (timedOut)
+        {
+            if (!trustXRealIp)
+            {
+                buffer[used] = 0;
+                noteClientTimeout(clientAddr);
+                char timeoutBuffer[256];
+                snprintf(timeoutBuffer, sizeof(timeoutBuffer), "[%s] Timed out reading the request from %s (%d in the last minute)",
+                         timebuf, clientIp, getTimeoutPMcount(clientAddr));
+                logRequest(timeoutBuffer, toggleLogging, logMaxLines);
+
+                // score what it sent, the timeouts count against it, so a slowloris gets blocked like a flood
+                if (evaluateTrustScore && access != IpAccess::Allow)
+                {
+                    std::string partial(buffer, (size_t)used);
+                    if (asyncTrustFd() != -1)
+                    {
+                        queueTrustEvaluation(clientAddr, move(partial), get404PMcount(clientAddr), getTimeoutPMcount(clientAddr));
+                    }
+                    else
+                    {
+                        int trustScore = evaluateTrust(clientAddr, partial, checkHoneypotPaths, get404PMcount(clientAddr), getTimeoutPMcount(clientAddr));
+                        noteAdmissionScore(clientAddr, trustScore);
+                        if (trustScore <= trustScoreThreshold)
+                        {
+                            blockClient(clientAddr, time(nullptr) + blockforDuration);
+                            char blockedBuffer[256];
+                            snprintf(blockedBuffer, sizeof(blockedBuffer), "[%s] Blocked %s due to low trust score (%d)", timebuf, clientIp, trustScore);
+                            logRequest(blockedBuffer, toggleLogging, logMaxLines);
+                        }
+                    }
+                }
+            }
+            continue;
+        }
+
+        IpAddr effectiveClientAddr = clientAddr;
+        char effectiveClientIp[INET6_ADDRSTRLEN];
+        snprintf(effectiveClientIp, sizeof(effectiveClientIp), "%s", clientIp);
 
         if (trustXRealIp) // if enabled, try to extract proxy-provided client IP
         {
@@ -508,101 +1010,82 @@ int main(int argc, char *argv[])
                 }
             }
 
-            if (!candidate.empty())
+            // Validate IPv4 or IPv6
+            IpAddr candidateAddr;
+            if (!candidate.empty() && parseIp(candidate, candidateAddr))
             {
-                // Validate IPv4 or IPv6
-                unsigned char tmp[sizeof(struct in6_addr)];
-                bool ok = (inet_pton(AF_INET, candidate.c_str(), tmp) == 1) ||
-                          (inet_pton(AF_INET6, candidate.c_str(), tmp) == 1);
-                if (ok)
-                    effectiveClientIp = candidate;
+                effectiveClientAddr = candidateAddr;
+                snprintf(effectiveClientIp, sizeof(effectiveClientIp), "%s", candidate.c_str());
             }
         }
 
-        // check if client is in block list
+        setDeadlineClient(effectiveClientAddr); // slow reads of the response count against the real client
+
+        // same fast path for the proxied ip
+        if (trustXRealIp)
         {
-            clearBlockedClients();
-            bool isBlocked = false;
-            for (const auto &entry : blockedClientList)
+            noteClient(effectiveClientAddr);
+            access = lookupIpAccess(effectiveClientAddr);
+            if (access == IpAccess::Deny)
             {
-                if (entry.ip == effectiveClientIp)
-                {
-                    isBlocked = true;
-                    break;
-                }
+                rejectDeniedClient(client_fd, effectiveClientAddr);
+                continue;
             }
-            if (isBlocked)
+            BlockedClient *blocked = access == IpAccess::Allow ? nullptr : hitBlockedClient(effectiveClientAddr);
+            if (blocked)
             {
-                returnErrorPage(client_fd, 4031, contactEmail);
-                char blockedBuffer[256];
-                string humanReadableUntil;
-                {
-                    time_t t = 0;
-                    for (const auto &entry : blockedClientList)
-                    {
-                        if (entry.ip == effectiveClientIp)
-                        {
-                            t = entry.blockedUntil;
-                            break;
-                        }
-                    }
-                    if (t != 0)
-                    {
-                        auto tm = *localtime(&t);
-                        char buf[32];
-                        strftime(buf, sizeof(buf), "%d-%m-%Y %H:%M:%S", &tm);
-                        humanReadableUntil = buf;
-                    }
-                    else
-                    {
-                        humanReadableUntil = "unknown time";
-                    }
-                }
-                snprintf(blockedBuffer, sizeof(blockedBuffer), "[%s] Blocked %s due to previous low trust score until %s", timebuf, effectiveClientIp.c_str(), humanReadableUntil.c_str());
-                string blockedOutput = blockedBuffer;
-                logRequest(blockedOutput, toggleLogging, logMaxLines);
-                close(client_fd);
+                rejectBlockedClient(client_fd, effectiveClientAddr, *blocked);
                 continue;
             }
+            if (access != IpAccess::Allow && shedConnection(client_fd, effectiveClientAddr))
+                continue;
         }
 
-        // evaluate trust score if enabled
-        if (evaluateTrustScore)
+        // evaluate trust score if enabled, allowed networks are never scored
+        if (evaluateTrustScore && access != IpAccess::Allow)
         {
             // Extract headers as string
             const char *hdrEnd = strstr(buffer, "\r\n\r\n");
             size_t headerLen = hdrEnd ? (size_t)(hdrEnd - buffer) : (size_t)used;
             std::string headers(buffer, headerLen);
 
-            int trustScore = evaluateTrust(effectiveClientIp, headers, checkHoneypotPaths);
-            if (trustScore <= trustScoreThreshold)
+            // serve now, a low score blocks the client from its next request on
+            if (asyncTrustFd() != -1)
             {
-                // block request, and add to blockedClients
-                blockedClients newEntry{};
-                newEntry.ip = effectiveClientIp;
-                newEntry.blockedUntil = time(nullptr) + blockforDuration;
-                blockedClientList.push_back(newEntry);
-
-                // 4031, 1 indicates its a trust score so returnErrorPage can show extra info
-                returnErrorPage(client_fd, 4031, contactEmail);
-                char blockedBuffer[256];
-                snprintf(blockedBuffer, sizeof(blockedBuffer), "[%s] Blocked %s due to low trust score (%d)", timebuf, effectiveClientIp.c_str(), trustScore);
-                string blockedOutput = blockedBuffer;
-                logRequest(blockedOutput, toggleLogging, logMaxLines);
-                continue;
+                queueTrustEvaluation(effectiveClientAddr, move(headers), get404PMcount(effectiveClientAddr), getTimeoutPMcount(effectiveClientAddr));
+            }
+            else
+            {
+                int trustScore = evaluateTrust(effectiveClientAddr, headers, checkHoneypotPaths, get404PMcount(effectiveClientAddr), getTimeoutPMcount(effectiveClientAddr));
+                noteAdmissionScore(effectiveClientAddr, trustScore);
+                if (trustScore <= trustScoreThreshold)
+                {
+                    // block request, and add to the block list
+                    blockClient(effectiveClientAddr, time(nullptr) + blockforDuration);
+
+                    // 4031, 1 indicates its a trust score so returnErrorPage can show extra info
+                    returnErrorPage(client_fd, 4031);
+                    char blockedBuffer[256];
+                    snprintf(blockedBuffer, sizeof(blockedBuffer), "[%s] Blocked %s due to low trust score (%d)", timebuf, effectiveClientIp, trustScore);
+                    string blockedOutput = blockedBuffer;
+                    logRequest(blockedOutput, toggleLogging, logMaxLines);
+                    continue;
+                }
             }
         }
 
-        if (requestRateLimit > 0)
+        int rateLimit = currentRateLimit(requestRateLimit); // tighter while under attack
+        if (rateLimit > 0)
         {
-            // check ip rate limit
+            // check ip rate limit, host-wide when the state is shared with other processes
             time_t now = time(nullptr);
-            bool found = false;
-            for (auto &entry : ipRateLimits)
+            int requestCount = sharedStateActive() ? sharedCountRequest(effectiveClientAddr, now) : -1;
+            if (requestCount < 0)
             {
-                if (entry.ip == effectiveClientIp)
+                auto found = ipRateLimits.find(effectiveClientAddr);
+                if (found != ipRateLimits.end())
                 {
-                    found = true;
+                    IpRateLimit &entry = found->second;
                     if (now == entry.lastRequestTime)
                     {
                         entry.requestCount++;
@@ -612,32 +1095,31 @@ int main(int argc, char *argv[])
                         entry.requestCount = 1;
                         entry.lastRequestTime = now;
                     }
-
-                    if (entry.requestCount > requestRateLimit)
-                    {
-                        // over limit, send 429 and close
-                        returnErrorPage(client_fd, 429, contactEmail);
-                        char rateExceededBuffer[256];
-                        snprintf(rateExceededBuffer, sizeof(rateExceededBuffer), "[%s] Rate limit exceeded for %s", timebuf, effectiveClientIp.c_str());
-                        string rateExceededOutput = rateExceededBuffer;
-                        logRequest(rateExceededOutput, toggleLogging, logMaxLines);
-                        found = true;
-                        break;
-                    }
-                    break;
+                    requestCount = entry.requestCount;
+                }
+                else
+                {
+                    ipRateLimits[effectiveClientAddr] = IpRateLimit{1, now};
+                    ipRateLimitsExpiry.schedule(effectiveClientAddr, now + 1);
+                    requestCount = 1;
                 }
             }
-            if (!found)
+
+            if (requestCount > rateLimit)
             {
-                IpRateLimit newEntry{};
-                newEntry.ip = effectiveClientIp;
-                newEntry.requestCount = 1;
-                newEntry.lastRequestTime = now;
-                ipRateLimits.push_back(newEntry);
+                // over limit, send 429 and close
+                returnErrorPage(client_fd, 429);
+                char rateExceededBuffer[256];
+                snprintf(rateExceededBuffer, sizeof(rateExceededBuffer), "[%s] Rate limit exceeded for %s", timebuf, effectiveClientIp);
+                string rateExceededOutput = rateExceededBuffer;
+                logRequest(rateExceededOutput, toggleLogging, logMaxLines);
+                continue;
             }
         }
 
         // get basic info from buffer
+        string userAgent;
+        bool http10 = false; // no chunked encoding for these, streamed bodies end with the connection instead
         {
             char methodTok[16] = {0};
             char pathTok[1024] = {0};
@@ -653,7 +1135,6 @@ int main(int argc, char *argv[])
             // extract User-Agent header
             const char *userAgentKey = "User-Agent:";
             const char *userAgentStart = strcasestr(buffer, userAgentKey);
-            string userAgent;
             if (userAgentStart)
             {
                 userAgentStart += strlen(userAgentKey);
@@ -671,15 +1152,16 @@ int main(int argc, char *argv[])
                 // fallback minimal logging
                 char malformedRequestLog[256];
                 snprintf(malformedRequestLog, sizeof(malformedRequestLog), "[%s] [%s:%d] (malformed request line)",
-                         timebuf, effectiveClientIp.c_str(), ntohs(client_addr.sin_port));
+                         timebuf, effectiveClientIp, ntohs(client_addr.sin_port));
                 string malformedRequestOutput = malformedRequestLog;
                 logRequest(malformedRequestOutput, toggleLogging, logMaxLines);
             }
             else
             {
+                http10 = strcmp(verTok, "HTTP/1.0") == 0;
                 char logBuffer[2048];
                 snprintf(logBuffer, sizeof(logBuffer), "[%s] [%s:%d] (%s %s %s | User-Agent: %s)",
-                         timebuf, effectiveClientIp.c_str(), ntohs(client_addr.sin_port),
+                         timebuf, effectiveClientIp, ntohs(client_addr.sin_port),
                          verTok, methodTok, pathTok, userAgent.empty() ? "" : userAgent.c_str());
                 string logOutput = logBuffer;
                 logRequest(logOutput, toggleLogging, logMaxLines);
@@ -692,7 +1174,7 @@ int main(int argc, char *argv[])
         // if header too large/malformed, close
         if (!strstr(buffer, eolmark))
         {
-            returnErrorPage(client_fd, 400, contactEmail);
+            returnErrorPage(client_fd, 400);
             continue;
         }
 
@@ -700,7 +1182,7 @@ int main(int argc, char *argv[])
         if (strncmp(buffer, "GET ", 4) != 0)
         {
             // unsupported method
-            returnErrorPage(client_fd, 405, contactEmail);
+            returnErrorPage(client_fd, 405);
             continue;
         }
 
@@ -757,7 +1239,7 @@ int main(int argc, char *argv[])
             }
             if (!authOk)
             {
-                returnErrorPage(client_fd, 401, contactEmail);
+                returnErrorPage(client_fd, 401);
                 continue;
             }
         }
@@ -771,477 +1253,160 @@ int main(int argc, char *argv[])
         }
         *path_end = 0;
 
-        // Decode any %HH sequences in the path so that files with spaces or other characters are correctly located
-        char decodedPath[2048];
-        if (!percentDecode(path_start, decodedPath, sizeof(decodedPath)))
+        // decode, drop the query, collapse // and /./, resolve .. into the key every lookup and cache below uses
+        CanonicalPath canonical;
+        if (!canonicalizePath(path_start, canonical))
         {
-            // invalid percent-encoding, 400
-            returnErrorPage(client_fd, 400, contactEmail);
+            // invalid percent-encoding or climbing out of the site, 400
+            returnErrorPage(client_fd, 400);
             continue;
         }
-        path_start = decodedPath; // switch to decoded path for further logic
-
-        // map / to index.html if no file specified
-        bool userSetFile = true;
-        if (strcmp(path_start, "/") == 0)
+        const std::string &key = canonical.key;
+        const std::string &query = canonical.query;
+        bool hasTrailingSlash = canonical.trailingSlash;
+        bool isTeapot = key == "imateapot418";
+        noteRequest(key, userAgent);
+
+        // status endpoint, to everyone else it's just another path on the site
+        if (!statusKey.empty() && key == statusKey &&
+            (access == IpAccess::Allow || lookupIpClass(effectiveClientAddr) == IpClass::Loopback))
         {
-            path_start = (char *)"/index.html";
-            userSetFile = false;
+            serveStatus(client_fd);
+            continue;
         }
 
-        // reject .. for simple security
-        if (strstr(path_start, ".."))
+        // serving from a site pack, the filesystem isn't involved at all
+        if (sitePackActive())
         {
-            returnErrorPage(client_fd, 400, contactEmail);
+            servePackRequest(client_fd, key, hasTrailingSlash, query, buffer, used, effectiveClientAddr);
             continue;
         }
 
-        // strip leading slash for filesystem open
-        const char *rel_path = (path_start[0] == '/') ? path_start + 1 : path_start;
-
-        // return 418 for /imateapot418 if file/dir does not exist
-        if (strcmp(path_start, "/imateapot418") == 0)
+        // resolve through the site index when it's active, whatever it can't answer falls through to the filesystem below
         {
-            const std::string fullPath = siteDir.empty() ? "imateapot418" : (siteDir + "/imateapot418");
-            struct stat st{};
-            if (stat(fullPath.c_str(), &st) != 0)
+            const SiteEntry *entry = nullptr;
+            SiteLookup found = lookupSite(key, entry);
+            if (found == SiteLookup::Missing || (found == SiteLookup::Found && !entry->isDir && hasTrailingSlash))
             {
-                returnErrorPage(client_fd, 418, contactEmail);
+                // return 418 for /imateapot418 if file/dir does not exist
+                if (isTeapot)
+                    returnErrorPage(client_fd, 418);
+                else
+                    return404(client_fd, effectiveClientAddr, key);
                 continue;
             }
-        }
-
-        // handle explicit directory requests ending with '/'
-        if (path_start[strlen(path_start) - 1] == '/')
-        {
-            // rel_path currently ends with '/', trim for filesystem path
-            std::string dirRel = rel_path;
-            while (!dirRel.empty() && dirRel.back() == '/')
-                dirRel.pop_back();
-            std::string dirFull = siteDir.empty() ? dirRel : (siteDir + "/" + dirRel);
-
-            struct stat dst{};
-            if (stat(dirFull.c_str(), &dst) == 0 && S_ISDIR(dst.st_mode))
+            if (found == SiteLookup::Found)
             {
-                // try common index files
-                const char *indices[] = {"index.html", "index.htm"};
-                bool servedIndex = false;
-                for (const char *idx : indices)
+                std::string rel = key;
+                if (entry->isDir && !hasTrailingSlash)
                 {
-                    std::string idxFull = dirFull + "/" + idx;
-                    int fd = open(idxFull.c_str(), O_RDONLY);
-                    if (fd != -1)
-                    {
-                        struct stat ist{};
-                        if (fstat(fd, &ist) == 0 && S_ISREG(ist.st_mode))
-                        {
-                            const char *ctype = guessContentType(idxFull.c_str());
-                            char header[256];
-                            int header_len = snprintf(header, sizeof(header),
-                                                      "HTTP/1.1 200 OK\r\n"
-                                                      "Content-Length: %lld\r\n"
-                                                      "Content-Type: %s\r\n"
-                                                      "Accept-Ranges: bytes\r\n"
-                                                      "Connection: close\r\n"
-                                                      "\r\n",
-                                                      (long long)ist.st_size, ctype);
-                            std::string tempHeader = headerManager(header);
-                            if (tempHeader == "invalid")
-                            {
-                                // fallback
-                                printf("Invalid header generated in main when serving index, using fallback 3.\n");
-                                header_len = snprintf(header, sizeof(header),
-                                                      "HTTP/1.1 200 OK\r\n"
-                                                      "Content-Length: %lld\r\n"
-                                                      "Content-Type: text/html; charset=utf-8\r\n"
-                                                      "Accept-Ranges: bytes\r\n"
-                                                      "Connection: close\r\n"
-                                                      "\r\n",
-                                                      (long long)ist.st_size);
-                            }
-                            else
-                            {
-                                // ensure fits buffer else send directly
-                                if (tempHeader.size() < sizeof(header))
-                                {
-                                    memcpy(header, tempHeader.c_str(), tempHeader.size() + 1);
-                                    header_len = (int)tempHeader.size();
-                                }
-                                else
-                                {
-                                    // send directly and skip buffer usage
-                                    send(client_fd, tempHeader.c_str(), tempHeader.size(), 0);
-                                    header_len = -1; // mark as sent
-                                }
-                            }
-                            if (header_len > 0 && header_len < (int)sizeof(header))
-                            {
-                                send(client_fd, header, header_len, 0);
-                                off_t off = 0;
-                                while (off < ist.st_size)
-                                {
-                                    ssize_t s = sendfile(client_fd, fd, &off, ist.st_size - off);
-                                    if (s <= 0)
-                                    {
-                                        if (s < 0 && (errno == EPIPE || errno == ECONNRESET))
-                                            break; // client went away
-                                        break;
-                                    }
-                                }
-                            }
-                            else if (header_len == -1)
-                            {
-                                // header already sent, now send body
-                                off_t off = 0;
-                                while (off < ist.st_size)
-                                {
-                                    ssize_t s = sendfile(client_fd, fd, &off, ist.st_size - off);
-                                    if (s <= 0)
-                                    {
-                                        if (s < 0 && (errno == EPIPE || errno == ECONNRESET))
-                                            break;
-                                        break;
-                                    }
-                                }
-                            }
-                            close(fd);
-                            close(client_fd);
-                            servedIndex = true;
-                            break;
-                        }
-                        close(fd);
-                    }
-                }
-                if (servedIndex)
+                    sendSlashRedirect(client_fd, key, query);
                     continue;
-
-                // no index file; directory listing or 404
-                if (useDirListing)
-                {
-                    returnDirListing(client_fd, siteDir, dirRel, Page404, contactEmail, effectiveClientIp);
                 }
-                else
+                const char *ctype = entry->contentType;
+                if (entry->isDir)
                 {
-                    return404(client_fd, siteDir, Page404, contactEmail, effectiveClientIp);
+                    if (entry->indexFile.empty())
+                    {
+                        // no index, directory listing or 404
+                        if (useDirListing && !underAttack())
+                            returnDirListing(client_fd, key, query, effectiveClientAddr, http10);
+                        else
+                            return404(client_fd, effectiveClientAddr, key);
+                        continue;
+                    }
+                    rel = key.empty() ? entry->indexFile : key + "/" + entry->indexFile;
+                    ctype = guessContentType(entry->indexFile.c_str());
                 }
-                continue;
-            }
-        }
-
-        // build full path inside of siteDir
-        std::string fullPath = siteDir.empty() ? rel_path : (siteDir + "/" + rel_path);
-
-        struct stat pathStat{};
-        if (stat(fullPath.c_str(), &pathStat) == 0 && S_ISDIR(pathStat.st_mode))
-        {
-            bool hasTrailingSlash = (path_start[strlen(path_start) - 1] == '/');
-            if (!hasTrailingSlash)
-            {
-                // send 301 redirect to canonical slash form
-                std::string loc = std::string(path_start) + "/";
-                char hdr[512];
-                int hdrLen = snprintf(hdr, sizeof(hdr),
-                                      "HTTP/1.1 301 Moved Permanently\r\n"
-                                      "Location: %s\r\n"
-                                      "Content-Length: 0\r\n"
-                                      "Connection: close\r\n"
-                                      "\r\n",
-                                      loc.c_str());
-                if (hdrLen > 0 && hdrLen < (int)sizeof(hdr))
-                    send(client_fd, hdr, hdrLen, 0);
-                close(client_fd);
-                continue;
-            }
 
-            // try index files
-            const char *indices[] = {"index.html", "index.htm"};
-            bool servedIndex = false;
-            for (const char *idx : indices)
-            {
-                std::string idxFull = fullPath + "/" + idx;
-                int fd = open(idxFull.c_str(), O_RDONLY);
-                if (fd != -1)
+                int fd = openInSite(rel.c_str(), O_RDONLY);
+                struct stat st{};
+                if (fd == -1 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))
                 {
-                    struct stat ist{};
-                    if (fstat(fd, &ist) == 0 && S_ISREG(ist.st_mode))
-                    {
-                        const char *ctype = guessContentType(idxFull.c_str());
-                        char header[256];
-                        int header_len = snprintf(header, sizeof(header),
-                                                  "HTTP/1.1 200 OK\r\n"
-                                                  "Content-Length: %lld\r\n"
-                                                  "Content-Type: %s\r\n"
-                                                  "Accept-Ranges: bytes\r\n"
-                                                  "Connection: close\r\n"
-                                                  "\r\n",
-                                                  (long long)ist.st_size, ctype);
-                        std::string tempHeader = headerManager(header);
-                        if (tempHeader == "invalid")
-                        {
-                            // fallback
-                            printf("Invalid header generated in main when serving index, using fallback 4.\n");
-                            header_len = snprintf(header, sizeof(header),
-                                                  "HTTP/1.1 200 OK\r\n"
-                                                  "Content-Length: %lld\r\n"
-                                                  "Content-Type: text/html; charset=utf-8\r\n"
-                                                  "Accept-Ranges: bytes\r\n"
-                                                  "Connection: close\r\n"
-                                                  "\r\n",
-                                                  (long long)ist.st_size);
-                        }
-                        else
-                        {
-                            if (tempHeader.size() < sizeof(header))
-                            {
-                                memcpy(header, tempHeader.c_str(), tempHeader.size() + 1);
-                                header_len = (int)tempHeader.size();
-                            }
-                            else
-                            {
-                                send(client_fd, tempHeader.c_str(), tempHeader.size(), 0);
-                                header_len = -1;
-                            }
-                        }
-                        if (header_len > 0 && header_len < (int)sizeof(header))
-                        {
-                            send(client_fd, header, header_len, 0);
-                            off_t off = 0;
-                            while (off < ist.st_size)
-                            {
-                                ssize_t s = sendfile(client_fd, fd, &off, ist.st_size - off);
-                                if (s <= 0)
-                                {
-                                    if (s < 0 && (errno == EPIPE || errno == ECONNRESET))
-                                        break;
-                                    break;
-                                }
-                            }
-                        }
-                        else if (header_len == -1)
-                        {
-                            off_t off = 0;
-                            while (off < ist.st_size)
-                            {
-                                ssize_t s = sendfile(client_fd, fd, &off, ist.st_size - off);
-                                if (s <= 0)
-                                {
-                                    if (s < 0 && (errno == EPIPE || errno == ECONNRESET))
-                                        break;
-                                    break;
-                                }
-                            }
-                        }
+                    if (fd != -1)
                         close(fd);
-                        close(client_fd);
-                        servedIndex = true;
-                        break;
-                    }
-                    close(fd);
+                    return404(client_fd, effectiveClientAddr, key);
+                    continue;
                 }
-            }
-            if (servedIndex)
+                serveRegularFile(client_fd, fd, st, ctype, buffer, used);
                 continue;
-
-            // no index,  directory listing or 404
-            if (useDirListing)
-            {
-                // rel_path currently without leading slash already
-                returnDirListing(client_fd, siteDir, rel_path, Page404, contactEmail, effectiveClientIp);
             }
-            else
-            {
-                return404(client_fd, siteDir, Page404, contactEmail, effectiveClientIp);
-            }
-            continue;
         }
-        int opened_fd = open(fullPath.c_str(), O_RDONLY);
-        if (opened_fd == -1) // file not found
+
+        // recently missed, skip the filesystem
+        if (isCachedMiss(key))
         {
-            // if dirlisting enabled and user did not specify file, show dir listing
-            if (useDirListing && !userSetFile)
-            {
-                returnDirListing(client_fd, siteDir, rel_path, Page404, contactEmail, effectiveClientIp);
-                continue;
-            }
+            if (isTeapot)
+                returnErrorPage(client_fd, 418);
             else
-            {
-                return404(client_fd, siteDir, Page404, contactEmail, effectiveClientIp);
-                continue;
-            }
-        }
-        struct stat st{};
-        if (fstat(opened_fd, &st) < 0 || !S_ISREG(st.st_mode))
-        {
-            return404(client_fd, siteDir, Page404, contactEmail, effectiveClientIp);
-            close(opened_fd); // not a regular file, close
+                return404(client_fd, effectiveClientAddr, key);
             continue;
         }
 
-        // send file
-        // guess content type based on extension for proper loading in browsers
-        // also check for Range header, and send partial content if present
-        const char *hdrEnd2 = strstr(buffer, "\r\n\r\n");
-        size_t headerLen2 = hdrEnd2 ? (size_t)(hdrEnd2 - buffer) : used;
-        std::string headersAll(buffer, headerLen2);
-        off_t rangeStart = 0, rangeEnd = 0; // inclusive
-        bool hasRange = parseRangeHeader(headersAll, st.st_size, rangeStart, rangeEnd);
-
-        const char *ctype = guessContentType(fullPath.c_str());
-        bool partial = false;
-        if (hasRange)
+        // return 418 for /imateapot418 if file/dir does not exist
+        if (isTeapot)
         {
-            if (st.st_size == 0)
+            int teapotFd = openInSite("imateapot418", O_PATH);
+            if (teapotFd == -1)
             {
-                // cannot satisfy any range on empty file -> 416
-                char hdr[256];
-                int hl = snprintf(hdr, sizeof(hdr),
-                                  "HTTP/1.1 416 Range Not Satisfiable\r\n"
-                                  "Content-Range: bytes */0\r\n"
-                                  "Connection: close\r\n"
-                                  "\r\n");
-                if (hl > 0 && hl < (int)sizeof(hdr))
-                    send(client_fd, hdr, hl, 0);
-                close(opened_fd);
-                close(client_fd);
-                continue;
-            }
-            if (rangeStart < 0 || rangeEnd < rangeStart || rangeEnd >= st.st_size)
-            {
-                // invalid (parse function should guarantee end < size, but double check)
-                char hdr[256];
-                int hl = snprintf(hdr, sizeof(hdr),
-                                  "HTTP/1.1 416 Range Not Satisfiable\r\n"
-                                  "Content-Range: bytes */%lld\r\n"
-                                  "Connection: close\r\n"
-                                  "\r\n",
-                                  (long long)st.st_size);
-                if (hl > 0 && hl < (int)sizeof(hdr))
-                    send(client_fd, hdr, hl, 0);
-                close(opened_fd);
-                close(client_fd);
+                if (errno == ENOENT)
+                    rememberMiss(key);
+                returnErrorPage(client_fd, 418);
                 continue;
             }
-            partial = true;
+            close(teapotFd);
         }
 
-        off_t sendStart = partial ? rangeStart : 0;
-        off_t sendEnd = partial ? rangeEnd : (st.st_size ? st.st_size - 1 : 0);
-        off_t contentLen = (sendEnd >= sendStart) ? (sendEnd - sendStart + 1) : 0;
-
-        // build header
-        char header[512];
-        int header_len = 0;
-        if (partial)
-        {
-            header_len = snprintf(header, sizeof(header),
-                                  "HTTP/1.1 206 Partial Content\r\n"
-                                  "Content-Length: %lld\r\n"
-                                  "Content-Type: %s\r\n"
-                                  "Accept-Ranges: bytes\r\n"
-                                  "Content-Range: bytes %lld-%lld/%lld\r\n"
-                                  "Connection: close\r\n"
-                                  "\r\n",
-                                  (long long)contentLen, ctype,
-                                  (long long)sendStart, (long long)sendEnd, (long long)st.st_size);
-        }
-        else
-        {
-            header_len = snprintf(header, sizeof(header),
-                                  "HTTP/1.1 200 OK\r\n"
-                                  "Content-Length: %lld\r\n"
-                                  "Content-Type: %s\r\n"
-                                  "Accept-Ranges: bytes\r\n"
-                                  "Connection: close\r\n"
-                                  "\r\n",
-                                  (long long)st.st_size, ctype);
-        }
-        std::string tempHeader = headerManager(header);
-        if (tempHeader == "invalid")
-        {
-            // fallback
-            if (partial)
-            {
-                printf("Invalid header generated in main when serving file, using fallback 5.\n");
-                header_len = snprintf(header, sizeof(header),
-                                      "HTTP/1.1 206 Partial Content\r\n"
-                                      "Content-Length: %lld\r\n"
-                                      "Content-Type: %s\r\n"
-                                      "Accept-Ranges: bytes\r\n"
-                                      "Content-Range: bytes %lld-%lld/%lld\r\n"
-                                      "Connection: close\r\n"
-                                      "\r\n",
-                                      (long long)contentLen, ctype,
-                                      (long long)sendStart, (long long)sendEnd, (long long)st.st_size);
-            }
-            else
-            {
-                printf("Invalid header generated in main when serving file, using fallback 6.\n");
-                header_len = snprintf(header, sizeof(header),
-                                      "HTTP/1.1 200 OK\r\n"
-                                      "Content-Length: %lld\r\n"
-                                      "Content-Type: text/html; charset=utf-8\r\n"
-                                      "Accept-Ranges: bytes\r\n"
-                                      "Connection: close\r\n"
-                                      "\r\n",
-                                      (long long)st.st_size);
-            }
-        }
-        else
-        {
-            if (tempHeader.size() < sizeof(header))
-            {
-                memcpy(header, tempHeader.c_str(), tempHeader.size() + 1);
-                header_len = (int)tempHeader.size();
-            }
-            else
-            {
-                send(client_fd, tempHeader.c_str(), tempHeader.size(), 0);
-                header_len = -1;
-            }
-        }
-        if (header_len >= 0 && header_len < (int)sizeof(header))
+        // one open for files and directories alike, fstat tells them apart
+        int opened_fd = openInSite(key.c_str(), O_RDONLY);
+        if (opened_fd == -1) // not found, or outside the site dir
         {
-            send(client_fd, header, header_len, 0);
+            if (errno == ENOENT)
+                rememberMiss(key);
+            return404(client_fd, effectiveClientAddr, key);
+            continue;
         }
-        else if (header_len >= (int)sizeof(header))
+        struct stat st{};
+        if (fstat(opened_fd, &st) < 0)
         {
             close(opened_fd);
-            close(client_fd);
+            return404(client_fd, effectiveClientAddr, key);
             continue;
         }
 
-        // Position file descriptor if partial
-        off_t offset = sendStart;
-        if (offset > 0)
+        if (S_ISDIR(st.st_mode))
         {
-            if (lseek(opened_fd, offset, SEEK_SET) == (off_t)-1)
+            close(opened_fd);
+            if (!hasTrailingSlash)
             {
-                close(opened_fd);
-                close(client_fd);
+                // send 301 redirect to canonical slash form
+                sendSlashRedirect(client_fd, key, query);
                 continue;
             }
+
+            // try index files
+            if (tryServeIndex(client_fd, key))
+                continue;
+
+            // no index, directory listing or 404
+            if (useDirListing && !underAttack())
+                returnDirListing(client_fd, key, query, effectiveClientAddr, http10);
+            else
+                return404(client_fd, effectiveClientAddr, key);
+            continue;
         }
-        off_t remaining = contentLen;
-        while (remaining > 0)
+        if (!S_ISREG(st.st_mode) || hasTrailingSlash)
         {
-            ssize_t toSend = remaining;
-            // sendfile updates offset internally when offset pointer is provided; here we use NULL and rely on fd position
-            ssize_t sent = sendfile(client_fd, opened_fd, nullptr, toSend);
-            if (sent <= 0)
-            {
-                if (sent < 0 && (errno == EPIPE || errno == ECONNRESET))
-                    break; // client closed connection
-                break;
-            }
-            remaining -= sent;
+            return404(client_fd, effectiveClientAddr, key);
+            close(opened_fd); // not a regular file (or asked for as a dir), close
+            continue;
         }
 
-        // close connections
-        close(opened_fd);
-        close(client_fd);
+        serveRegularFile(client_fd, opened_fd, st, guessContentType(key.c_str()), buffer, used);
     }
 
     printf("Shutting down...\n");
+    stopAsyncTrust();
     close(sock);
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,189 @@
+#include "include/missCache.h"
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstdio>
+#include <ctime>
+#include <cstdint>
+#include <deque>
+#include <unordered_map>
+
+using namespace std;
+
+struct MissEntry
+{
+    time_t expires;
+    int wd;        // watch on the nearest existing ancestor dir
+    uint64_t seq;  // matches the missOrder entry that owns it
+};
+
+struct MissWatch
+{
+    string dirRel;
+    size_t refs;
+};
+
+static unordered_map<string, MissEntry> misses;   // rel path -> entry
+static deque<pair<uint64_t, string>> missOrder;   // insertion order, which is also expiry order
+static unordered_map<int, MissWatch> missWatches; // inotify wd -> dir and how many misses use it
+static string missRoot;
+static int missTtl = 0;
+static int missInotifyFd = -1;
+static uint64_t missSeq = 0;
+
+static const size_t missCacheMaxEntries = 8192; // scanners rotate through a lot of paths, keep it bounded
+
+// something might have appeared in these dirs
+static const uint32_t missWatchMask = IN_CREATE | IN_MOVED_TO | IN_ATTRIB | IN_ONLYDIR;
+
+static void dropMiss(unordered_map<string, MissEntry>::iterator it)
+{
+    auto w = missWatches.find(it->second.wd);
+    if (w != missWatches.end() && --w->second.refs == 0)
+    {
+        inotify_rm_watch(missInotifyFd, w->first);
+        missWatches.erase(w);
+    }
+    misses.erase(it);
+}
+
+// drops expired entries from the front, and the oldest ones if we're full
+static void trimMisses(time_t now)
+{
+    while (!missOrder.empty())
+    {
+        auto it = misses.find(missOrder.front().second);
+        bool current = it != misses.end() && it->second.seq == missOrder.front().first;
+        if (current && it->second.expires > now && misses.size() < missCacheMaxEntries)
+            break;
+        if (current)
+            dropMiss(it);
+        missOrder.pop_front();
+    }
+}
+
+void initializeMissCache(const string &siteDir, int ttlSeconds)
+{
+    missRoot = siteDir.empty() ? "." : siteDir;
+    missTtl = ttlSeconds;
+    if (missTtl <= 0)
+        return;
+    missInotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (missInotifyFd == -1)
+    {
+        perror("inotify_init1");
+        printf("Miss cache disabled.\n");
+    }
+}
+
+int missCacheFd()
+{
+    return missInotifyFd;
+}
+
+bool isCachedMiss(const string &relPath)
+{
+    if (missInotifyFd == -1 || relPath.empty())
+        return false;
+    auto it = misses.find(relPath);
+    if (it == misses.end())
+        return false;
+    if (it->second.expires <= time(nullptr))
+    {
+        dropMiss(it); // its missOrder slot is skipped later by the seq check
+        return false;
+    }
+    return true;
+}
+
+void rememberMiss(const string &relPath)
+{
+    if (missInotifyFd == -1 || relPath.empty() || misses.count(relPath))
+        return;
+    time_t now = time(nullptr);
+    trimMisses(now);
+
+    // watch the deepest dir that exists, creating anything between it and the path shows up there
+    string dirRel = relPath;
+    struct stat st;
+    for (;;)
+    {
+        size_t slash = dirRel.rfind('/');
+        dirRel = slash == string::npos ? string() : dirRel.substr(0, slash);
+        string full = dirRel.empty() ? missRoot : missRoot + "/" + dirRel;
+        if (stat(full.c_str(), &st) == 0 && S_ISDIR(st.st_mode))
+            break;
+        if (dirRel.empty())
+            return; // site dir itself is gone, nothing to watch
+    }
+    string full = dirRel.empty() ? missRoot : missRoot + "/" + dirRel;
+    int wd = inotify_add_watch(missInotifyFd, full.c_str(), missWatchMask);
+    if (wd < 0)
+        return; // without a watch we'd serve stale 404s, so don't cache it
+
+    auto w = missWatches.find(wd);
+    if (w == missWatches.end())
+        missWatches[wd] = MissWatch{dirRel, 1};
+    else
+        w->second.refs++;
+
+    misses[relPath] = MissEntry{now + missTtl, wd, ++missSeq};
+    missOrder.emplace_back(missSeq, relPath);
+}
+
+void refreshMissCache()
+{
+    if (missInotifyFd == -1)
+        return;
+    alignas(struct inotify_event) char buf[16384];
+    for (;;)
+    {
+        ssize_t n = read(missInotifyFd, buf, sizeof(buf));
+        if (n <= 0)
+            break; // EAGAIN, drained
+        for (char *p = buf; p < buf + n;)
+        {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            p += sizeof(struct inotify_event) + ev->len;
+
+            if (ev->mask & IN_Q_OVERFLOW)
+            {
+                // lost events, nothing cached can be trusted
+                for (auto it = misses.begin(); it != misses.end();)
+                    dropMiss(it++);
+                missOrder.clear();
+                continue;
+            }
+            auto w = missWatches.find(ev->wd);
+            if (w == missWatches.end())
+                continue;
+            if (ev->mask & IN_IGNORED)
+            {
+                // watched dir went away, its misses can't be invalidated anymore so forget them
+                int wd = ev->wd;
+                for (auto it = misses.begin(); it != misses.end();)
+                {
+                    if (it->second.wd == wd)
+                        dropMiss(it++);
+                    else
+                        ++it;
+                }
+                missWatches.erase(wd);
+                continue;
+            }
+            if (ev->len == 0)
+                continue;
+
+            // forget the created path and anything below it
+            string created = w->second.dirRel.empty() ? string(ev->name) : w->second.dirRel + "/" + ev->name;
+            string prefix = created + "/";
+            for (auto it = misses.begin(); it != misses.end();)
+            {
+                if (it->first == created || it->first.compare(0, prefix.size(), prefix) == 0)
+                    dropMiss(it++);
+                else
+                    ++it;
+            }
+        }
+    }
+}
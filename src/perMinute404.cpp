@@ -1,67 +1,83 @@
 #include "include/perMinute404.h"
-#include <vector>
+#include "include/expiryWheel.h"
+#include "include/countMinSketch.h"
+#include "include/sharedState.h"
+#include "include/trustRules.h"
+#include <unordered_map>
+#include <memory>
 #include <ctime>
-#include <string>
-#include <algorithm>
 #include <cstdio>
+#include <algorithm>
 using namespace std;
 
 struct PerMinute404 // stores 404s per minute for an IP
 {
-    string ip;
     int count;
-    time_t timestamp;
+    time_t timestamp; // last 404, the window runs 60s past it
 };
 
 // cant believe they named it after the guy from despicable me
-static vector<PerMinute404> notFoundPerMinute;
+static unordered_map<IpAddr, PerMinute404, IpAddrHash> notFoundPerMinute;
+static ExpiryWheel<IpAddr> notFoundExpiry;
 
-static void clearOldEntries()
+// COUNTER_SKETCH mode, exact windows only for addresses past the first 404 penalty (the notfound band in the trust rules)
+static bool sketchMode = false;
+static unique_ptr<WindowedCountMin> notFoundSketch; // only allocated in sketch mode
+static const size_t heavyHitterCap = 65536;
+
+void use404Sketch()
 {
-    time_t now = time(nullptr);
-    notFoundPerMinute.erase(
-        std::remove_if(notFoundPerMinute.begin(), notFoundPerMinute.end(),
-                       [now](const PerMinute404 &entry)
-                       {
-                           return (now - entry.timestamp) > 60;
-                       }),
-        notFoundPerMinute.end());
+    sketchMode = true;
+    notFoundSketch.reset(new WindowedCountMin(60, 6));
 }
 
-int get404PMcount(const string &ip)
+static bool isExpired(const PerMinute404 &entry, time_t now)
 {
-    // clear old entries first
-    clearOldEntries();
-
-    int total = 0;
-    for (const auto &entry : notFoundPerMinute)
-    {
-        if (entry.ip == ip)
-        {
-            total += entry.count;
-        }
-    }
-    return total;
+    return (now - entry.timestamp) > 60;
 }
 
-void add404PMentry(const string &ip)
+int get404PMcount(const IpAddr &ip)
 {
-    // clear old entries first
     time_t now = time(nullptr);
-    clearOldEntries();
-
+    int shared = sharedStateActive() ? sharedWindowCount(ip, SharedNotFound, 60, now) : -1;
+    auto it = notFoundPerMinute.find(ip);
+    if (it == notFoundPerMinute.end() || isExpired(it->second, now))
+        return max(shared, sketchMode ? (int)notFoundSketch->estimate(ip, now) : 0);
+    return max(shared, it->second.count);
+}
 
-    // check if entry for this ip already exists
-    for (auto &entry : notFoundPerMinute)
+void add404PMentry(const IpAddr &ip)
+{
+    time_t now = time(nullptr);
+    if (sharedStateActive())
+        sharedCountWindow(ip, SharedNotFound, 60, now);
+    int estimate = sketchMode ? (int)notFoundSketch->add(ip, now) : 1;
+    auto it = notFoundPerMinute.find(ip);
+    if (it != notFoundPerMinute.end() && !isExpired(it->second, now))
     {
-        if (entry.ip == ip)
-        {
-            entry.count++;
-            entry.timestamp = now; // update timestamp to now
-            return;
-        }
+        it->second.count++;
+        it->second.timestamp = now; // update timestamp to now
+        return;
     }
 
     // add new entry
-    notFoundPerMinute.push_back({ip, 1, now});
-}
\ No newline at end of file
+    if (sketchMode && (estimate < firstTrustBand(NotFoundPerMinute) || notFoundPerMinute.size() >= heavyHitterCap))
+        return; // the sketch has it
+    if (it == notFoundPerMinute.end())
+        notFoundExpiry.schedule(ip, now + 61);
+    notFoundPerMinute[ip] = {estimate, now};
+}
+
+void expire404PMentries()
+{
+    time_t now = time(nullptr);
+    notFoundExpiry.advance(now, [now](const IpAddr &ip) -> time_t
+                           {
+                               auto it = notFoundPerMinute.find(ip);
+                               if (it == notFoundPerMinute.end())
+                                   return 0;
+                               if (!isExpired(it->second, now))
+                                   return it->second.timestamp + 61; // got more 404s since
+                               notFoundPerMinute.erase(it);
+                               return 0; });
+}
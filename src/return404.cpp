@@ -1,72 +1,125 @@
 #include "include/return404.h"
 #include <fcntl.h>
 #include <sys/stat.h>
-#include <sys/socket.h>
-#include <sys/sendfile.h>
 #include <unistd.h>
-#include <cstring>
+#include <cstdio>
+#include <ctime>
 #include "include/perMinute404.h"
+#include "include/topTraffic.h"
+#include "include/underAttack.h"
 
 #include "include/returnErrorPage.h"
+#include "include/headerManager.h"
 
-extern void return404(int client_fd, 
-    const std::string 
-    &siteDir, 
-    const std::string &Page404, 
-    const std::string &contactEmail,
-    const std::string &ip)
+// custom 404 page kept in memory, so misses never touch the filesystem
+static std::string custom404Path;
+static PreparedResponse custom404Response;
+static bool custom404Loaded = false;
+static struct stat custom404Stat{};
+static time_t custom404CheckedAt = 0;
+
+static const off_t custom404MaxSize = 4 * 1024 * 1024; // anything bigger is not a 404 page
+
+static bool load404Page()
 {
-    // if custom 404 page is set, try to serve it
-    add404PMentry(ip);
-    if (!Page404.empty())
+    int fd = open(custom404Path.c_str(), O_RDONLY);
+    if (fd == -1)
     {
-        std::string fullPath = siteDir.empty() ? Page404 : (siteDir + "/" + Page404);
-        int opened_fd = open(fullPath.c_str(), O_RDONLY);
-        if (opened_fd != -1)
-        {
-            struct stat st{};
-            if (fstat(opened_fd, &st) == 0 && S_ISREG(st.st_mode))
-            {
-                // send file
-                const char *ctype = "text/html"; // assume html for custom 404
+        perror("open");
+        return false;
+    }
+    struct stat st{};
+    bool statOk = fstat(fd, &st) == 0;
+    if (statOk)
+        custom404Stat = st; // remember even if unusable, so it isn't retried until it changes
+    if (!statOk || !S_ISREG(st.st_mode) || st.st_size > custom404MaxSize)
+    {
+        printf("Custom 404 page %s is not a regular file or is too large, using default 404.\n", custom404Path.c_str());
+        close(fd);
+        return false;
+    }
 
-                char header[256];
-                int header_len = snprintf(header, sizeof(header),
-                                          "HTTP/1.1 404 Not Found\r\n"
-                                          "Content-Length: %lld\r\n"
-                                          "Content-Type: %s\r\n"
-                                          "Connection: close\r\n"
-                                          "\r\n",
-                                          (long long)st.st_size, ctype);
-                if (header_len >= 0 && header_len < (int)sizeof(header))
-                {
-                    send(client_fd, header, header_len, 0);
+    std::string body((size_t)st.st_size, '\0');
+    size_t got = 0;
+    while (got < body.size())
+    {
+        ssize_t r = read(fd, &body[got], body.size() - got);
+        if (r <= 0)
+            break;
+        got += (size_t)r;
+    }
+    close(fd);
+    body.resize(got);
+
+    // assume html for custom 404
+    ResponseHeader header("404 Not Found");
+    header.addf("Content-Length: %zu", body.size());
+    header.add("Content-Type: text/html; charset=utf-8");
+    custom404Response = prepareResponse(header, body);
+    return !custom404Response.beforeDate.empty();
+}
+
+void initialize404Page(const std::string &siteDir, const std::string &Page404)
+{
+    custom404Loaded = false;
+    if (Page404.empty())
+        return;
+    custom404Path = siteDir.empty() ? Page404 : (siteDir + "/" + Page404);
+    custom404Loaded = load404Page();
+    custom404CheckedAt = time(nullptr);
+}
 
-                    // send full file
-                    off_t offset = 0;
-                    while (offset < st.st_size)
-                    {
-                        ssize_t sent = sendfile(client_fd, opened_fd, &offset, st.st_size - offset);
-                        if (sent <= 0)
-                            break; // error or EOF
-                    }
-                    close(opened_fd);
-                    close(client_fd);
-                    return;
-                }
-            }
-            close(opened_fd); // not a regular file, close
-        }
-        else
-        {
-            // could not open custom 404 page, fallback to basic 404
-            perror("open");
-            returnErrorPage(client_fd, 404, contactEmail);
-        }
+void set404PageBody(const char *data, size_t len)
+{
+    custom404Path.clear(); // nothing on disk to watch
+    custom404Loaded = false;
+    if (!data)
+        return;
+    // assume html for custom 404
+    ResponseHeader header("404 Not Found");
+    header.addf("Content-Length: %zu", len);
+    header.add("Content-Type: text/html; charset=utf-8");
+    custom404Response = prepareResponse(header, std::string(data, len));
+    custom404Loaded = !custom404Response.beforeDate.empty();
+}
+
+// picks up edits to the 404 page, checked at most once per second so scanner bursts stay syscall free
+static void refresh404Page()
+{
+    time_t now = time(nullptr);
+    if (custom404Path.empty() || now == custom404CheckedAt)
+        return;
+    custom404CheckedAt = now;
+
+    struct stat st{};
+    if (stat(custom404Path.c_str(), &st) != 0)
+    {
+        custom404Loaded = false; // removed, fall back to the default page until it comes back
+        custom404Stat = {};
+        return;
     }
-    else
+    if (st.st_ino == custom404Stat.st_ino &&
+        st.st_size == custom404Stat.st_size &&
+        st.st_mtim.tv_sec == custom404Stat.st_mtim.tv_sec &&
+        st.st_mtim.tv_nsec == custom404Stat.st_mtim.tv_nsec)
+        return;
+    custom404Loaded = load404Page();
+}
+
+void return404(int client_fd, const IpAddr &ip, const std::string &key)
+{
+    add404PMentry(ip);
+    noteNotFound(key);
+    noteGlobalNotFound();
+
+    refresh404Page();
+    if (!custom404Loaded || underAttack())
     {
-        // no custom 404 page set, return returnErrorPage
-        returnErrorPage(client_fd, 404, contactEmail); // returnErrorPage handles closing client_fd yadayada
+        // no custom 404 page set (or unreadable), return returnErrorPage
+        returnErrorPage(client_fd, 404); // returnErrorPage handles closing client_fd yadayada
+        return;
     }
-}
\ No newline at end of file
+
+    sendPrepared(client_fd, custom404Response);
+    close(client_fd);
+}
@@ -1,5 +1,8 @@
 #include "include/returnDirListing.h"
 #include "include/return404.h"
+#include "include/headerManager.h"
+#include "include/jsonString.h"
+#include "include/siteRoot.h"
 #include <string>
 #include <dirent.h>
 #include <cstring>
@@ -11,7 +14,10 @@
 #include <sys/types.h>
 #include <ctime>
 #include <cctype>
-#include <sstream>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <cstdlib>
+#include <unordered_map>
 
 using namespace std;
 
@@ -143,7 +149,7 @@ static const char *pageFooter = "</table></body>"
     "<footer><p>Powered by faucet</p></footer>"
     "</html>";
 
-static std::string getFileTypeClass(const std::string &filename) {
+static const char *getFileTypeClass(const std::string &filename) {
     // determine file type by extension for icon
     size_t dotPos = filename.rfind('.');
     if (dotPos == std::string::npos || dotPos == filename.length() - 1)
@@ -167,68 +173,247 @@ static std::string getFileTypeClass(const std::string &filename) {
     return "file"; // default
 }
 
-void returnDirListing(int client_fd,
-                      const std::string &siteDir,
-                      const std::string &relPath,
-                      const std::string &Page404,
-                      const std::string &contactEmail,
-                      const std::string &ip)
+struct DirListingEntry
+{
+    std::string name;
+    bool isDir;
+    off_t size;
+    time_t mtime;
+};
+
+// heap behind a string, 0 while it fits the small string buffer inside the object
+static size_t heapBytes(const std::string &s)
+{
+    static const size_t inlineCapacity = std::string().capacity();
+    return s.capacity() > inlineCapacity ? s.capacity() + 1 : 0;
+}
+
+struct DirListingCache // rendered listing of one directory, valid while the directory mtime is unchanged
+{
+    struct timespec dirMtime;
+    ino_t dirIno;
+    time_t builtAt;
+    size_t bytes; // heap used by the entry, names and page, accounted against dirListingCacheMaxBytes
+    std::vector<DirListingEntry> entries; // sorted by name
+    std::string page;                     // default html listing, empty if the directory is too big to keep rendered
+};
+
+static std::unordered_map<std::string, DirListingCache> dirListingCache;
+static size_t dirListingCacheBytes = 0;
+static const size_t dirListingCacheMaxBytes = 32 * 1024 * 1024; // evict past this, rebuilt on demand
+static const size_t dirListingPageCacheMaxEntries = 5000;            // bigger listings are streamed from the entry list instead
+static const time_t dirListingCacheMaxAge = 30;                  // files modified in place don't touch the dir mtime, so refresh sizes/dates now and then
+
+static void appendUrlEncoded(std::string &out, const std::string &in)
 {
-    auto urlEncode = [](const std::string &in) -> std::string
+    static const char hex[] = "0123456789ABCDEF";
+    for (unsigned char c : in)
     {
-        std::ostringstream oss;
-        for (unsigned char c : in)
+        // encode space and all non-unreserved characters per RFC 3986.
+        if ((c >= 'A' && c <= 'Z') ||
+            (c >= 'a' && c <= 'z') ||
+            (c >= '0' && c <= '9') ||
+            c == '-' || c == '_' || c == '.' || c == '~' || c == '/')
         {
-            // encode space and all non-unreserved characters per RFC 3986.
-            if ((c >= 'A' && c <= 'Z') ||
-                (c >= 'a' && c <= 'z') ||
-                (c >= '0' && c <= '9') ||
-                c == '-' || c == '_' || c == '.' || c == '~' || c == '/')
-            {
-                oss << c;
-            }
-            else
-            {
-                char buf[4];
-                snprintf(buf, sizeof(buf), "%02X", c);
-                oss << '%' << buf;
-            }
+            out += (char)c;
         }
-        return oss.str();
-    };
-    std::string fullPath = siteDir.empty() ? relPath : (siteDir + "/" + relPath);
+        else
+        {
+            out += '%';
+            out += hex[c >> 4];
+            out += hex[c & 15];
+        }
+    }
+}
 
-    DIR *dir = opendir(fullPath.c_str());
+static void appendHtmlEscaped(std::string &out, const std::string &in)
+{
+    for (char c : in)
+    {
+        switch (c)
+        {
+        case '<':
+            out += "&lt;";
+            break;
+        case '>':
+            out += "&gt;";
+            break;
+        case '&':
+            out += "&amp;";
+            break;
+        case '"':
+            out += "&quot;";
+            break;
+        default:
+            out += c;
+        }
+    }
+}
+
+// reads the directory with one fstatat per non-directory entry (d_type covers the rest), returns false if unreadable
+static bool readDirEntries(int dirFd, std::vector<DirListingEntry> &entries)
+{
+    int iterFd = dup(dirFd); // fdopendir takes ownership
+    if (iterFd == -1)
+        return false;
+    DIR *dir = fdopendir(iterFd);
     if (!dir)
     {
-        return404(client_fd, siteDir, Page404, contactEmail, ip);
-        return;
+        close(iterFd);
+        return false;
     }
 
-    std::vector<std::string> entries;
     while (auto *ent = readdir(dir))
     {
         const char *name = ent->d_name;
         if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) // skip . and .., add manually
             continue;
-        entries.emplace_back(name);
+        DirListingEntry e{name, false, 0, 0};
+        if (ent->d_type == DT_DIR)
+        {
+            e.isDir = true; // size and date aren't shown for directories, no stat needed
+        }
+        else
+        {
+            // regular files need size and mtime, symlinks/unknown types need following anyway
+            struct stat st;
+            if (fstatat(dirFd, name, &st, 0) == 0)
+            {
+                e.isDir = S_ISDIR(st.st_mode);
+                e.size = st.st_size;
+                e.mtime = st.st_mtime;
+            }
+        }
+        entries.push_back(std::move(e));
     }
     closedir(dir);
-    std::sort(entries.begin(), entries.end());
+    std::sort(entries.begin(), entries.end(), [](const DirListingEntry &a, const DirListingEntry &b)
+              { return a.name < b.name; });
+    return true;
+}
+
+// collects rendered output, when streaming it goes out as Transfer-Encoding: chunked pieces instead of one big buffer
+struct ListingWriter
+{
+    std::string buf;
+    int fd = -1;         // -1 collects everything into buf (for the cache)
+    bool chunked = true; // false for HTTP/1.0 clients, the pieces are sent as is and closing the connection ends the body
+
+    void flushChunk()
+    {
+        if (fd < 0 || buf.empty())
+            return;
+        char sizeLine[24];
+        int n = snprintf(sizeLine, sizeof(sizeLine), "%zx\r\n", buf.size());
+        struct iovec iov[3] = {{sizeLine, (size_t)n}, {&buf[0], buf.size()}, {(void *)"\r\n", 2}};
+        // a chunk sent halfway would corrupt the framing of every chunk after it, so it's all or nothing
+        bool sent = chunked ? sendAll(fd, iov, 3) : sendAll(fd, iov + 1, 1);
+        if (!sent)
+            fd = -2; // client went away or stalled, stop sending
+        buf.clear();
+    }
+
+    // false once the client is gone, rendering the rest would be for nobody
+    bool maybeFlush()
+    {
+        if (fd != -1 && buf.size() >= 16 * 1024)
+            flushChunk();
+        return fd != -2;
+    }
+
+    void finish()
+    {
+        flushChunk();
+        if (fd >= 0 && chunked && !sendAll(fd, "0\r\n\r\n", 5))
+            fd = -2;
+    }
+};
+
+struct ListingQuery // ?offset=&limit=&sort=&format=
+{
+    size_t offset = 0;
+    size_t limit = 0;  // 0 for all
+    char sortKey = 'n'; // n(ame), s(ize), m(time)
+    bool descending = false;
+    bool json = false;
+    bool isDefault = true; // plain html listing, served from the page cache
+};
+
+static ListingQuery parseListingQuery(const std::string &query)
+{
+    ListingQuery q;
+    size_t pos = 0;
+    while (pos < query.size())
+    {
+        size_t amp = query.find('&', pos);
+        if (amp == std::string::npos)
+            amp = query.size();
+        size_t eq = query.find('=', pos);
+        if (eq != std::string::npos && eq < amp)
+        {
+            std::string key = query.substr(pos, eq - pos);
+            std::string value = query.substr(eq + 1, amp - eq - 1);
+            if (key == "offset")
+                q.offset = strtoull(value.c_str(), nullptr, 10);
+            else if (key == "limit")
+                q.limit = strtoull(value.c_str(), nullptr, 10);
+            else if (key == "sort")
+            {
+                q.descending = !value.empty() && value[0] == '-';
+                std::string field = q.descending ? value.substr(1) : value;
+                if (field == "size")
+                    q.sortKey = 's';
+                else if (field == "mtime" || field == "date")
+                    q.sortKey = 'm';
+                else
+                    q.sortKey = 'n';
+            }
+            else if (key == "format")
+                q.json = (value == "json");
+        }
+        pos = amp + 1;
+    }
+    q.isDefault = q.offset == 0 && q.limit == 0 && q.sortKey == 'n' && !q.descending && !q.json;
+    return q;
+}
 
-    std::string dirLabel = relPath.empty() ? "/" : relPath;
-    std::string header = pageHeader;
+// entry order for the query, entries are stored sorted by name already
+static std::vector<uint32_t> listingOrder(const std::vector<DirListingEntry> &entries, const ListingQuery &q)
+{
+    std::vector<uint32_t> order(entries.size());
+    for (size_t i = 0; i < order.size(); ++i)
+        order[i] = (uint32_t)i;
+    if (q.sortKey == 's')
+        std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b)
+                         { return entries[a].size < entries[b].size; });
+    else if (q.sortKey == 'm')
+        std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b)
+                         { return entries[a].mtime < entries[b].mtime; });
+    if (q.descending)
+        std::reverse(order.begin(), order.end());
+    return order;
+}
+
+static void renderDirListing(const std::string &relPath,
+                             const std::vector<DirListingEntry> &entries,
+                             const std::vector<uint32_t> &order,
+                             const ListingQuery &q,
+                             ListingWriter &out)
+{
+    std::string &body = out.buf;
+    std::string dirLabel;
+    appendHtmlEscaped(dirLabel, relPath.empty() ? "/" : relPath);
+    body += pageHeader;
     {
         const string needle = "{Dir}";
         size_t pos = 0;
-        while ((pos = header.find(needle, pos)) != std::string::npos)
+        while ((pos = body.find(needle, pos)) != std::string::npos)
         {
-            header.replace(pos, needle.length(), dirLabel);
+            body.replace(pos, needle.length(), dirLabel);
             pos += dirLabel.length();
         }
     } // replace {Dir} with folder name
 
-    std::string body = header;
     body += "<hr>"; // hr for style points cause its cool
     body += "<tr><th>Name</th><th>Size</th><th>Date Modified</th></tr>";
     if (!relPath.empty())
@@ -237,87 +422,220 @@ void returnDirListing(int client_fd,
         body += "<tr><td><a href=\"../\" class=\"upfolder\">Parent Directory (../)</a></td><td></td><td></td></tr>"; // parent dir
     }
 
-    for (auto &e : entries)
+    size_t end = (q.limit == 0 || q.limit > order.size() - q.offset) ? order.size() : q.offset + q.limit; // offset is clamped already, limit can be anything
+    for (size_t i = q.offset; i < end; ++i)
     {
-        // check if dir, if file, add size data later
-        bool isDir = false;
+        const DirListingEntry &e = entries[order[i]];
+        body += "<tr><td><a href=\"";
+        appendUrlEncoded(body, e.name);
+        if (e.isDir)
         {
-            struct stat st;
-            std::string p = fullPath + "/" + e;
-            if (stat(p.c_str(), &st) == 0 && S_ISDIR(st.st_mode))
-                isDir = true;
+            body += "/\" class=\"directory\">"; // ensure link ends with slash for directories
+            appendHtmlEscaped(body, e.name);
+            body += "/</a></td><td></td><td></td>"; // empty size and date for directories
         }
+        else
+        {
+            body += "\" class=\"";
+            body += getFileTypeClass(e.name);
+            body += "\">";
+            appendHtmlEscaped(body, e.name);
+            body += "</a></td>";
 
-        std::string display = e;
-        if (isDir && display.back() != '/')
-            display += '/';
+            // convert size to human readable
+            const char *units[] = {"B", "KB", "MB", "GB"};
+            int unitIdx = 0;
+            double fsize = (double)e.size;
+            while (fsize >= 1024.0 && unitIdx < 3)
+            {
+                fsize /= 1024.0;
+                unitIdx++;
+            }
+            // round to 1 decimal place at most
+            char cells[96];
+            int n;
+            if (unitIdx == 0)
+                n = snprintf(cells, sizeof(cells), "<td>%lld %s</td>", (long long)e.size, units[unitIdx]);
+            else
+                n = snprintf(cells, sizeof(cells), "<td>%.1f %s</td>", fsize, units[unitIdx]);
+            body.append(cells, n);
 
-        body += "<tr><td><a href=\"";
-    body += urlEncode(e);
-        if (isDir)
+            // date modified
+            struct tm tm_info;
+            localtime_r(&e.mtime, &tm_info);
+            n = (int)strftime(cells, sizeof(cells), "<td>%Y-%m-%d %H:%M</td>", &tm_info);
+            body.append(cells, n);
+        }
+
+        // close
+        body += "</tr>";
+        if (!out.maybeFlush())
+            return;
+    }
+
+    if (q.limit != 0 && (q.offset > 0 || end < order.size()))
+    {
+        // page links, keep the sort the client asked for
+        const char *sortName = q.sortKey == 's' ? "size" : (q.sortKey == 'm' ? "mtime" : "name");
+        char link[160];
+        body += "<tr><td>";
+        if (q.offset > 0)
+        {
+            size_t prev = q.offset > q.limit ? q.offset - q.limit : 0;
+            snprintf(link, sizeof(link), "<a href=\"?offset=%zu&amp;limit=%zu&amp;sort=%s%s\">&laquo; Previous</a> ",
+                     prev, q.limit, q.descending ? "-" : "", sortName);
+            body += link;
+        }
+        if (end < order.size())
         {
-            body += "/"; // ensure link ends with slash for directories
-            body += "\" class=\"directory\">" + display + "</a></td>";
+            snprintf(link, sizeof(link), "<a href=\"?offset=%zu&amp;limit=%zu&amp;sort=%s%s\">Next &raquo;</a>",
+                     end, q.limit, q.descending ? "-" : "", sortName);
+            body += link;
         }
+        snprintf(link, sizeof(link), "</td><td colspan=\"2\">%zu-%zu of %zu</td></tr>", q.offset + 1, end, order.size());
+        body += link;
+    }
+    body += pageFooter;
+}
+
+static void renderDirListingJson(const std::string &relPath,
+                                 const std::vector<DirListingEntry> &entries,
+                                 const std::vector<uint32_t> &order,
+                                 const ListingQuery &q,
+                                 ListingWriter &out)
+{
+    std::string &body = out.buf;
+    size_t end = (q.limit == 0 || q.limit > order.size() - q.offset) ? order.size() : q.offset + q.limit;
+    char num[128];
+
+    body += "{\"path\":";
+    appendJsonString(body, relPath.empty() ? "/" : "/" + relPath + "/");
+    snprintf(num, sizeof(num), ",\"offset\":%zu,\"limit\":%zu,\"total\":%zu,\"entries\":[", q.offset, q.limit, order.size());
+    body += num;
+    for (size_t i = q.offset; i < end; ++i)
+    {
+        const DirListingEntry &e = entries[order[i]];
+        if (i != q.offset)
+            body += ',';
+        body += "{\"name\":";
+        appendJsonString(body, e.name);
+        if (e.isDir)
+            body += ",\"type\":\"dir\"}";
         else
         {
-            body += "\" class=\"" + getFileTypeClass(e) + "\">" + display + "</a></td>";
+            snprintf(num, sizeof(num), ",\"type\":\"file\",\"size\":%lld,\"mtime\":%lld}", (long long)e.size, (long long)e.mtime);
+            body += num;
         }
+        if (!out.maybeFlush())
+            return;
+    }
+    body += "]}";
+}
 
-        if (!isDir)
+void returnDirListing(int client_fd,
+                      const std::string &relPath,
+                      const std::string &query,
+                      const IpAddr &ip,
+                      bool http10)
+{
+    int dirFd = openInSite(relPath.c_str(), O_RDONLY | O_DIRECTORY);
+    struct stat dst;
+    if (dirFd == -1 || fstat(dirFd, &dst) != 0)
+    {
+        if (dirFd != -1)
+            close(dirFd);
+        return404(client_fd, ip, relPath);
+        return;
+    }
+
+    time_t now = time(nullptr);
+    DirListingCache uncached; // a listing too big for the cache is built just for this request
+    auto it = dirListingCache.find(relPath);
+    bool fresh = it != dirListingCache.end() &&
+                 it->second.dirMtime.tv_sec == dst.st_mtim.tv_sec &&
+                 it->second.dirMtime.tv_nsec == dst.st_mtim.tv_nsec &&
+                 it->second.dirIno == dst.st_ino &&
+                 now - it->second.builtAt < dirListingCacheMaxAge;
+    if (!fresh)
+    {
+        std::vector<DirListingEntry> entries;
+        if (!readDirEntries(dirFd, entries))
         {
-            // Get file size
-            struct stat st;
-            if (stat((fullPath + "/" + e).c_str(), &st) == 0)
-            {
-                int bytes = st.st_size;
-                // convert to human readable
-                const char *units[] = {"B", "KB", "MB", "GB"};
-                int unitIdx = 0;
-                double fsize = bytes;
-                while (fsize >= 1024.0 && unitIdx < 3)
-                {
-                    fsize /= 1024.0;
-                    unitIdx++;
-                }
-                // round to 1 decimal place at most
-                char sizeStr[32];
-                if (unitIdx == 0)
-                    snprintf(sizeStr, sizeof(sizeStr), "%d %s", bytes, units[unitIdx]);
-                else
-                    snprintf(sizeStr, sizeof(sizeStr), "%.1f %s", fsize, units[unitIdx]);
-                body += "<td>" + std::string(sizeStr) + "</td>";
-
-                // get date modified if available
-                char timebuf[64];
-                struct tm *tm_info = localtime(&st.st_mtime);
-                strftime(timebuf, sizeof(timebuf), "%Y-%m-%d %H:%M", tm_info);
-                body += "<td>" + std::string(timebuf) + "</td>";
-            }
-        } else
+            close(dirFd);
+            return404(client_fd, ip, relPath);
+            return;
+        }
+
+        // small directories also keep the default page rendered, huge ones are always streamed
+        std::string page;
+        if (entries.size() <= dirListingPageCacheMaxEntries)
         {
-            body += "<td></td><td></td>"; // empty size and date for directories
+            ListingWriter collect;
+            std::vector<uint32_t> order = listingOrder(entries, ListingQuery{});
+            renderDirListing(relPath, entries, order, ListingQuery{}, collect);
+            page.swap(collect.buf);
         }
 
-        // close
-        body += "</tr>";
+        size_t bytes = heapBytes(relPath) + heapBytes(page) + entries.capacity() * sizeof(DirListingEntry);
+        for (const DirListingEntry &e : entries)
+            bytes += heapBytes(e.name);
+        if (it != dirListingCache.end())
+        {
+            dirListingCacheBytes -= it->second.bytes;
+            dirListingCache.erase(it);
+        }
+        if (bytes > dirListingCacheMaxBytes)
+        {
+            // bigger than the whole budget, keeping it would push out everything else
+            uncached = DirListingCache{dst.st_mtim, dst.st_ino, now, bytes, std::move(entries), std::move(page)};
+            it = dirListingCache.end();
+        }
+        else
+        {
+            for (auto victim = dirListingCache.begin();
+                 dirListingCacheBytes + bytes > dirListingCacheMaxBytes && victim != dirListingCache.end();)
+            {
+                dirListingCacheBytes -= victim->second.bytes;
+                victim = dirListingCache.erase(victim);
+            }
+            dirListingCacheBytes += bytes;
+            it = dirListingCache.emplace(relPath, DirListingCache{dst.st_mtim, dst.st_ino, now, bytes, std::move(entries), std::move(page)}).first;
+        }
     }
-    body += pageFooter;
+    close(dirFd);
 
-    char hdr[256];
-    int hdrLen = snprintf(hdr, sizeof(hdr),
-                          "HTTP/1.1 200 OK\r\n"
-                          "Content-Length: %zu\r\n"
-                          "Content-Type: text/html\r\n"
-                          "Connection: close\r\n"
-                          "\r\n",
-                          body.size());
-    if (hdrLen <= 0 || hdrLen >= (int)sizeof(hdr))
+    const DirListingCache &cached = it == dirListingCache.end() ? uncached : it->second;
+    ListingQuery q = parseListingQuery(query);
+    if (q.isDefault && !cached.page.empty())
     {
-        return404(client_fd, siteDir, Page404, contactEmail, ip);
+        ResponseHeader hdr("200 OK");
+        hdr.addf("Content-Length: %zu", cached.page.size());
+        hdr.add("Content-Type: text/html; charset=utf-8");
+        if (sendHeader(client_fd, hdr, true))
+            sendAll(client_fd, cached.page.data(), cached.page.size());
+        close(client_fd);
         return;
     }
-    send(client_fd, hdr, hdrLen, 0);
-    send(client_fd, body.data(), body.size(), 0);
+
+    // paged, sorted, json or too big to keep rendered: stream it
+    ResponseHeader hdr("200 OK");
+    hdr.add(q.json ? "Content-Type: application/json" : "Content-Type: text/html; charset=utf-8");
+    if (!http10)
+        hdr.add("Transfer-Encoding: chunked");
+    if (sendHeader(client_fd, hdr, true))
+    {
+        ListingWriter out;
+        out.fd = client_fd;
+        out.chunked = !http10;
+        out.buf.reserve(20 * 1024);
+        std::vector<uint32_t> order = listingOrder(cached.entries, q);
+        if (q.offset > order.size())
+            q.offset = order.size();
+        if (q.json)
+            renderDirListingJson(relPath, cached.entries, order, q, out);
+        else
+            renderDirListing(relPath, cached.entries, order, q, out);
+        out.finish();
+    }
     close(client_fd);
-}
\ No newline at end of file
+}
@@ -1,5 +1,6 @@
 #include "include/returnErrorPage.h"
 #include "include/headerManager.h"
+#include "include/underAttack.h"
 #include <string>
 #include <sys/socket.h>
 #include <unistd.h>
@@ -8,11 +9,52 @@
 
 using namespace std;
 
-void returnErrorPage(int client_fd, int errorType, string contactMail)
+struct PrerenderedPage // full response for one error code
 {
-    // build html body
-    const char *ctype = "text/html; charset=utf-8";
+    int code;
+    PreparedResponse response;
+    PreparedResponse minimal; // one line of text, sent instead while under attack
+};
+
+static const int errorCodes[] = {400, 401, 403, 4031, 404, 405, 418, 429, 500, 501, 503};
+static const size_t errorCodeCount = sizeof(errorCodes) / sizeof(errorCodes[0]);
+static PrerenderedPage pages[errorCodeCount];
+
+static const char *errorTextFor(int errorType)
+{
+    switch (errorType)
+    {
+    case 400:
+        return "Bad Request";
+    case 401:
+        return "Unauthorized";
+    case 403:
+        return "Forbidden";
+    case 4031: // low trust score
+        return "Forbidden<br>Your activity has been flagged as suspicious."
+               "<br>If you believe this is an error, try again later, and contact the site administrator";
+    case 404:
+        return "Not Found";
+    case 405:
+        return "Method Not Allowed";
+    case 500:
+        return "Internal Server Error";
+    case 501:
+        return "Not Implemented";
+    case 503:
+        return "Service Unavailable";
+    case 418:
+        return "I'm a teapot"; // haha funni
+    case 429:
+        return "Too Many Requests";
+    default:
+        return "Unknown Error";
+    }
+}
 
+static void renderErrorPage(PrerenderedPage &page, int errorType, const string &contactMail)
+{
+    // build html body
     static const string styling = "<style>"
     "body{font-family:'Segoe UI',Tahoma,Geneva,Verdana,sans-serif;text-align:center;margin-top:50px;background-color:#2d2d2d;color:#e0e0e0}"
     "h1{font-size:48px;color:#f0f0f0}"
@@ -30,45 +72,10 @@ void returnErrorPage(int client_fd, int errorType, string contactMail)
         "<footer><p>Powered by faucet</p></footer>"
         "</body></html>";
 
-    string errorText;
-    switch (errorType)
-    {
-    case 400:
-        errorText = "Bad Request";
-        break;
-    case 401:
-        errorText = "Unauthorized";
-        break;
-    case 403:
-        errorText = "Forbidden";
-        break;
-    case 4031: // low trust score
-        errorText = "Forbidden<br>Your activity has been flagged as suspicious."
-                    "<br>If you believe this is an error, try again later, and contact the site administrator";
+    page.code = errorType;
+    string errorText = errorTextFor(errorType);
+    if (errorType == 4031)
         errorType = 403; // send as normal 403
-        break;
-    case 404:
-        errorText = "Not Found";
-        break;
-    case 500:
-        errorText = "Internal Server Error";
-        break;
-    case 501:
-        errorText = "Not Implemented";
-        break;
-    case 503:
-        errorText = "Service Unavailable";
-        break;
-    case 418:
-        errorText = "I'm a teapot";
-        break; // haha funni
-    case 429:
-        errorText = "Too Many Requests";
-        break;
-    default:
-        errorText = "Unknown Error";
-        break;
-    }
 
     string body = pageTemplate;
     size_t pos;
@@ -80,54 +87,60 @@ void returnErrorPage(int client_fd, int errorType, string contactMail)
         body.replace(pos, 15, errorText); // just errortext without br and contact
 
     // HTTP header
-    string header;
+    char status[64];
+    size_t statusTextLen = errorText.find('<'); // 4031 carries extra html, keep it out of the status line
+    if (statusTextLen == string::npos)
+        statusTextLen = errorText.size();
+    snprintf(status, sizeof(status), "%d %.*s", errorType, (int)statusTextLen, errorText.c_str());
+    ResponseHeader header(status);
     if (errorType == 401)
     {
-        header = "HTTP/1.1 401 Unauthorized\r\n";
-        header += "WWW-Authenticate: Basic realm=\"faucet\"\r\n";
-        header += "Cache-Control: no-store\r\n";
-        header += "Content-Type: ";
-        header += ctype;
-        header += "\r\nContent-Length: ";
-        header += to_string(body.size());
-        header += "\r\nConnection: close\r\n\r\n";
-        header = headerManager(header);
-        if (header == "invalid")
-        {
-            // fallback
-            printf("Invalid header generated in returnErrorPage, using fallback 1.\n");
-            header = "HTTP/1.1 401 Unauthorized\r\n"
-                     "WWW-Authenticate: Basic realm=\"faucet\"\r\n"
-                     "Cache-Control: no-store\r\n"
-                     "Content-Type: text/html; charset=utf-8\r\n"
-                     "Content-Length: " +
-                     to_string(body.size()) +
-                     "\r\nConnection: close\r\n\r\n";
-        }
+        header.add("WWW-Authenticate: Basic realm=\"faucet\"");
+        header.add("Cache-Control: no-store");
     }
-    else
+    if (errorType == 405)
+        header.add("Allow: GET");
+    ResponseHeader minimalHeader = header;
+    header.add("Content-Type: text/html; charset=utf-8");
+    header.addf("Content-Length: %zu", body.size());
+    page.response = prepareResponse(header, body);
+
+    string minimalBody = string(status) + "\n";
+    minimalHeader.add("Content-Type: text/plain; charset=utf-8");
+    minimalHeader.addf("Content-Length: %zu", minimalBody.size());
+    page.minimal = prepareResponse(minimalHeader, minimalBody);
+}
+
+void initializeErrorPages(const string &contactMail)
+{
+    for (size_t i = 0; i < errorCodeCount; ++i)
+        renderErrorPage(pages[i], errorCodes[i], contactMail);
+}
+
+static const PrerenderedPage *findPage(int errorType)
+{
+    for (size_t i = 0; i < errorCodeCount; ++i)
     {
-        header = "HTTP/1.1 " + to_string(errorType) + " " + errorText + "\r\n";
-        header += "Content-Type: ";
-        header += ctype;
-        header += "\r\nContent-Length: ";
-        header += to_string(body.size());
-        header += "\r\nConnection: close\r\n\r\n";
-        header = headerManager(header);
-        if (header == "invalid")
-        {
-            // fallback
-            printf("Invalid header generated in returnErrorPage, using fallback 2.\n");
-            header = "HTTP/1.1 " + to_string(errorType) + " " + errorText + "\r\n"
-                                                                            "Content-Type: text/html; charset=utf-8\r\n"
-                                                                            "Content-Length: " +
-                     to_string(body.size()) +
-                     "\r\nConnection: close\r\n\r\n";
-        }
+        if (pages[i].code == errorType)
+            return &pages[i];
     }
+    return nullptr;
+}
 
-    string response = header + body;
+void returnErrorPage(int client_fd, int errorType)
+{
+    const PrerenderedPage *page = findPage(errorType);
+    if (!page)
+    {
+        printf("No prerendered error page for %d, sending 500 instead.\n", errorType);
+        page = findPage(500);
+    }
+    if (!page) // initializeErrorPages() not called yet
+    {
+        close(client_fd);
+        return;
+    }
 
-    send(client_fd, response.c_str(), response.size(), 0);
+    sendPrepared(client_fd, underAttack() ? page->minimal : page->response);
     close(client_fd);
-}
\ No newline at end of file
+}
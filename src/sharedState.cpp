@@ -0,0 +1,376 @@
+#include "include/sharedState.h"
+#include "include/ipAddr.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+
+using namespace std;
+
+static const char sharedMagic[8] = {'F', 'C', 'T', 'S', 'H', 'A', 'R', 'E'};
+static const uint32_t sharedVersion = 2;
+static const uint32_t sharedSlots = 1 << 18; // 32 MiB of shm, pages only get allocated as addresses show up
+static const time_t sharedIdleReclaim = 300; // slots unused this long (and not blocked) can be taken by a new address
+
+struct SharedHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t slotCount;
+    atomic<uint32_t> initState; // 0 fresh, 1 being initialized, 2 ready
+    uint8_t reserved[44];
+};
+
+// the address is guarded by a seqlock, odd seq means it's being (re)written, 0 means never used
+// blockedUntil is only written while holding the seqlock with the address checked, so a block can't land on
+// whoever reclaimed the slot. the counters are plain atomics that recheck seq afterwards, an update racing a
+// reclaim can at worst leave one count with the new owner
+struct SharedSlot
+{
+    atomic<uint32_t> seq;
+    uint32_t reserved;
+    uint8_t addr[16];
+    atomic<int64_t> blockedUntil;
+    atomic<int64_t> rateSecond;
+    atomic<int64_t> lastSeen;
+    atomic<uint32_t> rateCount;
+    uint32_t reserved2;
+    // trust windows, one word each so they update with a single CAS
+    atomic<uint64_t> windows[SharedWindowCount]; // last hit << 24 | count, the count restarts after a quiet window
+    atomic<uint64_t> requestMinutes;             // minute << 32 | previous minute's count << 16 | this minute's count
+    atomic<uint64_t> lowestScore;                // when << 8 | score, the lowest score in the last minute
+    uint64_t reserved3[4];
+};
+
+static_assert(sizeof(SharedHeader) == 64 && sizeof(SharedSlot) == 128, "shared state layout is fixed");
+static_assert(atomic<uint32_t>::is_always_lock_free && atomic<int64_t>::is_always_lock_free, "shared atomics must be lock-free");
+
+static SharedSlot *sharedTable = nullptr;
+
+bool openSharedState(const string &name)
+{
+    string shmName = "/faucet-" + name;
+    int fd = shm_open(shmName.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd == -1)
+    {
+        perror("shm_open");
+        return false;
+    }
+    size_t size = sizeof(SharedHeader) + (size_t)sharedSlots * sizeof(SharedSlot);
+    struct stat st{};
+    if (fstat(fd, &st) != 0 || ((size_t)st.st_size != size && ftruncate(fd, (off_t)size) != 0))
+    {
+        perror("ftruncate");
+        close(fd);
+        return false;
+    }
+    void *map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        perror("mmap");
+        return false;
+    }
+
+    // first process in fills the header, everyone else waits for it
+    SharedHeader *h = (SharedHeader *)map;
+    uint32_t expected = 0;
+    if (h->initState.compare_exchange_strong(expected, 1))
+    {
+        memcpy(h->magic, sharedMagic, sizeof(sharedMagic));
+        h->version = sharedVersion;
+        h->slotCount = sharedSlots;
+        h->initState.store(2, memory_order_release);
+    }
+    else
+    {
+        for (int i = 0; i < 1000 && h->initState.load(memory_order_acquire) != 2; i++)
+            usleep(1000);
+    }
+    if (h->initState.load(memory_order_acquire) != 2 || memcmp(h->magic, sharedMagic, sizeof(sharedMagic)) != 0 ||
+        h->version != sharedVersion || h->slotCount != sharedSlots)
+    {
+        printf("Shared state %s belongs to another faucet version, not sharing state.\n", shmName.c_str());
+        munmap(map, size);
+        return false;
+    }
+    sharedTable = (SharedSlot *)((char *)map + sizeof(SharedHeader));
+    return true;
+}
+
+bool sharedStateActive()
+{
+    return sharedTable != nullptr;
+}
+
+static size_t slotIndex(const uint8_t addr[16])
+{
+    uint64_t h = 1469598103934665603ULL;
+    for (int i = 0; i < 16; i++)
+    {
+        h ^= addr[i];
+        h *= 1099511628211ULL;
+    }
+    return (size_t)(h ^ (h >> 31)) & (sharedSlots - 1);
+}
+
+// true if slot currently holds addr (consistent read under the seqlock)
+static bool slotHolds(SharedSlot &slot, const uint8_t addr[16], uint32_t &seqOut)
+{
+    for (int spins = 0;; spins++)
+    {
+        uint32_t before = slot.seq.load(memory_order_acquire);
+        seqOut = before;
+        if (before == 0)
+            return false;
+        if (before & 1)
+        {
+            if (spins > 1000)
+                return false; // writer died mid-claim, treat the slot as taken by someone else
+            continue;        // being rewritten, a few stores at most
+        }
+        uint8_t copy[16];
+        memcpy(copy, slot.addr, 16);
+        atomic_thread_fence(memory_order_acquire);
+        if (slot.seq.load(memory_order_relaxed) == before)
+            return memcmp(copy, addr, 16) == 0;
+    }
+}
+
+// writes addr into slot if its seq is still expected, resetting the counters
+static bool claimSlot(SharedSlot &slot, uint32_t expected, const uint8_t addr[16], time_t now)
+{
+    if (!slot.seq.compare_exchange_strong(expected, expected + 1, memory_order_acquire))
+        return false;
+    memcpy(slot.addr, addr, 16);
+    slot.blockedUntil.store(0, memory_order_relaxed);
+    slot.rateSecond.store(0, memory_order_relaxed);
+    slot.rateCount.store(0, memory_order_relaxed);
+    for (auto &window : slot.windows)
+        window.store(0, memory_order_relaxed);
+    slot.requestMinutes.store(0, memory_order_relaxed);
+    slot.lowestScore.store(0, memory_order_relaxed);
+    slot.lastSeen.store(now, memory_order_relaxed);
+    slot.seq.store(expected + 2, memory_order_release);
+    return true;
+}
+
+// finds addr's slot, with create it takes an empty or long idle slot along the probe chain, nullptr if none
+// seqOut is the seq it was found under, stillHolds() tells if an update made after went to the right address
+static SharedSlot *findSlot(const IpAddr &ip, bool create, uint32_t &seqOut)
+{
+    if (!sharedTable)
+        return nullptr;
+    const uint8_t *addr = ip.bytes;
+    time_t now = time(nullptr);
+    size_t idx = slotIndex(addr);
+    for (int attempt = 0; attempt < 2; attempt++)
+    {
+        SharedSlot *idle = nullptr;
+        uint32_t idleSeq = 0;
+        for (uint32_t probe = 0; probe < 64; probe++) // chains are short, a full neighbourhood means fall back to local state
+        {
+            SharedSlot &slot = sharedTable[(idx + probe) & (sharedSlots - 1)];
+            uint32_t seq;
+            if (slotHolds(slot, addr, seq))
+            {
+                seqOut = seq;
+                return &slot;
+            }
+            if (seq == 0)
+            {
+                // end of the chain, it isn't here
+                if (!create)
+                    return nullptr;
+                if (idle && claimSlot(*idle, idleSeq, addr, now))
+                {
+                    seqOut = idleSeq + 2;
+                    return idle;
+                }
+                if (claimSlot(slot, 0, addr, now))
+                {
+                    seqOut = 2;
+                    return &slot;
+                }
+                break; // raced with another process, look again, it may have been the same address
+            }
+            if (!idle && !(seq & 1) && slot.blockedUntil.load(memory_order_relaxed) <= now &&
+                now - slot.lastSeen.load(memory_order_relaxed) > sharedIdleReclaim)
+            {
+                idle = &slot;
+                idleSeq = seq;
+            }
+        }
+        if (create && idle && claimSlot(*idle, idleSeq, addr, now))
+        {
+            seqOut = idleSeq + 2;
+            return idle;
+        }
+    }
+    return nullptr;
+}
+
+static bool stillHolds(const SharedSlot &slot, uint32_t seq)
+{
+    return slot.seq.load(memory_order_acquire) == seq;
+}
+
+// finds or creates addr's slot and runs update on it, again if the slot was reclaimed meanwhile
+template <typename Update>
+static bool updateSlot(const IpAddr &ip, Update update)
+{
+    for (int attempt = 0; attempt < 3; attempt++)
+    {
+        uint32_t seq;
+        SharedSlot *slot = findSlot(ip, true, seq);
+        if (!slot)
+            return false;
+        update(*slot);
+        if (stillHolds(*slot, seq))
+            return true;
+    }
+    return false;
+}
+
+time_t sharedBlockedUntil(const IpAddr &ip)
+{
+    uint32_t seq;
+    SharedSlot *slot = findSlot(ip, false, seq);
+    if (!slot)
+        return -1;
+    time_t until = (time_t)slot->blockedUntil.load(memory_order_relaxed);
+    if (!stillHolds(*slot, seq))
+        return -1;
+    return until > time(nullptr) ? until : 0;
+}
+
+void sharedBlock(const IpAddr &ip, time_t blockedUntil)
+{
+    for (int attempt = 0; attempt < 3; attempt++)
+    {
+        uint32_t seq;
+        SharedSlot *slot = findSlot(ip, true, seq);
+        if (!slot)
+            return;
+        // take the write side of the seqlock, the slot may have been reclaimed for another address since the lookup
+        if (!slot->seq.compare_exchange_strong(seq, seq + 1, memory_order_acquire))
+            continue;
+        if (memcmp(slot->addr, ip.bytes, 16) == 0)
+        {
+            slot->blockedUntil.store(blockedUntil, memory_order_relaxed);
+            slot->lastSeen.store(time(nullptr), memory_order_relaxed);
+            slot->seq.store(seq + 2, memory_order_release);
+            return;
+        }
+        slot->seq.store(seq + 2, memory_order_release);
+    }
+}
+
+int sharedCountRequest(const IpAddr &ip, time_t now)
+{
+    int count = -1;
+    bool counted = updateSlot(ip, [&](SharedSlot &slot)
+                              {
+                                  slot.lastSeen.store(now, memory_order_relaxed);
+                                  int64_t second = slot.rateSecond.load(memory_order_relaxed);
+                                  if (second != now && slot.rateSecond.compare_exchange_strong(second, now, memory_order_relaxed))
+                                      slot.rateCount.store(0, memory_order_relaxed); // first request of a new second, whoever wins resets
+                                  count = (int)slot.rateCount.fetch_add(1, memory_order_relaxed) + 1; });
+    return counted ? count : -1;
+}
+
+static const uint64_t windowCountMax = (1 << 24) - 1;
+
+static int windowCount(uint64_t packed, int windowSeconds, time_t now)
+{
+    time_t last = (time_t)(packed >> 24);
+    return packed && now - last <= windowSeconds ? (int)(packed & windowCountMax) : 0;
+}
+
+int sharedCountWindow(const IpAddr &ip, SharedWindow window, int windowSeconds, time_t now)
+{
+    int count = -1;
+    bool counted = updateSlot(ip, [&](SharedSlot &slot)
+                              {
+                                  slot.lastSeen.store(now, memory_order_relaxed);
+                                  uint64_t packed = slot.windows[window].load(memory_order_relaxed);
+                                  uint64_t next;
+                                  do
+                                  {
+                                      uint64_t n = (uint64_t)windowCount(packed, windowSeconds, now) + 1;
+                                      next = (uint64_t)now << 24 | min(n, windowCountMax);
+                                  } while (!slot.windows[window].compare_exchange_weak(packed, next, memory_order_relaxed));
+                                  count = (int)(next & windowCountMax); });
+    return counted ? count : -1;
+}
+
+int sharedWindowCount(const IpAddr &ip, SharedWindow window, int windowSeconds, time_t now)
+{
+    uint32_t seq;
+    SharedSlot *slot = findSlot(ip, false, seq);
+    if (!slot)
+        return -1;
+    int count = windowCount(slot->windows[window].load(memory_order_relaxed), windowSeconds, now);
+    return stillHolds(*slot, seq) ? count : -1;
+}
+
+int sharedCountRequestMinute(const IpAddr &ip, time_t now)
+{
+    int estimate = -1;
+    bool counted = updateSlot(ip, [&](SharedSlot &slot)
+                              {
+                                  slot.lastSeen.store(now, memory_order_relaxed);
+                                  uint64_t minute = (uint64_t)now / 60;
+                                  uint64_t packed = slot.requestMinutes.load(memory_order_relaxed);
+                                  uint64_t next;
+                                  do
+                                  {
+                                      uint64_t at = packed >> 32, previous = 0, current = 0;
+                                      if (at == minute)
+                                      {
+                                          previous = (packed >> 16) & 0xffff;
+                                          current = packed & 0xffff;
+                                      }
+                                      else if (at + 1 == minute)
+                                      {
+                                          previous = packed & 0xffff;
+                                      }
+                                      current = min<uint64_t>(current + 1, 0xffff);
+                                      next = minute << 32 | previous << 16 | current;
+                                  } while (!slot.requestMinutes.compare_exchange_weak(packed, next, memory_order_relaxed));
+                                  // sliding minute estimate, the previous minute weighted by how much of it is still in range
+                                  uint64_t previous = (next >> 16) & 0xffff, current = next & 0xffff;
+                                  estimate = (int)(current + previous * (uint64_t)(60 - now % 60) / 60); });
+    return counted ? estimate : -1;
+}
+
+int sharedLowestScore(const IpAddr &ip, int score, time_t now)
+{
+    int lowest = -1;
+    bool stored = updateSlot(ip, [&](SharedSlot &slot)
+                             {
+                                 uint64_t packed = slot.lowestScore.load(memory_order_relaxed);
+                                 for (;;)
+                                 {
+                                     time_t when = (time_t)(packed >> 8);
+                                     int previous = (int)(packed & 0xff);
+                                     if (packed && now - when <= 60 && previous <= score)
+                                     {
+                                         lowest = previous;
+                                         return;
+                                     }
+                                     // first in the window or a new low, the window starts over from now
+                                     uint64_t next = (uint64_t)now << 8 | (uint64_t)(score & 0xff);
+                                     if (slot.lowestScore.compare_exchange_weak(packed, next, memory_order_relaxed))
+                                     {
+                                         lowest = score;
+                                         return;
+                                     }
+                                 } });
+    return stored ? lowest : -1;
+}
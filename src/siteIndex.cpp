@@ -0,0 +1,297 @@
+#include "include/siteIndex.h"
+#include "include/contentTypes.h"
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <vector>
+#include <unordered_map>
+
+using namespace std;
+
+static unordered_map<string, SiteEntry> siteEntries; // rel path -> entry, "" is the root
+static unordered_map<int, string> watchDirs;         // inotify wd -> rel dir
+static string indexRoot;                             // siteDir as opened from the working directory
+static int inotifyFd = -1;
+
+static const size_t siteIndexMaxEntries = 500000; // past this dirs are left incomplete and served from the filesystem
+
+// IN_MODIFY is left out on purpose, sizes are taken from fstat when serving and a big upload would flood us
+static const uint32_t watchMask = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | IN_ATTRIB | IN_ONLYDIR;
+
+static string joinRel(const string &dir, const char *name)
+{
+    return dir.empty() ? string(name) : dir + "/" + name;
+}
+
+static string fsPath(const string &rel)
+{
+    if (rel.empty())
+        return indexRoot;
+    return indexRoot + "/" + rel;
+}
+
+static SiteEntry entryFromStat(const string &rel, const struct stat &st)
+{
+    SiteEntry e{};
+    e.isDir = S_ISDIR(st.st_mode);
+    e.complete = false;
+    e.size = st.st_size;
+    e.mtime = st.st_mtime;
+    e.contentType = e.isDir ? nullptr : guessContentType(rel.c_str());
+    return e;
+}
+
+static void updateIndexFile(const string &dirRel) // which index file a dir serves, same order as main.cpp tries them
+{
+    auto it = siteEntries.find(dirRel);
+    if (it == siteEntries.end() || !it->second.isDir)
+        return;
+    it->second.indexFile.clear();
+    for (const char *idx : {"index.html", "index.htm"})
+    {
+        auto f = siteEntries.find(joinRel(dirRel, idx));
+        if (f != siteEntries.end() && !f->second.isDir)
+        {
+            it->second.indexFile = idx;
+            break;
+        }
+    }
+}
+
+// reads dirRel (already in siteEntries) and everything below it, watching each directory before reading it
+static void indexDirectory(const string &rel)
+{
+    vector<string> pending{rel};
+    while (!pending.empty())
+    {
+        string dirRel = pending.back();
+        pending.pop_back();
+        string full = fsPath(dirRel);
+
+        bool complete = true;
+        int wd = inotify_add_watch(inotifyFd, full.c_str(), watchMask);
+        if (wd >= 0)
+            watchDirs[wd] = dirRel;
+        else
+            complete = false; // can't see changes, so don't trust what we read either
+
+        int dirFd = open(full.c_str(), O_RDONLY | O_DIRECTORY);
+        DIR *dir = dirFd == -1 ? nullptr : fdopendir(dirFd);
+        if (!dir)
+        {
+            if (dirFd != -1)
+                close(dirFd);
+            complete = false;
+        }
+        else
+        {
+            while (auto *ent = readdir(dir))
+            {
+                const char *name = ent->d_name;
+                if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+                    continue;
+                if (siteEntries.size() >= siteIndexMaxEntries)
+                {
+                    complete = false;
+                    break;
+                }
+                struct stat st;
+                if (fstatat(dirFd, name, &st, 0) != 0 || (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode)))
+                    continue; // broken symlinks and special files are 404s anyway
+
+                string childRel = joinRel(dirRel, name);
+                SiteEntry e = entryFromStat(childRel, st);
+                bool isLink = ent->d_type == DT_LNK;
+                if (ent->d_type == DT_UNKNOWN)
+                {
+                    struct stat lst;
+                    isLink = fstatat(dirFd, name, &lst, AT_SYMLINK_NOFOLLOW) == 0 && S_ISLNK(lst.st_mode);
+                }
+                siteEntries[childRel] = e;
+                if (e.isDir && !isLink) // symlinked dirs stay incomplete, avoids loops
+                    pending.push_back(childRel);
+            }
+            closedir(dir);
+        }
+
+        auto it = siteEntries.find(dirRel);
+        if (it != siteEntries.end())
+            it->second.complete = complete;
+        updateIndexFile(dirRel);
+    }
+}
+
+// drops rel and, if it was a directory, everything below it along with the watches
+static void removeTree(const string &rel)
+{
+    auto it = siteEntries.find(rel);
+    if (it == siteEntries.end())
+        return;
+    bool wasDir = it->second.isDir;
+    siteEntries.erase(it);
+    if (!wasDir)
+        return;
+
+    string prefix = rel + "/";
+    for (auto e = siteEntries.begin(); e != siteEntries.end();)
+    {
+        if (e->first.compare(0, prefix.size(), prefix) == 0)
+            e = siteEntries.erase(e);
+        else
+            ++e;
+    }
+    for (auto w = watchDirs.begin(); w != watchDirs.end();)
+    {
+        if (w->second == rel || w->second.compare(0, prefix.size(), prefix) == 0)
+        {
+            inotify_rm_watch(inotifyFd, w->first);
+            w = watchDirs.erase(w);
+        }
+        else
+            ++w;
+    }
+}
+
+// re-reads one path after an event in its parent directory
+static void refreshPath(const string &rel, const string &parentRel)
+{
+    struct stat st;
+    if (stat(fsPath(rel).c_str(), &st) != 0 || (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode)))
+    {
+        removeTree(rel);
+    }
+    else
+    {
+        auto it = siteEntries.find(rel);
+        bool wasDir = it != siteEntries.end() && it->second.isDir;
+        if (S_ISDIR(st.st_mode) && wasDir)
+        {
+            it->second.mtime = st.st_mtime; // contents are tracked by its own watch
+        }
+        else
+        {
+            removeTree(rel);
+            SiteEntry e = entryFromStat(rel, st);
+            if (siteEntries.size() >= siteIndexMaxEntries)
+            {
+                // no room, make the parent fall back to the filesystem
+                auto p = siteEntries.find(parentRel);
+                if (p != siteEntries.end())
+                    p->second.complete = false;
+                return;
+            }
+            siteEntries[rel] = e;
+            struct stat lst;
+            if (e.isDir && lstat(fsPath(rel).c_str(), &lst) == 0 && !S_ISLNK(lst.st_mode))
+                indexDirectory(rel);
+        }
+    }
+    updateIndexFile(parentRel);
+}
+
+static bool buildSiteIndex()
+{
+    siteEntries.clear();
+    watchDirs.clear();
+    if (inotifyFd != -1)
+        close(inotifyFd);
+    inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotifyFd == -1)
+    {
+        perror("inotify_init1");
+        return false;
+    }
+
+    struct stat st;
+    if (stat(fsPath("").c_str(), &st) != 0 || !S_ISDIR(st.st_mode))
+    {
+        printf("Site index: %s is not a directory, index disabled.\n", fsPath("").c_str());
+        close(inotifyFd);
+        inotifyFd = -1;
+        return false;
+    }
+    siteEntries[""] = entryFromStat("", st);
+    indexDirectory("");
+    return true;
+}
+
+bool initializeSiteIndex(const string &siteDir)
+{
+    indexRoot = siteDir.empty() ? "." : siteDir;
+    if (!buildSiteIndex())
+        return false;
+    printf("Site index: %zu entries, %zu directories watched%s\n", siteEntries.size(), watchDirs.size(),
+           siteEntries.size() >= siteIndexMaxEntries ? " (entry cap reached, rest served from the filesystem)" : "");
+    return true;
+}
+
+int siteIndexFd()
+{
+    return inotifyFd;
+}
+
+void refreshSiteIndex()
+{
+    if (inotifyFd == -1)
+        return;
+    alignas(struct inotify_event) char buf[16384];
+    for (;;)
+    {
+        ssize_t n = read(inotifyFd, buf, sizeof(buf));
+        if (n <= 0)
+            break; // EAGAIN, drained
+        for (char *p = buf; p < buf + n;)
+        {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            p += sizeof(struct inotify_event) + ev->len;
+
+            if (ev->mask & IN_Q_OVERFLOW)
+            {
+                printf("Site index: inotify queue overflowed, rebuilding.\n");
+                buildSiteIndex();
+                return; // the fd was replaced, old events are meaningless now
+            }
+            auto w = watchDirs.find(ev->wd);
+            if (w == watchDirs.end())
+                continue;
+            if (ev->mask & IN_IGNORED)
+            {
+                watchDirs.erase(w); // dir is gone, its parent's event removes the entries
+                continue;
+            }
+            if (ev->len == 0)
+                continue;
+            string dirRel = w->second;
+            refreshPath(joinRel(dirRel, ev->name), dirRel);
+        }
+    }
+}
+
+SiteLookup lookupSite(const string &relPath, const SiteEntry *&entry)
+{
+    if (inotifyFd == -1)
+        return SiteLookup::Unknown;
+    auto it = siteEntries.find(relPath);
+    if (it != siteEntries.end())
+    {
+        entry = &it->second;
+        return SiteLookup::Found;
+    }
+
+    // not indexed, it only definitely doesn't exist if the nearest indexed ancestor was fully read
+    string parent = relPath;
+    while (!parent.empty())
+    {
+        size_t slash = parent.rfind('/');
+        parent = slash == string::npos ? string() : parent.substr(0, slash);
+        auto p = siteEntries.find(parent);
+        if (p != siteEntries.end())
+            return (!p->second.isDir || p->second.complete) ? SiteLookup::Missing : SiteLookup::Unknown;
+    }
+    return SiteLookup::Unknown;
+}
@@ -0,0 +1,459 @@
+#include "include/sitePack.h"
+#include "include/contentTypes.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <climits>
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+// .fpk layout: header | entries (sorted by path) | strings (NUL terminated) | file data
+// everything is native endian, packs are meant to be built on the box (or arch) that serves them
+static const char packMagic[8] = {'F', 'A', 'U', 'C', 'E', 'T', 'P', 'K'};
+static const uint32_t packVersion = 1;
+
+struct PackHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t entryCount;
+    uint64_t entriesOffset;
+    uint64_t stringsOffset;
+    uint64_t stringsSize;
+    uint64_t dataOffset;
+};
+
+struct PackEntry
+{
+    uint32_t path;        // offset into strings
+    uint32_t contentType; // offset into strings, files only
+    uint32_t flags;
+    uint32_t reserved;
+    int64_t mtime;
+    uint64_t offset, length; // absolute file offsets
+    uint64_t gzOffset, gzLength;
+    uint64_t brOffset, brLength;
+};
+
+static const uint32_t packFlagDir = 1;
+
+static_assert(sizeof(PackHeader) % 8 == 0 && sizeof(PackEntry) % 8 == 0, "pack structs must keep entries 8-byte aligned");
+
+// the mapped pack, only the index part is mapped, file data goes out with sendfile()
+static string packPath;
+static int packFd = -1;
+static void *packMap = nullptr;
+static size_t packMapLen = 0;
+static const PackHeader *packHeader = nullptr;
+static const PackEntry *packEntries = nullptr;
+static const char *packStrings = nullptr;
+static struct stat packStat{};
+static time_t packCheckedAt = 0;
+
+// building
+
+struct PackSource
+{
+    string rel;
+    bool isDir;
+    struct stat st;
+};
+
+static bool writeAll(int fd, const void *buf, size_t len, off_t at)
+{
+    const char *p = (const char *)buf;
+    while (len > 0)
+    {
+        ssize_t w = pwrite(fd, p, len, at);
+        if (w <= 0)
+            return false;
+        p += w;
+        len -= (size_t)w;
+        at += w;
+    }
+    return true;
+}
+
+// copies at most maxLen bytes of path into out at offset at, returns bytes copied or -1
+static off_t copyFileInto(int out, const string &path, off_t maxLen, off_t at)
+{
+    int in = open(path.c_str(), O_RDONLY);
+    if (in == -1)
+        return -1;
+    char buf[65536];
+    off_t copied = 0;
+    while (copied < maxLen)
+    {
+        ssize_t r = read(in, buf, (size_t)min<off_t>(sizeof(buf), maxLen - copied));
+        if (r < 0)
+        {
+            close(in);
+            return -1;
+        }
+        if (r == 0)
+            break; // shrank while packing, keep what we got
+        if (!writeAll(out, buf, (size_t)r, at + copied))
+        {
+            close(in);
+            return -1;
+        }
+        copied += r;
+    }
+    close(in);
+    return copied;
+}
+
+bool buildSitePack(const string &siteDir, const string &outPath)
+{
+    string root = siteDir;
+    while (root.size() > 1 && root.back() == '/')
+        root.pop_back();
+    struct stat rootSt;
+    if (stat(root.c_str(), &rootSt) != 0 || !S_ISDIR(rootSt.st_mode))
+    {
+        printf("Pack: %s is not a directory.\n", root.c_str());
+        return false;
+    }
+
+    // the server resolves every path beneath the site root, so the pack may only hold what it could have served
+    char rootRealBuf[PATH_MAX];
+    if (!realpath(root.c_str(), rootRealBuf))
+    {
+        perror(root.c_str());
+        return false;
+    }
+    string rootReal = rootRealBuf;
+    auto insideRoot = [&rootReal](const string &full)
+    {
+        char target[PATH_MAX];
+        if (!realpath(full.c_str(), target))
+            return false;
+        size_t n = rootReal.size();
+        return strncmp(target, rootReal.c_str(), n) == 0 && (target[n] == '/' || target[n] == '\0' || rootReal == "/");
+    };
+
+    // walk the site, symlinked dirs are packed as plain dirs but not followed (avoids loops)
+    vector<PackSource> sources{{"", true, rootSt}};
+    vector<string> pending{""};
+    while (!pending.empty())
+    {
+        string dirRel = pending.back();
+        pending.pop_back();
+        string dirFull = dirRel.empty() ? root : root + "/" + dirRel;
+        DIR *dir = opendir(dirFull.c_str());
+        if (!dir)
+        {
+            perror(dirFull.c_str());
+            return false;
+        }
+        while (auto *ent = readdir(dir))
+        {
+            if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+                continue;
+            string rel = dirRel.empty() ? string(ent->d_name) : dirRel + "/" + ent->d_name;
+            string full = root + "/" + rel;
+            struct stat st, lst;
+            if (lstat(full.c_str(), &lst) != 0)
+                continue;
+            if (S_ISLNK(lst.st_mode) && !insideRoot(full))
+            {
+                printf("Pack: skipping %s, it links outside %s\n", rel.c_str(), root.c_str());
+                continue;
+            }
+            if (stat(full.c_str(), &st) != 0 || (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode)))
+                continue; // broken symlinks and special files are 404s anyway
+            sources.push_back({rel, S_ISDIR(st.st_mode), st});
+            if (S_ISDIR(st.st_mode) && !S_ISLNK(lst.st_mode))
+                pending.push_back(rel);
+        }
+        closedir(dir);
+    }
+    sort(sources.begin(), sources.end(), [](const PackSource &a, const PackSource &b)
+         { return strcmp(a.rel.c_str(), b.rel.c_str()) < 0; });
+
+    // strings table
+    string strings;
+    vector<PackEntry> entries(sources.size());
+    unordered_map<string, size_t> ctypeOffsets;
+    for (size_t i = 0; i < sources.size(); i++)
+    {
+        PackEntry &e = entries[i];
+        e = PackEntry{};
+        e.path = (uint32_t)strings.size();
+        strings.append(sources[i].rel).push_back('\0');
+        e.flags = sources[i].isDir ? packFlagDir : 0;
+        e.mtime = sources[i].st.st_mtime;
+        if (!sources[i].isDir)
+        {
+            const char *ctype = guessContentType(sources[i].rel.c_str());
+            auto it = ctypeOffsets.find(ctype);
+            if (it == ctypeOffsets.end())
+            {
+                it = ctypeOffsets.emplace(ctype, strings.size()).first;
+                strings.append(ctype).push_back('\0');
+            }
+            e.contentType = (uint32_t)it->second;
+        }
+    }
+    if (strings.size() > UINT32_MAX)
+    {
+        printf("Pack: too many paths.\n");
+        return false;
+    }
+
+    PackHeader header{};
+    memcpy(header.magic, packMagic, sizeof(packMagic));
+    header.version = packVersion;
+    header.entryCount = (uint32_t)entries.size();
+    header.entriesOffset = sizeof(PackHeader);
+    header.stringsOffset = header.entriesOffset + entries.size() * sizeof(PackEntry);
+    header.stringsSize = strings.size();
+    header.dataOffset = (header.stringsOffset + strings.size() + 4095) & ~(uint64_t)4095; // data starts page aligned
+
+    string tmpPath = outPath + ".tmp";
+    int out = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out == -1)
+    {
+        perror(tmpPath.c_str());
+        return false;
+    }
+
+    // file data first, the index is written once the offsets are known
+    off_t at = (off_t)header.dataOffset;
+    bool ok = true;
+    for (size_t i = 0; i < sources.size() && ok; i++)
+    {
+        if (sources[i].isDir)
+            continue;
+        off_t copied = copyFileInto(out, root + "/" + sources[i].rel, sources[i].st.st_size, at);
+        if (copied < 0)
+        {
+            perror(sources[i].rel.c_str());
+            ok = false;
+            break;
+        }
+        entries[i].offset = (uint64_t)at;
+        entries[i].length = (uint64_t)copied;
+        at += copied;
+    }
+
+    // link foo.gz / foo.br next to foo as its precompressed variants
+    if (ok)
+    {
+        unordered_map<string, size_t> byPath;
+        for (size_t i = 0; i < sources.size(); i++)
+            if (!sources[i].isDir)
+                byPath[sources[i].rel] = i;
+        for (size_t i = 0; i < sources.size(); i++)
+        {
+            if (sources[i].isDir)
+                continue;
+            auto gz = byPath.find(sources[i].rel + ".gz");
+            if (gz != byPath.end())
+            {
+                entries[i].gzOffset = entries[gz->second].offset;
+                entries[i].gzLength = entries[gz->second].length;
+            }
+            auto br = byPath.find(sources[i].rel + ".br");
+            if (br != byPath.end())
+            {
+                entries[i].brOffset = entries[br->second].offset;
+                entries[i].brLength = entries[br->second].length;
+            }
+        }
+    }
+
+    ok = ok && writeAll(out, &header, sizeof(header), 0) &&
+         writeAll(out, entries.data(), entries.size() * sizeof(PackEntry), (off_t)header.entriesOffset) &&
+         writeAll(out, strings.data(), strings.size(), (off_t)header.stringsOffset) &&
+         ftruncate(out, max<off_t>(at, (off_t)header.dataOffset)) == 0 && fsync(out) == 0;
+    if (close(out) != 0)
+        ok = false;
+    if (!ok || rename(tmpPath.c_str(), outPath.c_str()) != 0)
+    {
+        perror("pack");
+        unlink(tmpPath.c_str());
+        return false;
+    }
+    printf("Packed %zu paths (%lld bytes) from %s into %s\n", sources.size(), (long long)at, root.c_str(), outPath.c_str());
+    return true;
+}
+
+// serving
+
+static void unmapPack()
+{
+    if (packMap)
+        munmap(packMap, packMapLen);
+    if (packFd != -1)
+        close(packFd);
+    packMap = nullptr;
+    packMapLen = 0;
+    packFd = -1;
+    packHeader = nullptr;
+    packEntries = nullptr;
+    packStrings = nullptr;
+}
+
+// checks everything the lookups rely on, so a truncated or foreign file can't send us out of bounds
+static bool validatePack(const void *map, size_t mapLen, off_t fileSize)
+{
+    if (mapLen < sizeof(PackHeader))
+        return false;
+    const PackHeader *h = (const PackHeader *)map;
+    if (memcmp(h->magic, packMagic, sizeof(packMagic)) != 0 || h->version != packVersion)
+        return false;
+    // header fields are untrusted 64-bit values, compare against what's left instead of adding so nothing can wrap
+    uint64_t entriesSize = (uint64_t)h->entryCount * sizeof(PackEntry); // 32-bit count, can't overflow
+    if (h->entriesOffset != sizeof(PackHeader) ||
+        entriesSize > mapLen - h->entriesOffset ||
+        h->stringsOffset != h->entriesOffset + entriesSize ||
+        h->stringsSize == 0 || h->stringsOffset > mapLen || h->stringsSize > mapLen - h->stringsOffset)
+        return false;
+    const char *strings = (const char *)map + h->stringsOffset;
+    if (strings[h->stringsSize - 1] != '\0')
+        return false;
+
+    const PackEntry *entries = (const PackEntry *)((const char *)map + h->entriesOffset);
+    uint64_t size = (uint64_t)fileSize;
+    for (uint32_t i = 0; i < h->entryCount; i++)
+    {
+        const PackEntry &e = entries[i];
+        if (e.path >= h->stringsSize || e.contentType >= h->stringsSize)
+            return false;
+        if (e.offset > size || e.length > size - e.offset ||
+            e.gzOffset > size || e.gzLength > size - e.gzOffset ||
+            e.brOffset > size || e.brLength > size - e.brOffset)
+            return false;
+        if (i > 0 && strcmp(strings + entries[i - 1].path, strings + e.path) >= 0)
+            return false; // lookups binary search, must be strictly sorted
+    }
+    return true;
+}
+
+static bool loadPack()
+{
+    int fd = open(packPath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        perror(packPath.c_str());
+        return false;
+    }
+    struct stat st{};
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size < (off_t)sizeof(PackHeader))
+    {
+        printf("Site pack %s is not a valid pack.\n", packPath.c_str());
+        close(fd);
+        return false;
+    }
+
+    // map only up to the data, file contents are never touched in userspace
+    PackHeader h;
+    if (pread(fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h) || h.dataOffset > (uint64_t)st.st_size || h.dataOffset < sizeof(h))
+    {
+        printf("Site pack %s is not a valid pack.\n", packPath.c_str());
+        close(fd);
+        return false;
+    }
+    size_t mapLen = (size_t)h.dataOffset;
+    void *map = mmap(nullptr, mapLen, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+    {
+        perror("mmap");
+        close(fd);
+        return false;
+    }
+    if (!validatePack(map, mapLen, st.st_size))
+    {
+        printf("Site pack %s is not a valid pack.\n", packPath.c_str());
+        munmap(map, mapLen);
+        close(fd);
+        return false;
+    }
+
+    unmapPack();
+    packFd = fd;
+    packMap = map;
+    packMapLen = mapLen;
+    packHeader = (const PackHeader *)map;
+    packEntries = (const PackEntry *)((const char *)map + packHeader->entriesOffset);
+    packStrings = (const char *)map + packHeader->stringsOffset;
+    return true;
+}
+
+bool initializeSitePack(const string &path)
+{
+    packPath = path;
+    stat(packPath.c_str(), &packStat);
+    packCheckedAt = time(nullptr);
+    if (!loadPack())
+        return false;
+    printf("Site pack: %u paths from %s\n", packHeader->entryCount, packPath.c_str());
+    return true;
+}
+
+bool sitePackActive()
+{
+    return packHeader != nullptr;
+}
+
+int sitePackFd()
+{
+    return packFd;
+}
+
+bool refreshSitePack()
+{
+    time_t now = time(nullptr);
+    if (!packHeader || now == packCheckedAt)
+        return false;
+    packCheckedAt = now;
+
+    struct stat st{};
+    if (stat(packPath.c_str(), &st) != 0)
+        return false; // mid-swap or removed, keep serving what we have
+    if (st.st_ino == packStat.st_ino && st.st_dev == packStat.st_dev &&
+        st.st_size == packStat.st_size && st.st_mtim.tv_sec == packStat.st_mtim.tv_sec &&
+        st.st_mtim.tv_nsec == packStat.st_mtim.tv_nsec)
+        return false;
+    packStat = st; // remember even if it's broken, so it isn't retried until it changes again
+    if (!loadPack())
+    {
+        printf("Site pack %s changed but couldn't be loaded, still serving the previous one.\n", packPath.c_str());
+        return false;
+    }
+    printf("Site pack reloaded: %u paths\n", packHeader->entryCount);
+    return true;
+}
+
+bool findPackFile(const string &relPath, PackFile &out)
+{
+    if (!packHeader)
+        return false;
+    const PackEntry *first = packEntries;
+    const PackEntry *last = packEntries + packHeader->entryCount;
+    const PackEntry *it = lower_bound(first, last, relPath.c_str(), [](const PackEntry &e, const char *key)
+                                      { return strcmp(packStrings + e.path, key) < 0; });
+    if (it == last || strcmp(packStrings + it->path, relPath.c_str()) != 0)
+        return false;
+
+    out.isDir = it->flags & packFlagDir;
+    out.offset = (off_t)it->offset;
+    out.length = (off_t)it->length;
+    out.mtime = (time_t)it->mtime;
+    out.contentType = packStrings + it->contentType;
+    out.gzOffset = (off_t)it->gzOffset;
+    out.gzLength = (off_t)it->gzLength;
+    out.brOffset = (off_t)it->brOffset;
+    out.brLength = (off_t)it->brLength;
+    return true;
+}
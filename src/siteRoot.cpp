@@ -0,0 +1,74 @@
+#include "include/siteRoot.h"
+#include <linux/openat2.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+
+using namespace std;
+
+static int siteRootFd = -1;
+static bool haveOpenat2 = true; // cleared the first time the kernel says ENOSYS
+
+bool openSiteRoot(const string &siteDir)
+{
+    if (siteRootFd != -1)
+        close(siteRootFd);
+    siteRootFd = open(siteDir.empty() ? "." : siteDir.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (siteRootFd == -1)
+    {
+        perror(siteDir.c_str());
+        return false;
+    }
+    return true;
+}
+
+// fallback containment check for kernels without openat2 (pre 5.6), no absolute paths and no ".." segments
+static bool staysBeneath(const char *rel)
+{
+    if (rel[0] == '/')
+        return false;
+    for (const char *seg = rel; *seg;)
+    {
+        const char *end = strchr(seg, '/');
+        size_t len = end ? (size_t)(end - seg) : strlen(seg);
+        if (len == 2 && seg[0] == '.' && seg[1] == '.')
+            return false;
+        if (!end)
+            break;
+        seg = end + 1;
+    }
+    return true;
+}
+
+int openInSite(const char *rel, int flags)
+{
+    if (siteRootFd == -1)
+    {
+        errno = ENOENT;
+        return -1;
+    }
+    if (rel[0] == '\0')
+        rel = ".";
+    flags |= O_CLOEXEC;
+
+    if (haveOpenat2)
+    {
+        struct open_how how{};
+        how.flags = (unsigned long long)flags;
+        how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+        int fd = (int)syscall(SYS_openat2, siteRootFd, rel, &how, sizeof(how));
+        if (fd != -1 || errno != ENOSYS)
+            return fd;
+        haveOpenat2 = false;
+    }
+
+    if (!staysBeneath(rel))
+    {
+        errno = EXDEV; // same as openat2 reports for escapes
+        return -1;
+    }
+    return openat(siteRootFd, rel, flags);
+}
@@ -0,0 +1,111 @@
+#include "include/topTraffic.h"
+#include "include/spaceSaving.h"
+#include "include/jsonString.h"
+#include <ctime>
+
+using namespace std;
+
+static const size_t topCapacity = 64;   // counters per summary, anything above 1/64th of a window's traffic is guaranteed in
+static const size_t topReported = 20;   // entries shown per summary on the status endpoint
+static const size_t topKeyMaxLen = 200; // longer paths/User-Agents are truncated, they'd only make attackers' keys unique
+static const time_t topWindowSeconds = 60;
+
+// the running window and the last complete one, rotated on minute boundaries
+template <typename Key, typename Hash = std::hash<Key>>
+struct WindowedTop
+{
+    SpaceSaving<Key, Hash> current{topCapacity};
+    SpaceSaving<Key, Hash> previous{topCapacity};
+    time_t window = 0;
+
+    void rotate(time_t now)
+    {
+        time_t w = now / topWindowSeconds;
+        if (w == window)
+            return;
+        if (w == window + 1)
+            swap(current, previous);
+        else
+            previous.clear(); // idle for longer than a window, nothing recent to show
+        current.clear();
+        window = w;
+    }
+
+    void add(const Key &key)
+    {
+        rotate(time(nullptr));
+        current.add(key);
+    }
+};
+
+static WindowedTop<IpAddr, IpAddrHash> topClients;
+static WindowedTop<string> topPaths;
+static WindowedTop<string> topUserAgents;
+static WindowedTop<string> topNotFound;
+
+static string truncated(const string &s)
+{
+    return s.size() <= topKeyMaxLen ? s : s.substr(0, topKeyMaxLen);
+}
+
+void noteClient(const IpAddr &ip)
+{
+    topClients.add(ip);
+}
+
+void noteRequest(const string &key, const string &userAgent)
+{
+    topPaths.add(truncated(key));
+    topUserAgents.add(truncated(userAgent));
+}
+
+void noteNotFound(const string &key)
+{
+    topNotFound.add(truncated(key));
+}
+
+static string displayKey(const IpAddr &ip) { return ipToString(ip); }
+static string displayKey(const string &key) { return key; }
+
+template <typename Key, typename Hash>
+static void appendSummary(string &out, const SpaceSaving<Key, Hash> &summary, const char *prefix)
+{
+    out += "{\"total\":" + to_string(summary.totalCount()) + ",\"top\":[";
+    size_t shown = 0;
+    for (const auto &e : summary.entries())
+    {
+        if (shown == topReported)
+            break;
+        if (shown++)
+            out += ',';
+        out += "{\"key\":";
+        appendJsonString(out, prefix + displayKey(e.key));
+        out += ",\"count\":" + to_string(e.count) + ",\"error\":" + to_string(e.error) + "}";
+    }
+    out += "]}";
+}
+
+template <typename Key, typename Hash>
+static void appendWindowed(string &out, const char *name, WindowedTop<Key, Hash> &top, const char *prefix, time_t now)
+{
+    top.rotate(now);
+    out += ",\"";
+    out += name;
+    out += "\":{\"current\":";
+    appendSummary(out, top.current, prefix);
+    out += ",\"previous\":";
+    appendSummary(out, top.previous, prefix);
+    out += "}";
+}
+
+string topTrafficJson()
+{
+    time_t now = time(nullptr);
+    string out = "{\"window\":" + to_string(topWindowSeconds) + ",\"windowStart\":" + to_string(now - now % topWindowSeconds);
+    appendWindowed(out, "clients", topClients, "", now);
+    appendWindowed(out, "paths", topPaths, "/", now);
+    appendWindowed(out, "userAgents", topUserAgents, "", now);
+    appendWindowed(out, "notFound", topNotFound, "/", now);
+    out += "}";
+    return out;
+}
@@ -0,0 +1,395 @@
+#include "include/trustRules.h"
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string_view>
+#include <strings.h>
+
+using namespace std;
+
+static const char *featureNames[TrustFeatureCount] = {
+    "ua.missing", "ua.suspicious", "ua.trusted", "ua.unknown",
+    "platform.legit", "platform.unknown", "platform.other",
+    "referer",
+    "encoding.known", "encoding.other", "encoding.missing",
+    "ip.public", "ip.private", "ip.loopback", "ip.datacenter",
+    "honeypot.hit"};
+
+static const char *counterNames[TrustCounterCount] = {"rpm", "honeypots", "notfound", "timeouts"};
+
+static bool takesTokens(int feature)
+{
+    return feature == UaSuspicious || feature == UaTrusted || feature == PlatformLegit ||
+           feature == PlatformUnknown || feature == EncodingKnown;
+}
+
+// the rules faucet always had, trustRules.txt lines override them
+static const char *defaultRules =
+    "base 30\n"
+    "ua.missing -20\n"
+    "ua.suspicious -10 curl wget python-requests libwww-perl java php ruby scrapy httpclient go-http-client\n"
+    "ua.trusted 10 Mozilla Chrome Safari Edge Firefox Opera AppleWebKit Gecko\n"
+    "ua.unknown -10\n"
+    "platform.legit 5 Windows Linux macOS Android iOS \"Chrome OS\" \"Chromium OS\"\n"
+    "platform.unknown 0 Unknown\n"
+    "platform.other -5\n"
+    "referer 5\n"
+    "encoding.known 5 gzip deflate br zstd\n"
+    "encoding.missing -5\n"
+    "ip.private 15\n"
+    "ip.loopback 35\n"
+    "ip.datacenter -15\n"
+    "honeypot.hit -35\n"
+    "rpm 26 -5\n"
+    "rpm 46 -10\n"
+    "rpm 61 -20\n"
+    "honeypots 2 -10\n"
+    "honeypots 4 -25\n"
+    "honeypots 6 -40\n"
+    "honeypots 7 -65\n"
+    "notfound 11 -10\n"
+    "notfound 21 -20\n"
+    "notfound 31 -35\n"
+    "timeouts 2 -15\n"
+    "timeouts 4 -35\n"
+    "timeouts 8 -65\n";
+
+// splits on spaces/tabs, "double quotes" keep spaces in a token, # starts a comment
+static vector<string> splitRuleLine(const char *line)
+{
+    vector<string> words;
+    const char *p = line;
+    for (;;)
+    {
+        while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+            p++;
+        if (!*p || *p == '#')
+            break;
+        string word;
+        if (*p == '"')
+        {
+            p++;
+            while (*p && *p != '"')
+                word += *p++;
+            if (*p == '"')
+                p++;
+        }
+        else
+        {
+            while (*p && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n')
+                word += *p++;
+        }
+        words.push_back(word);
+    }
+    return words;
+}
+
+static bool parseInt(const string &s, int &out)
+{
+    char *end;
+    long v = strtol(s.c_str(), &end, 10);
+    if (s.empty() || *end || v < -1000 || v > 1000000)
+        return false;
+    out = (int)v;
+    return true;
+}
+
+// applies one line on top of into, bandsSeen tracks which counters already dropped their old bands
+static bool applyRuleLine(const char *line, TrustRules &into, bool bandsSeen[TrustCounterCount], const char *source, int lineNo)
+{
+    vector<string> words = splitRuleLine(line);
+    if (words.empty())
+        return true;
+
+    if (words[0] == "base")
+    {
+        if (words.size() == 2 && parseInt(words[1], into.base))
+            return true;
+        printf("%s:%d: expected base <score>\n", source, lineNo);
+        return false;
+    }
+
+    for (int f = 0; f < TrustFeatureCount; f++)
+    {
+        if (words[0] != featureNames[f])
+            continue;
+        if (words.size() < 2 || !parseInt(words[1], into.weights[f]))
+        {
+            printf("%s:%d: expected %s <weight>%s\n", source, lineNo, featureNames[f], takesTokens(f) ? " <tokens...>" : "");
+            return false;
+        }
+        if (!takesTokens(f) && words.size() > 2)
+        {
+            printf("%s:%d: %s takes no tokens\n", source, lineNo, featureNames[f]);
+            return false;
+        }
+        if (takesTokens(f))
+            into.tokens[f].assign(words.begin() + 2, words.end());
+        return true;
+    }
+
+    for (int c = 0; c < TrustCounterCount; c++)
+    {
+        if (words[0] != counterNames[c])
+            continue;
+        TrustBand band;
+        if (words.size() != 3 || !parseInt(words[1], band.min) || !parseInt(words[2], band.weight) || band.min < 1)
+        {
+            printf("%s:%d: expected %s <min, at least 1> <weight>\n", source, lineNo, counterNames[c]);
+            return false;
+        }
+        if (!bandsSeen[c])
+        {
+            into.bands[c].clear(); // the file's bands replace the defaults as a whole
+            bandsSeen[c] = true;
+        }
+        into.bands[c].push_back(band);
+        return true;
+    }
+
+    printf("%s:%d: unknown rule %s\n", source, lineNo, words[0].c_str());
+    return false;
+}
+
+static void finishRules(TrustRules &r)
+{
+    for (auto &bands : r.bands)
+    {
+        sort(bands.begin(), bands.end(), [](const TrustBand &a, const TrustBand &b)
+             { return a.min < b.min; });
+        // bands are reported as uint8_t indexes, nobody needs more than a handful
+        if (bands.size() > 255)
+            bands.resize(255);
+    }
+}
+
+static TrustRules compileDefaults()
+{
+    TrustRules r{};
+    bool bandsSeen[TrustCounterCount] = {};
+    const char *p = defaultRules;
+    int lineNo = 0;
+    while (*p)
+    {
+        const char *end = strchr(p, '\n');
+        string line(p, end - p);
+        applyRuleLine(line.c_str(), r, bandsSeen, "defaults", ++lineNo);
+        p = end + 1;
+    }
+    finishRules(r);
+    return r;
+}
+
+// lowest band min per counter, atomics because the 404 counting on the main thread reads them while
+// ASYNC_TRUST reloads the rules on its worker
+static atomic<int> firstBandMins[TrustCounterCount];
+
+static void publishFirstBands(const TrustRules &r)
+{
+    for (int c = 0; c < TrustCounterCount; c++)
+        firstBandMins[c].store(r.bands[c].empty() ? INT_MAX : r.bands[c].front().min, memory_order_relaxed);
+}
+
+static TrustRules initialRules()
+{
+    TrustRules r = compileDefaults();
+    publishFirstBands(r);
+    return r;
+}
+
+static TrustRules rules = initialRules();
+
+void loadTrustRules()
+{
+    // if trustRules.txt exists in same dir as exe, its lines override the defaults
+    FILE *file = fopen("trustRules.txt", "r");
+    if (!file)
+    {
+        printf("trustRules.txt not found, using default trust rules\n");
+        rules = compileDefaults();
+        publishFirstBands(rules);
+        return;
+    }
+
+    TrustRules loaded = compileDefaults();
+    bool bandsSeen[TrustCounterCount] = {};
+    bool ok = true;
+    int lineNo = 0;
+    size_t ruleCount = 0;
+    char line[4096];
+    while (fgets(line, sizeof(line), file))
+    {
+        lineNo++;
+        if (!applyRuleLine(line, loaded, bandsSeen, "trustRules.txt", lineNo))
+            ok = false;
+        else if (!splitRuleLine(line).empty())
+            ruleCount++;
+    }
+    fclose(file);
+
+    if (!ok)
+    {
+        printf("trustRules.txt has errors, keeping the previous trust rules\n");
+        return;
+    }
+    finishRules(loaded);
+    rules = loaded;
+    publishFirstBands(rules);
+    printf("Loaded %zu trust rules from trustRules.txt\n", ruleCount);
+}
+
+const TrustRules &trustRules()
+{
+    return rules;
+}
+
+int firstTrustBand(TrustCounter counter)
+{
+    return firstBandMins[counter].load(memory_order_relaxed);
+}
+
+static bool containsAny(const char *value, size_t len, const vector<string> &tokens)
+{
+    string_view v(value, len);
+    for (const auto &token : tokens)
+    {
+        if (v.find(token) != string_view::npos)
+            return true;
+    }
+    return false;
+}
+
+uint32_t extractTrustFeatures(const string &headers, IpClass ipClass, bool honeypotHit)
+{
+    // one pass over the header lines, picking out the values the rules look at
+    const char *userAgent = nullptr, *platform = nullptr, *encoding = nullptr;
+    size_t userAgentLen = 0, platformLen = 0, encodingLen = 0;
+    bool referer = false;
+    size_t pos = headers.find("\r\n");
+    while (pos != string::npos)
+    {
+        size_t start = pos + 2;
+        pos = headers.find("\r\n", start);
+        size_t end = pos == string::npos ? headers.size() : pos;
+        size_t colon = headers.find(':', start);
+        if (colon == string::npos || colon > end)
+            continue;
+        const char *name = headers.data() + start;
+        size_t nameLen = colon - start;
+        size_t valueStart = colon + 1;
+        while (valueStart < end && (headers[valueStart] == ' ' || headers[valueStart] == '\t'))
+            valueStart++;
+        const char *value = headers.data() + valueStart;
+        size_t valueLen = end - valueStart;
+        if (nameLen == 10 && strncasecmp(name, "User-Agent", 10) == 0)
+            userAgent = value, userAgentLen = valueLen;
+        else if (nameLen == 18 && strncasecmp(name, "sec-ch-ua-platform", 18) == 0)
+            platform = value, platformLen = valueLen;
+        else if (nameLen == 15 && strncasecmp(name, "Accept-Encoding", 15) == 0)
+            encoding = value, encodingLen = valueLen;
+        else if (nameLen == 7 && strncasecmp(name, "Referer", 7) == 0)
+            referer = true;
+    }
+
+    uint32_t features = 0;
+    auto set = [&features](TrustFeature f)
+    { features |= 1u << f; };
+
+    if (!userAgent || userAgentLen == 0)
+        set(UaMissing);
+    if (userAgent && containsAny(userAgent, userAgentLen, rules.tokens[UaSuspicious]))
+        set(UaSuspicious);
+    else if (userAgent && containsAny(userAgent, userAgentLen, rules.tokens[UaTrusted]))
+        set(UaTrusted);
+    else
+        set(UaUnknown);
+
+    if (platform)
+    {
+        if (containsAny(platform, platformLen, rules.tokens[PlatformLegit]))
+            set(PlatformLegit);
+        else if (containsAny(platform, platformLen, rules.tokens[PlatformUnknown]))
+            set(PlatformUnknown);
+        else
+            set(PlatformOther);
+    }
+
+    if (referer)
+        set(HasReferer);
+
+    if (!encoding)
+        set(EncodingMissing);
+    else if (containsAny(encoding, encodingLen, rules.tokens[EncodingKnown]))
+        set(EncodingKnown);
+    else
+        set(EncodingOther);
+
+    switch (ipClass)
+    {
+    case IpClass::Public:
+        set(IpPublic);
+        break;
+    case IpClass::Private:
+        set(IpPrivate);
+        break;
+    case IpClass::Loopback:
+        set(IpLoopback);
+        break;
+    case IpClass::Datacenter:
+        set(IpDatacenter);
+        break;
+    }
+
+    if (honeypotHit)
+        set(HoneypotHit);
+    return features;
+}
+
+uint8_t trustBand(TrustCounter counter, int value)
+{
+    const auto &bands = rules.bands[counter];
+    uint8_t band = 0;
+    while (band < bands.size() && value >= bands[band].min)
+        band++;
+    return band;
+}
+
+int scoreTrust(uint32_t features, const uint8_t bands[TrustCounterCount])
+{
+    int score = rules.base;
+    for (int f = 0; f < TrustFeatureCount; f++)
+    {
+        if (features & (1u << f))
+            score += rules.weights[f];
+    }
+    for (int c = 0; c < TrustCounterCount; c++)
+    {
+        if (bands[c] > 0 && bands[c] <= rules.bands[c].size())
+            score += rules.bands[c][bands[c] - 1].weight;
+    }
+    return max(0, min(100, score));
+}
+
+string explainTrust(uint32_t features, const uint8_t bands[TrustCounterCount])
+{
+    string out = "base " + to_string(rules.base);
+    auto signedWeight = [](int w)
+    { return (w >= 0 ? "+" : "") + to_string(w); };
+    for (int f = 0; f < TrustFeatureCount; f++)
+    {
+        if (features & (1u << f))
+            out += string(", ") + featureNames[f] + " " + signedWeight(rules.weights[f]);
+    }
+    for (int c = 0; c < TrustCounterCount; c++)
+    {
+        if (bands[c] > 0 && bands[c] <= rules.bands[c].size())
+        {
+            const TrustBand &band = rules.bands[c][bands[c] - 1];
+            out += string(", ") + counterNames[c] + ">=" + to_string(band.min) + " " + signedWeight(band.weight);
+        }
+    }
+    return out;
+}
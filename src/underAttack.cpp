@@ -0,0 +1,151 @@
+#include "include/underAttack.h"
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+
+using namespace std;
+
+static const int rateBuckets = 6;          // per-minute rates over six 10 second buckets
+static const int bucketSeconds = 10;
+static const time_t calmSecondsToLeave = 60; // both rates under half their threshold for this long
+
+// events per minute over a sliding window, coarse but O(1) and allocation free
+struct GlobalRate
+{
+    uint32_t counts[rateBuckets] = {};
+    time_t epochs[rateBuckets] = {};
+
+    void add(time_t now)
+    {
+        time_t epoch = now / bucketSeconds;
+        int b = (int)(epoch % rateBuckets);
+        if (epochs[b] != epoch)
+        {
+            counts[b] = 0; // aged out
+            epochs[b] = epoch;
+        }
+        counts[b]++;
+    }
+
+    uint32_t perMinute(time_t now) const
+    {
+        time_t epoch = now / bucketSeconds;
+        uint32_t total = 0;
+        for (int b = 0; b < rateBuckets; b++)
+        {
+            if (epoch - epochs[b] < rateBuckets)
+                total += counts[b];
+        }
+        return total;
+    }
+};
+
+static GlobalRate notFoundRate;
+static GlobalRate blockRate;
+static int notFoundThreshold = 0;
+static int blockThreshold = 0;
+static int logSampleEvery = 100;
+static int attackRateLimit = 0;
+
+static atomic<bool> active{false};
+static time_t activeSince = 0;
+static time_t calmSince = 0; // while active, when both rates dropped under half their threshold, 0 if they haven't
+static unsigned long timesEntered = 0;
+static unsigned long timesLeft = 0;
+static unsigned long logLinesSeen = 0;
+static unsigned long logLinesDropped = 0;
+
+void initializeUnderAttack(int notFoundPerMinute, int blocksPerMinute, int logSample, int rateLimit)
+{
+    notFoundThreshold = notFoundPerMinute;
+    blockThreshold = blocksPerMinute;
+    logSampleEvery = logSample > 0 ? logSample : 1;
+    attackRateLimit = rateLimit;
+}
+
+void noteGlobalNotFound()
+{
+    notFoundRate.add(time(nullptr));
+}
+
+void noteGlobalBlock()
+{
+    blockRate.add(time(nullptr));
+}
+
+void updateUnderAttack()
+{
+    if (notFoundThreshold <= 0 && blockThreshold <= 0)
+        return;
+    time_t now = time(nullptr);
+    uint32_t notFound = notFoundRate.perMinute(now);
+    uint32_t blocks = blockRate.perMinute(now);
+
+    if (!active)
+    {
+        bool notFoundSpike = notFoundThreshold > 0 && notFound >= (uint32_t)notFoundThreshold;
+        bool blockSpike = blockThreshold > 0 && blocks >= (uint32_t)blockThreshold;
+        if (!notFoundSpike && !blockSpike)
+            return;
+        active = true;
+        activeSince = now;
+        calmSince = 0;
+        timesEntered++;
+        printf("Under attack (%u 404s/min, %u blocked/min): no directory listings, minimal error pages, logging 1 in %d\n",
+               notFound, blocks, logSampleEvery);
+        return;
+    }
+
+    // hysteresis, leave only after a calm stretch well under the thresholds so it doesn't flap around them
+    bool notFoundCalm = notFoundThreshold <= 0 || notFound < (uint32_t)notFoundThreshold / 2;
+    bool blockCalm = blockThreshold <= 0 || blocks < (uint32_t)blockThreshold / 2;
+    if (!notFoundCalm || !blockCalm)
+    {
+        calmSince = 0;
+        return;
+    }
+    if (calmSince == 0)
+        calmSince = now;
+    if (now - calmSince < calmSecondsToLeave)
+        return;
+    active = false;
+    timesLeft++;
+    printf("Attack over after %lds, %lu log lines were dropped\n", (long)(now - activeSince), logLinesDropped);
+    logLinesDropped = 0;
+}
+
+bool underAttack()
+{
+    return active.load(memory_order_relaxed);
+}
+
+bool keepLogLine()
+{
+    if (!underAttack())
+        return true;
+    if (logLinesSeen++ % logSampleEvery == 0)
+        return true;
+    logLinesDropped++;
+    return false;
+}
+
+int currentRateLimit(int requestRateLimit)
+{
+    if (!underAttack() || attackRateLimit <= 0)
+        return requestRateLimit;
+    if (requestRateLimit > 0 && requestRateLimit < attackRateLimit)
+        return requestRateLimit; // already stricter
+    return attackRateLimit;
+}
+
+string underAttackJson()
+{
+    time_t now = time(nullptr);
+    return "{\"active\":" + string(underAttack() ? "true" : "false") +
+           ",\"since\":" + to_string(underAttack() ? activeSince : 0) +
+           ",\"entered\":" + to_string(timesEntered) +
+           ",\"left\":" + to_string(timesLeft) +
+           ",\"notFoundPerMinute\":" + to_string(notFoundRate.perMinute(now)) +
+           ",\"blockedPerMinute\":" + to_string(blockRate.perMinute(now)) + "}";
+}